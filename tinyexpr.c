@@ -23,6 +23,11 @@
  * 3. This notice may not be removed or altered from any source distribution.
  */
 
+/* This is an altered version of TinyExpr for txtML: te_is_builtin(), the arena
+   (te_compile_arena()), the perfect hash of builtins and the bytecode (te_lower(),
+   te_lower_function(), te_run(), te_run_args(), te_run_batch(), te_program_free())
+   are added. */
+
 /* COMPILE TIME OPTIONS */
 
 /* Exponentiation associativity:
@@ -72,6 +77,8 @@ typedef struct state {
 
     const te_variable *lookup;
     int lookup_len;
+
+    te_arena *arena; /* NULL - nodes are malloc'ed */
 } state;
 
 
@@ -81,14 +88,53 @@ typedef struct state {
 #define IS_FUNCTION(TYPE) (((TYPE) & TE_FUNCTION0) != 0)
 #define IS_CLOSURE(TYPE) (((TYPE) & TE_CLOSURE0) != 0)
 #define ARITY(TYPE) ( ((TYPE) & (TE_FUNCTION0 | TE_CLOSURE0)) ? ((TYPE) & 0x00000007) : 0 )
-#define NEW_EXPR(type, ...) new_expr((type), (const te_expr*[]){__VA_ARGS__})
+#define NEW_EXPR(type, ...) new_expr(s->arena, (type), (const te_expr*[]){__VA_ARGS__})
 #define CHECK_NULL(ptr, ...) if ((ptr) == NULL) { __VA_ARGS__; return NULL; }
 
-static te_expr *new_expr(const int type, const te_expr *parameters[]) {
+/* Nodes of an arena are 8-byte aligned. When the buffer is full, the arena
+ * goes on in malloc'ed blocks, the first pointer of a block links the previous one. */
+#define TE_ARENA_BLOCK 16384
+
+void te_arena_init(te_arena *arena, void *buffer, size_t size) {
+    arena->start = arena->buffer = buffer;
+    arena->start_size = arena->size = buffer ? size : 0;
+    arena->used = 0;
+    arena->blocks = NULL;
+}
+
+
+static void *arena_alloc(te_arena *arena, size_t size) {
+    size_t pos = (arena->used + 7) & ~(size_t)7;
+    if (pos + size > arena->size) {
+        const size_t block_size = sizeof(void*) + (size > TE_ARENA_BLOCK ? size : TE_ARENA_BLOCK);
+        char *block = malloc(block_size);
+        if (!block) return NULL;
+        *(void**)block = arena->blocks;
+        arena->blocks = block;
+        arena->buffer = block + sizeof(void*);
+        arena->size = block_size - sizeof(void*);
+        pos = 0;
+    }
+    arena->used = pos + size;
+    return arena->buffer + pos;
+}
+
+
+void te_arena_release(te_arena *arena) {
+    while (arena->blocks) {
+        void *prev = *(void**)arena->blocks;
+        free(arena->blocks);
+        arena->blocks = prev;
+    }
+    te_arena_init(arena, arena->start, arena->start_size);
+}
+
+
+static te_expr *new_expr(te_arena *arena, const int type, const te_expr *parameters[]) {
     const int arity = ARITY(type);
     const int psize = sizeof(void*) * arity;
     const int size = (sizeof(te_expr) - sizeof(void*)) + psize + (IS_CLOSURE(type) ? sizeof(void*) : 0);
-    te_expr *ret = malloc(size);
+    te_expr *ret = arena ? arena_alloc(arena, size) : malloc(size);
     CHECK_NULL(ret);
 
     memset(ret, 0, size);
@@ -160,7 +206,7 @@ static double npr(double n, double r) {return ncr(n, r) * fac(r);}
 #endif
 
 static const te_variable functions[] = {
-        /* must be in alphabetical order */
+        /* must be in alphabetical order, builtin_slots has their indexes */
         {"abs", fabs,     TE_FUNCTION1 | TE_FLAG_PURE, 0},
         {"acos", acos,    TE_FUNCTION1 | TE_FLAG_PURE, 0},
         {"asin", asin,    TE_FUNCTION1 | TE_FLAG_PURE, 0},
@@ -192,25 +238,30 @@ static const te_variable functions[] = {
         {0, 0, 0, 0}
 };
 
+/* Perfect hash of the builtin names (txtML): every name of functions[] has its own
+ * slot, which holds the index of the name (-1 - no name). Update the slots when
+ * functions[] changes. */
+static const signed char builtin_slots[64] = {
+     1, 11, 18, -1, -1, 21, -1, -1, -1, -1, -1, -1,  4, -1, 13, 16,
+    10, -1, 23, -1, -1, -1, -1, -1, -1,  6, -1, 22, -1,  7, -1, 14,
+    -1, 20, -1, -1, -1,  5, -1, -1,  9, -1, 19, -1, 12,  2, -1,  3,
+    -1, -1, -1, 17, -1, 15, -1, -1, -1,  8, -1, -1, -1,  0, -1, -1
+};
+
+static int builtin_hash(const char *name, int len) {
+    const unsigned char *n = (const unsigned char*)name;
+    return (n[0] + (len > 1 ? n[1] : 0) * 2 + n[len - 1] * 23 + len) % 64;
+}
+
 static const te_variable *find_builtin(const char *name, int len) {
-    int imin = 0;
-    int imax = sizeof(functions) / sizeof(te_variable) - 2;
-
-    /*Binary search.*/
-    while (imax >= imin) {
-        const int i = (imin + ((imax-imin)/2));
-        int c = strncmp(name, functions[i].name, len);
-        if (!c) c = '\0' - functions[i].name[len];
-        if (c == 0) {
-            return functions + i;
-        } else if (c > 0) {
-            imin = i + 1;
-        } else {
-            imax = i - 1;
-        }
-    }
+    if (len <= 0) return 0;
+    const int i = builtin_slots[builtin_hash(name, len)];
+    if (i < 0 || strncmp(name, functions[i].name, len) != 0 || functions[i].name[len] != '\0') return 0;
+    return functions + i;
+}
 
-    return 0;
+int te_is_builtin(const char *name, int len) {
+    return find_builtin(name, len) != 0;
 }
 
 static const te_variable *find_lookup(const state *s, const char *name, int len) {
@@ -303,6 +354,12 @@ void next_token(state *s) {
 }
 
 
+/* Nodes of an arena are released all at once. */
+static void free_expr(const state *s, te_expr *n) {
+    if (!s->arena) te_free(n);
+}
+
+
 static te_expr *list(state *s);
 static te_expr *expr(state *s);
 static te_expr *power(state *s);
@@ -314,7 +371,7 @@ static te_expr *base(state *s) {
 
     switch (TYPE_MASK(s->type)) {
         case TOK_NUMBER:
-            ret = new_expr(TE_CONSTANT, 0);
+            ret = new_expr(s->arena, TE_CONSTANT, 0);
             CHECK_NULL(ret);
 
             ret->value = s->value;
@@ -322,7 +379,7 @@ static te_expr *base(state *s) {
             break;
 
         case TOK_VARIABLE:
-            ret = new_expr(TE_VARIABLE, 0);
+            ret = new_expr(s->arena, TE_VARIABLE, 0);
             CHECK_NULL(ret);
 
             ret->bound = s->bound;
@@ -331,7 +388,7 @@ static te_expr *base(state *s) {
 
         case TE_FUNCTION0:
         case TE_CLOSURE0:
-            ret = new_expr(s->type, 0);
+            ret = new_expr(s->arena, s->type, 0);
             CHECK_NULL(ret);
 
             ret->function = s->function;
@@ -349,14 +406,14 @@ static te_expr *base(state *s) {
 
         case TE_FUNCTION1:
         case TE_CLOSURE1:
-            ret = new_expr(s->type, 0);
+            ret = new_expr(s->arena, s->type, 0);
             CHECK_NULL(ret);
 
             ret->function = s->function;
             if (IS_CLOSURE(s->type)) ret->parameters[1] = s->context;
             next_token(s);
             ret->parameters[0] = power(s);
-            CHECK_NULL(ret->parameters[0], te_free(ret));
+            CHECK_NULL(ret->parameters[0], free_expr(s, ret));
             break;
 
         case TE_FUNCTION2: case TE_FUNCTION3: case TE_FUNCTION4:
@@ -365,7 +422,7 @@ static te_expr *base(state *s) {
         case TE_CLOSURE5: case TE_CLOSURE6: case TE_CLOSURE7:
             arity = ARITY(s->type);
 
-            ret = new_expr(s->type, 0);
+            ret = new_expr(s->arena, s->type, 0);
             CHECK_NULL(ret);
 
             ret->function = s->function;
@@ -379,7 +436,7 @@ static te_expr *base(state *s) {
                 for(i = 0; i < arity; i++) {
                     next_token(s);
                     ret->parameters[i] = expr(s);
-                    CHECK_NULL(ret->parameters[i], te_free(ret));
+                    CHECK_NULL(ret->parameters[i], free_expr(s, ret));
 
                     if(s->type != TOK_SEP) {
                         break;
@@ -407,7 +464,7 @@ static te_expr *base(state *s) {
             break;
 
         default:
-            ret = new_expr(0, 0);
+            ret = new_expr(s->arena, 0, 0);
             CHECK_NULL(ret);
 
             s->type = TOK_ERROR;
@@ -436,7 +493,7 @@ static te_expr *power(state *s) {
         CHECK_NULL(b);
 
         ret = NEW_EXPR(TE_FUNCTION1 | TE_FLAG_PURE, b);
-        CHECK_NULL(ret, te_free(b));
+        CHECK_NULL(ret, free_expr(s, b));
 
         ret->function = negate;
     }
@@ -468,21 +525,21 @@ static te_expr *factor(state *s) {
         if (insertion) {
             /* Make exponentiation go right-to-left. */
             te_expr *p = power(s);
-            CHECK_NULL(p, te_free(ret));
+            CHECK_NULL(p, free_expr(s, ret));
 
             te_expr *insert = NEW_EXPR(TE_FUNCTION2 | TE_FLAG_PURE, insertion->parameters[1], p);
-            CHECK_NULL(insert, te_free(p), te_free(ret));
+            CHECK_NULL(insert, free_expr(s, p), free_expr(s, ret));
 
             insert->function = t;
             insertion->parameters[1] = insert;
             insertion = insert;
         } else {
             te_expr *p = power(s);
-            CHECK_NULL(p, te_free(ret));
+            CHECK_NULL(p, free_expr(s, ret));
 
             te_expr *prev = ret;
             ret = NEW_EXPR(TE_FUNCTION2 | TE_FLAG_PURE, ret, p);
-            CHECK_NULL(ret, te_free(p), te_free(prev));
+            CHECK_NULL(ret, free_expr(s, p), free_expr(s, prev));
 
             ret->function = t;
             insertion = ret;
@@ -492,7 +549,7 @@ static te_expr *factor(state *s) {
     if (neg) {
         te_expr *prev = ret;
         ret = NEW_EXPR(TE_FUNCTION1 | TE_FLAG_PURE, ret);
-        CHECK_NULL(ret, te_free(prev));
+        CHECK_NULL(ret, free_expr(s, prev));
 
         ret->function = negate;
     }
@@ -509,11 +566,11 @@ static te_expr *factor(state *s) {
         te_fun2 t = s->function;
         next_token(s);
         te_expr *p = power(s);
-        CHECK_NULL(p, te_free(ret));
+        CHECK_NULL(p, free_expr(s, ret));
 
         te_expr *prev = ret;
         ret = NEW_EXPR(TE_FUNCTION2 | TE_FLAG_PURE, ret, p);
-        CHECK_NULL(ret, te_free(p), te_free(prev));
+        CHECK_NULL(ret, free_expr(s, p), free_expr(s, prev));
 
         ret->function = t;
     }
@@ -533,11 +590,11 @@ static te_expr *term(state *s) {
         te_fun2 t = s->function;
         next_token(s);
         te_expr *f = factor(s);
-        CHECK_NULL(f, te_free(ret));
+        CHECK_NULL(f, free_expr(s, ret));
 
         te_expr *prev = ret;
         ret = NEW_EXPR(TE_FUNCTION2 | TE_FLAG_PURE, ret, f);
-        CHECK_NULL(ret, te_free(f), te_free(prev));
+        CHECK_NULL(ret, free_expr(s, f), free_expr(s, prev));
 
         ret->function = t;
     }
@@ -555,11 +612,11 @@ static te_expr *expr(state *s) {
         te_fun2 t = s->function;
         next_token(s);
         te_expr *te = term(s);
-        CHECK_NULL(te, te_free(ret));
+        CHECK_NULL(te, free_expr(s, ret));
 
         te_expr *prev = ret;
         ret = NEW_EXPR(TE_FUNCTION2 | TE_FLAG_PURE, ret, te);
-        CHECK_NULL(ret, te_free(te), te_free(prev));
+        CHECK_NULL(ret, free_expr(s, te), free_expr(s, prev));
 
         ret->function = t;
     }
@@ -576,11 +633,11 @@ static te_expr *list(state *s) {
     while (s->type == TOK_SEP) {
         next_token(s);
         te_expr *e = expr(s);
-        CHECK_NULL(e, te_free(ret));
+        CHECK_NULL(e, free_expr(s, ret));
 
         te_expr *prev = ret;
         ret = NEW_EXPR(TE_FUNCTION2 | TE_FLAG_PURE, ret, e);
-        CHECK_NULL(ret, te_free(e), te_free(prev));
+        CHECK_NULL(ret, free_expr(s, e), free_expr(s, prev));
 
         ret->function = comma;
     }
@@ -636,7 +693,7 @@ double te_eval(const te_expr *n) {
 #undef TE_FUN
 #undef M
 
-static void optimize(te_expr *n) {
+static void optimize(te_expr *n, int in_arena) {
     /* Evaluates as much as possible. */
     if (n->type == TE_CONSTANT) return;
     if (n->type == TE_VARIABLE) return;
@@ -647,14 +704,14 @@ static void optimize(te_expr *n) {
         int known = 1;
         int i;
         for (i = 0; i < arity; ++i) {
-            optimize(n->parameters[i]);
+            optimize(n->parameters[i], in_arena);
             if (((te_expr*)(n->parameters[i]))->type != TE_CONSTANT) {
                 known = 0;
             }
         }
         if (known) {
             const double value = te_eval(n);
-            te_free_parameters(n);
+            if (!in_arena) te_free_parameters(n);
             n->type = TE_CONSTANT;
             n->value = value;
         }
@@ -663,10 +720,16 @@ static void optimize(te_expr *n) {
 
 
 te_expr *te_compile(const char *expression, const te_variable *variables, int var_count, int *error) {
+    return te_compile_arena(expression, variables, var_count, error, NULL);
+}
+
+
+te_expr *te_compile_arena(const char *expression, const te_variable *variables, int var_count, int *error, te_arena *arena) {
     state s;
     s.start = s.next = expression;
     s.lookup = variables;
     s.lookup_len = var_count;
+    s.arena = arena;
 
     next_token(&s);
     te_expr *root = list(&s);
@@ -676,14 +739,14 @@ te_expr *te_compile(const char *expression, const te_variable *variables, int va
     }
 
     if (s.type != TOK_END) {
-        te_free(root);
+        free_expr(&s, root);
         if (error) {
             *error = (s.next - s.start);
             if (*error == 0) *error = 1;
         }
         return 0;
     } else {
-        optimize(root);
+        optimize(root, arena != NULL);
         if (error) *error = 0;
         return root;
     }
@@ -706,6 +769,401 @@ double te_interp(const char *expression, int *error) {
     return ret;
 }
 
+/* Bytecode (txtML). The tree is lowered to a linear program for a stack machine.
+ * Arithmetic has its own opcodes, with forms that take a constant or a variable
+ * as the right operand. Folding keeps results bit-exact with te_eval(): pure
+ * functions of constants (also under closures and impure functions), x*1, 1*x,
+ * x/1, x-0, x^1 and -(-x), and x/c becomes x*(1/c) when c is a power of two.
+ * Variables bound to the parameters given to te_lower_function() become
+ * arguments: they are read from the array given to te_run_args(). */
+
+#define TE_MAX_STACK 256
+
+enum {
+    OP_CONST, OP_VAR, OP_ARG,
+    OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_NEG,
+    OP_ADD_CONST, OP_SUB_CONST, OP_MUL_CONST, OP_DIV_CONST,
+    OP_ADD_VAR, OP_SUB_VAR, OP_MUL_VAR, OP_DIV_VAR,
+    OP_CALL1, OP_CALL2, OP_CALL
+};
+
+typedef struct te_op {
+    int op;
+    int type; /* type of the function for OP_CALL, index of the argument for OP_ARG */
+    union {double value; const double *bound; const void *function;};
+    void *context;
+} te_op;
+
+struct te_program {
+    int count;
+    int stack_size; /* max depth of the stack */
+    te_op code[];
+};
+
+/* Code being lowered, it starts in a local buffer and is copied to the program at the end. */
+typedef struct builder {
+    te_op *code;
+    int count;
+    int capacity;
+    te_op *local;
+    const double *params; /* variables that are arguments */
+    int params_count;
+} builder;
+
+
+static double call(int type, const void *function, void *context, const double *a) {
+    #define F(...) ((double(*)(__VA_ARGS__))function)
+    if (IS_CLOSURE(type)) {
+        switch(ARITY(type)) {
+            case 0: return F(void*)(context);
+            case 1: return F(void*, double)(context, a[0]);
+            case 2: return F(void*, double, double)(context, a[0], a[1]);
+            case 3: return F(void*, double, double, double)(context, a[0], a[1], a[2]);
+            case 4: return F(void*, double, double, double, double)(context, a[0], a[1], a[2], a[3]);
+            case 5: return F(void*, double, double, double, double, double)(context, a[0], a[1], a[2], a[3], a[4]);
+            case 6: return F(void*, double, double, double, double, double, double)(context, a[0], a[1], a[2], a[3], a[4], a[5]);
+            case 7: return F(void*, double, double, double, double, double, double, double)(context, a[0], a[1], a[2], a[3], a[4], a[5], a[6]);
+            default: return NAN;
+        }
+    }
+    switch(ARITY(type)) {
+        case 0: return F(void)();
+        case 1: return F(double)(a[0]);
+        case 2: return F(double, double)(a[0], a[1]);
+        case 3: return F(double, double, double)(a[0], a[1], a[2]);
+        case 4: return F(double, double, double, double)(a[0], a[1], a[2], a[3]);
+        case 5: return F(double, double, double, double, double)(a[0], a[1], a[2], a[3], a[4]);
+        case 6: return F(double, double, double, double, double, double)(a[0], a[1], a[2], a[3], a[4], a[5]);
+        case 7: return F(double, double, double, double, double, double, double)(a[0], a[1], a[2], a[3], a[4], a[5], a[6]);
+        default: return NAN;
+    }
+    #undef F
+}
+
+
+static te_op *emit(builder *p, int op) {
+    if (p->count == p->capacity) {
+        int capacity = p->capacity * 2;
+        te_op *code = realloc(p->code == p->local ? NULL : p->code, sizeof(te_op) * capacity);
+        if (!code) return NULL;
+        if (p->code == p->local) memcpy(code, p->local, sizeof(te_op) * p->count);
+        p->code = code;
+        p->capacity = capacity;
+    }
+    te_op *ret = &p->code[p->count++];
+    memset(ret, 0, sizeof(te_op));
+    ret->op = op;
+    return ret;
+}
+
+
+/* The code from start is a single constant. */
+static int is_const(const builder *p, int start, int end) {
+    return end - start == 1 && p->code[start].op == OP_CONST;
+}
+
+
+/* Drops the single instruction at start, the code after it moves back. */
+static void drop_op(builder *p, int start) {
+    memmove(&p->code[start], &p->code[start + 1], sizeof(te_op) * (p->count - start - 1));
+    p->count--;
+}
+
+
+static int lower_arith(builder *p, const void *function, int a, int b) {
+    const int end = p->count;
+    const te_op right = p->code[b];
+    int op = function == add ? OP_ADD : function == sub ? OP_SUB : function == mul ? OP_MUL : OP_DIV;
+
+    if (is_const(p, b, end)) {
+        if ((op == OP_MUL || op == OP_DIV) && right.value == 1.0) {p->count = b; return 1;}
+        if (op == OP_SUB && right.value == 0.0 && !signbit(right.value)) {p->count = b; return 1;}
+        if (op == OP_DIV) {
+            int exp;
+            const double inverse = 1.0 / right.value;
+            if (isfinite(inverse) && fabs(frexp(inverse, &exp)) == 0.5) {
+                op = OP_MUL;
+                p->code[b].value = inverse;
+            }
+        }
+    }
+    if ((op == OP_ADD || op == OP_MUL) && is_const(p, a, b) && !is_const(p, b, end)) {
+        /* c+x = x+c and c*x = x*c, a constant has nothing to evaluate first. */
+        const double value = p->code[a].value;
+        drop_op(p, a);
+        if (op == OP_MUL && value == 1.0) return 1;
+        te_op *ret = emit(p, op == OP_ADD ? OP_ADD_CONST : OP_MUL_CONST);
+        if (!ret) return 0;
+        ret->value = value;
+        return 1;
+    }
+    if (end - b == 1 && (p->code[b].op == OP_CONST || p->code[b].op == OP_VAR)) {
+        p->code[b].op = op + (p->code[b].op == OP_CONST ? OP_ADD_CONST : OP_ADD_VAR) - OP_ADD;
+        return 1;
+    }
+    return emit(p, op) != NULL;
+}
+
+
+static int lower(builder *p, const te_expr *n) {
+    te_op *ret;
+    int start[8];
+    int arity, i, known;
+
+    switch(TYPE_MASK(n->type)) {
+        case TE_CONSTANT:
+            if (!(ret = emit(p, OP_CONST))) return 0;
+            ret->value = n->value;
+            return 1;
+        case TE_VARIABLE:
+            if (n->bound >= p->params && n->bound < p->params + p->params_count) {
+                if (!(ret = emit(p, OP_ARG))) return 0;
+                ret->type = (int)(n->bound - p->params);
+                return 1;
+            }
+            if (!(ret = emit(p, OP_VAR))) return 0;
+            ret->bound = n->bound;
+            return 1;
+    }
+    if (!IS_FUNCTION(n->type) && !IS_CLOSURE(n->type)) return 0;
+
+    arity = ARITY(n->type);
+    known = 1;
+    for (i = 0; i < arity; ++i) {
+        start[i] = p->count;
+        if (!lower(p, n->parameters[i])) return 0;
+    }
+    start[arity] = p->count;
+    for (i = 0; i < arity; ++i) {
+        if (!is_const(p, start[i], start[i + 1])) known = 0;
+    }
+
+    /* Pure functions of constants are folded also under impure ones. */
+    if (IS_PURE(n->type) && known) {
+        double a[7] = {0};
+        for (i = 0; i < arity; ++i) a[i] = p->code[start[i]].value;
+        const double value = call(n->type, n->function, IS_CLOSURE(n->type) ? n->parameters[arity] : 0, a);
+        p->count = arity ? start[0] : p->count;
+        if (!(ret = emit(p, OP_CONST))) return 0;
+        ret->value = value;
+        return 1;
+    }
+
+    if (IS_FUNCTION(n->type) && arity == 2 &&
+        (n->function == add || n->function == sub || n->function == mul || n->function == divide)) {
+        return lower_arith(p, n->function, start[0], start[1]);
+    }
+    if (IS_FUNCTION(n->type) && arity == 2 && n->function == pow &&
+        is_const(p, start[1], start[2]) && p->code[start[1]].value == 1.0) {
+        p->count = start[1];
+        return 1;
+    }
+    if (IS_FUNCTION(n->type) && arity == 1 && n->function == negate) {
+        if (p->code[p->count - 1].op == OP_NEG) {
+            p->count--;
+            return 1;
+        }
+        return emit(p, OP_NEG) != NULL;
+    }
+
+    if (!(ret = emit(p, IS_FUNCTION(n->type) && arity == 1 ? OP_CALL1 : IS_FUNCTION(n->type) && arity == 2 ? OP_CALL2 : OP_CALL))) return 0;
+    ret->type = n->type;
+    ret->function = n->function;
+    ret->context = IS_CLOSURE(n->type) ? n->parameters[arity] : 0;
+    return 1;
+}
+
+
+te_program *te_lower(const te_expr *n) {
+    return te_lower_function(n, NULL, 0);
+}
+
+
+te_program *te_lower_function(const te_expr *n, const double *params, int params_count) {
+    if (!n) return NULL;
+    te_op local[64];
+    builder b = {local, 0, 64, local, params, params_count};
+    te_program *p = NULL;
+
+    int depth = 0, stack_size = 0, i;
+    int ok = lower(&b, n);
+    for (i = 0; ok && i < b.count; ++i) {
+        switch (b.code[i].op) {
+            case OP_CONST: case OP_VAR: case OP_ARG: ++depth; break;
+            case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_CALL2: --depth; break;
+            case OP_CALL: depth += 1 - ARITY(b.code[i].type); break;
+        }
+        if (depth > stack_size) stack_size = depth;
+        if (depth > TE_MAX_STACK) ok = 0;
+    }
+    /* one allocation for the program and the code */
+    if (ok) p = malloc(sizeof(te_program) + sizeof(te_op) * b.count);
+    if (p) {
+        p->count = b.count;
+        p->stack_size = stack_size;
+        memcpy(p->code, b.code, sizeof(te_op) * b.count);
+    }
+    if (b.code != local) free(b.code);
+    return p;
+}
+
+
+double te_run(const te_program *p) {
+    return te_run_args(p, NULL);
+}
+
+
+double te_run_args(const te_program *p, const double *args) {
+    double stack[TE_MAX_STACK];
+    double *top = stack - 1;
+    const te_op *op = p->code;
+    const te_op *end = op + p->count;
+
+    for (; op < end; ++op) {
+        switch(op->op) {
+            case OP_CONST: *++top = op->value; break;
+            case OP_VAR: *++top = *op->bound; break;
+            case OP_ARG: *++top = args[op->type]; break;
+
+            case OP_ADD: top[-1] = top[-1] + top[0]; --top; break;
+            case OP_SUB: top[-1] = top[-1] - top[0]; --top; break;
+            case OP_MUL: top[-1] = top[-1] * top[0]; --top; break;
+            case OP_DIV: top[-1] = top[-1] / top[0]; --top; break;
+            case OP_NEG: *top = -*top; break;
+
+            case OP_ADD_CONST: *top = *top + op->value; break;
+            case OP_SUB_CONST: *top = *top - op->value; break;
+            case OP_MUL_CONST: *top = *top * op->value; break;
+            case OP_DIV_CONST: *top = *top / op->value; break;
+
+            case OP_ADD_VAR: *top = *top + *op->bound; break;
+            case OP_SUB_VAR: *top = *top - *op->bound; break;
+            case OP_MUL_VAR: *top = *top * *op->bound; break;
+            case OP_DIV_VAR: *top = *top / *op->bound; break;
+
+            case OP_CALL1: *top = ((double(*)(double))op->function)(*top); break;
+            case OP_CALL2: top[-1] = ((te_fun2)op->function)(top[-1], top[0]); --top; break;
+            case OP_CALL: {
+                const int arity = ARITY(op->type);
+                top -= arity - 1;
+                *top = call(op->type, op->function, op->context, top);
+                break;
+            }
+        }
+    }
+    return *top;
+}
+
+
+/* Batch evaluation (txtML). The program runs over a chunk of rows at a time,
+ * every stack slot is a vector of the chunk, so each opcode is a plain loop over
+ * arrays that the compiler can vectorize. */
+
+#define TE_BATCH_STACK 8192 /* doubles of the vector stack */
+#define TE_BATCH_CHUNK 256  /* max rows of a chunk */
+
+#define LOOP(...) for (i = 0; i < n; ++i) {__VA_ARGS__;}
+
+static void run_chunk(const te_program *p, const double *const *vars, const double *const *inputs,
+                      int inputs_count, int offset, int n, double *stack, double *out) {
+    const te_op *op = p->code;
+    const te_op *end = op + p->count;
+    int depth = 0; /* vectors on the stack */
+    int i, k;
+
+    for (; op < end; ++op) {
+        /* a constant operand, or the input of a variable (NULL if the variable keeps its value) */
+        double c = 0;
+        const double *in = NULL;
+        if (op->op == OP_CONST || (op->op >= OP_ADD_CONST && op->op <= OP_DIV_CONST)) {
+            c = op->value;
+        } else if (op->op == OP_VAR || (op->op >= OP_ADD_VAR && op->op <= OP_DIV_VAR)) {
+            for (k = 0; k < inputs_count && vars[k] != op->bound; ++k);
+            if (k < inputs_count) in = inputs[k] + offset;
+            else c = *op->bound;
+        }
+        /* a is under the top vector b */
+        double *restrict a = depth > 1 ? stack + (depth - 2) * n : stack;
+        double *restrict b = depth > 0 ? stack + (depth - 1) * n : stack;
+
+        switch(op->op) {
+            case OP_CONST: b = stack + depth++ * n; LOOP(b[i] = c); break;
+            case OP_VAR:
+                b = stack + depth++ * n;
+                if (in) memcpy(b, in, sizeof(double) * n);
+                else LOOP(b[i] = c);
+                break;
+
+            case OP_ADD: LOOP(a[i] = a[i] + b[i]); --depth; break;
+            case OP_SUB: LOOP(a[i] = a[i] - b[i]); --depth; break;
+            case OP_MUL: LOOP(a[i] = a[i] * b[i]); --depth; break;
+            case OP_DIV: LOOP(a[i] = a[i] / b[i]); --depth; break;
+            case OP_NEG: LOOP(b[i] = -b[i]); break;
+
+            case OP_ADD_CONST: LOOP(b[i] = b[i] + c); break;
+            case OP_SUB_CONST: LOOP(b[i] = b[i] - c); break;
+            case OP_MUL_CONST: LOOP(b[i] = b[i] * c); break;
+            case OP_DIV_CONST: LOOP(b[i] = b[i] / c); break;
+
+            case OP_ADD_VAR: if (in) LOOP(b[i] = b[i] + in[i]) else LOOP(b[i] = b[i] + c); break;
+            case OP_SUB_VAR: if (in) LOOP(b[i] = b[i] - in[i]) else LOOP(b[i] = b[i] - c); break;
+            case OP_MUL_VAR: if (in) LOOP(b[i] = b[i] * in[i]) else LOOP(b[i] = b[i] * c); break;
+            case OP_DIV_VAR: if (in) LOOP(b[i] = b[i] / in[i]) else LOOP(b[i] = b[i] / c); break;
+
+            case OP_CALL1:
+                if (op->function == fabs) LOOP(b[i] = fabs(b[i]))
+                else if (op->function == sqrt) LOOP(b[i] = sqrt(b[i]))
+                else if (op->function == floor) LOOP(b[i] = floor(b[i]))
+                else if (op->function == ceil) LOOP(b[i] = ceil(b[i]))
+                else {
+                    double (*f)(double) = (double(*)(double))op->function;
+                    LOOP(b[i] = f(b[i]));
+                }
+                break;
+            case OP_CALL2: {
+                te_fun2 f = (te_fun2)op->function;
+                LOOP(a[i] = f(a[i], b[i]));
+                --depth;
+                break;
+            }
+            case OP_CALL: {
+                const int arity = ARITY(op->type);
+                double args[7];
+                depth -= arity - 1;
+                b = stack + (depth - 1) * n;
+                for (i = 0; i < n; ++i) {
+                    for (k = 0; k < arity; ++k) args[k] = b[k * n + i];
+                    b[i] = call(op->type, op->function, op->context, args);
+                }
+                break;
+            }
+        }
+    }
+    memcpy(out, stack, sizeof(double) * n);
+}
+
+#undef LOOP
+
+
+void te_run_batch(const te_program *p, const double *const *vars, const double *const *inputs,
+                  int inputs_count, double *out, int count) {
+    double stack[TE_BATCH_STACK];
+    int chunk = TE_BATCH_STACK / (p->stack_size > 0 ? p->stack_size : 1);
+    int offset;
+    if (chunk > TE_BATCH_CHUNK) chunk = TE_BATCH_CHUNK;
+
+    for (offset = 0; offset < count; offset += chunk) {
+        const int n = count - offset < chunk ? count - offset : chunk;
+        run_chunk(p, vars, inputs, inputs_count, offset, n, stack, out + offset);
+    }
+}
+
+
+void te_program_free(te_program *p) {
+    free(p);
+}
+
+
 static void pn (const te_expr *n, int depth) {
     int i, arity;
     printf("%*s", depth, "");
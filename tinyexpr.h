@@ -26,6 +26,7 @@
 #ifndef TINYEXPR_H
 #define TINYEXPR_H
 
+#include <stddef.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -60,6 +61,18 @@ typedef struct te_variable {
 
 
 
+/* Memory for the nodes of expressions (txtML). */
+typedef struct te_arena {
+    char *buffer;
+    size_t size;
+    size_t used;
+    char *start;       /* the caller's buffer */
+    size_t start_size;
+    void *blocks;      /* blocks malloc'ed when the buffer is full */
+} te_arena;
+
+
+
 /* Parses the input expression, evaluates it, and frees it. */
 /* Returns NaN on error. */
 double te_interp(const char *expression, int *error);
@@ -68,12 +81,52 @@ double te_interp(const char *expression, int *error);
 /* Returns NULL on error. */
 te_expr *te_compile(const char *expression, const te_variable *variables, int var_count, int *error);
 
+/* Starts an arena on the caller's buffer, which may be NULL. */
+void te_arena_init(te_arena *arena, void *buffer, size_t size);
+
+/* Same as te_compile(), but the nodes are taken from the arena. */
+/* The expression is freed by te_arena_release(), not by te_free(). */
+te_expr *te_compile_arena(const char *expression, const te_variable *variables, int var_count, int *error, te_arena *arena);
+
+/* Frees all expressions of the arena, it can be used again. */
+void te_arena_release(te_arena *arena);
+
 /* Evaluates the expression. */
 double te_eval(const te_expr *n);
 
+/* Bytecode of an expression (txtML). */
+typedef struct te_program te_program;
+
+/* Lowers the expression to bytecode, the expression may be freed after it. */
+/* Returns NULL on error or if the expression is too deep. */
+te_program *te_lower(const te_expr *n);
+
+/* Same as te_lower(), but the variables bound at params[0..params_count-1] */
+/* become arguments of the program. */
+te_program *te_lower_function(const te_expr *n, const double *params, int params_count);
+
+/* Evaluates the bytecode, the result is the same as te_eval() gives. */
+double te_run(const te_program *p);
+
+/* Same as te_run() for a program of te_lower_function(), args[k] is the value */
+/* of params[k]. Such programs are not run by te_run_batch(). */
+double te_run_args(const te_program *p, const double *args);
+
+/* Evaluates the bytecode count times into out. For every row the variable bound */
+/* at vars[k] takes its value from inputs[k][row], other variables keep theirs. */
+void te_run_batch(const te_program *p, const double *const *vars, const double *const *inputs,
+                  int inputs_count, double *out, int count);
+
+/* Frees the bytecode. */
+/* This is safe to call on NULL pointers. */
+void te_program_free(te_program *p);
+
 /* Prints debugging information on the syntax tree. */
 void te_print(const te_expr *n);
 
+/* Returns 1 if the name is a builtin function or constant (txtML). */
+int te_is_builtin(const char *name, int len);
+
 /* Frees the expression. */
 /* This is safe to call on NULL pointers. */
 void te_free(te_expr *n);
@@ -11,37 +11,216 @@ void print_logo()
     puts("\\/_/ \\/__/\\//\\/_/  \\/__/ \\/_/ \\/_/\\/___/ ");
 }
 
-int main(int argc, char* argv[]) {
-    print_logo();
-    printf(".txtML translation system v1.0\nCopyright (C) 2023 Dmitriy Eliseev\n\n");
-    char source_file_extension[] = ".tml";
-    char result_file_extension[] = ".txt";
+void print_usage()
+{
+    printf("usage: txtml [-j threads] [-w widths] [command]\n");
+    printf("       txtml                          translate all .tml files in the current directory\n");
+    printf("       txtml pack <pack> [files]      put .tml files (all by default) into a pack\n");
+    printf("       txtml unpack <pack> [names]    extract documents (all by default) from a pack\n");
+    printf("       txtml render <pack>            translate a pack into a .txtpack pack\n");
+    printf("       -j threads                     threads for big tables (the number of processors by default)\n");
+    printf("       -w 60,80,120                   translate .tml files at every width into name.<width>.txt\n");
+}
+
+char source_file_extension[] = ".tml";
+char result_file_extension[] = ".txt";
+
+#define MAX_DOC_WIDTHS 16
+uint8_t doc_widths[MAX_DOC_WIDTHS];
+uint8_t doc_widths_count = 0;//0 - one result at the default width
+
+//the source is read once and rendered at every width
+void translate_file(char* filename)
+{
+    uint8_t widths_count = (doc_widths_count > 0) ? doc_widths_count : 1;
+    char* file_content = NULL;
+    if (doc_widths_count > 1) start_sharing_tag_results();
+    for (uint8_t w = 0; w < widths_count; w++) {
+        char extension[16];
+        if (doc_widths_count > 0) {
+            set_start_doc_width(doc_widths[w]);
+            snprintf(extension, sizeof(extension), ".%u%s", doc_widths[w], result_file_extension);
+        } else {
+            set_start_doc_width(DEFAULT_DOC_WIDTH);
+            strcpy(extension, result_file_extension);
+        }
+        char* result_file = change_file_extension(filename, extension);
+        clear_doc_vars();
+        if (copy_plain_file(filename, result_file) == 0) {
+            if (file_content == NULL) file_content = get_file_content(filename);
+            char* result = execute_all_tags(file_content);
+            replace_service_symbols(result, strlen(result));
+            write_to_file(result_file, result);
+            clear_splices();
+            free(result);
+        }
+        free(result_file);
+    }
+    if (doc_widths_count > 1) stop_sharing_tag_results();
+    free(file_content);
+}
+
+//widths like 60,80,120
+int get_doc_widths(char* str)
+{
+    doc_widths_count = 0;
+    char* end = str;
+    do {
+        str = (*end == ',') ? end + 1 : end;
+        long width = strtol(str, &end, 10);
+        if (!isdigit(*str) || width < 10 || width > 200 || doc_widths_count == MAX_DOC_WIDTHS) return 0;
+        doc_widths[doc_widths_count++] = width;
+    } while (*end == ',');
+    return *end == '\0';
+}
+
+void translate_dir()
+{
     char** files = get_files_in_dir(".", source_file_extension);
-    uint16_t files_count = get_files_count(".", source_file_extension);
+    uint32_t files_count = get_files_count(".", source_file_extension);
     if (files_count == 0) {
         printf("Error: .tml files not found\n");
         exit(EXIT_SUCCESS);
     }
-    uint16_t i;
-    
+    uint32_t i;
+
     for (i = 0; i < files_count; i++) {
-        set_doc_width(DEFAULT_DOC_WIDTH);
         printf("processing file: %s\n", files[i]);
-        char* file_content = get_file_content(files[i]);
-        char* result = execute_all_tags(file_content);
-        change_symbols('\f', '<', result);
-        change_symbols('\a', '>', result);
-        change_symbols('\r', ' ', result);
-        change_symbols('\v', ' ', result);
-        char* result_file = change_file_extension(files[i], result_file_extension);
-        write_to_file(result_file, result);
+        translate_file(files[i]);
         printf("  done\n");
-        free(result_file);
-        free(file_content);
-        free(result);
         free(files[i]);
     }
     free(files);
+}
+
+int pack_files(char* pack_file, char** files, uint32_t files_count)
+{
+    char** dir_files = NULL;
+    if (files_count == 0) {
+        dir_files = get_files_in_dir(".", source_file_extension);
+        files_count = get_files_count(".", source_file_extension);
+        files = dir_files;
+    }
+    pack_writer pw;
+    if (create_pack(pack_file, &pw) == 0) return EXIT_FAILURE;
+    for (uint32_t i = 0; i < files_count; i++) {
+        char* file_content = get_file_content(files[i]);
+        if (file_content != NULL) {
+            add_to_pack(&pw, files[i], file_content, strlen(file_content));
+            free(file_content);
+        }
+    }
+    printf("packed %u files into %s\n", pw.count, pack_file);
+    if (dir_files != NULL) {
+        for (uint32_t i = 0; i < files_count; i++) free(dir_files[i]);
+        free(dir_files);
+    }
+    return finish_pack(&pw) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+void unpack_doc(pack* pk, uint32_t index)
+{
+    char* name = get_pack_doc_name(pk, index);
+    if (name[0] == '/' || strstr(name, "..") != NULL) {
+        printf("  Error: unsafe document name \"%s\". Ignoring\n", name);
+        return;
+    }
+    FILE* file = fopen(name, "wb");
+    if (file == NULL) {print_file_error(name); return;}
+    fwrite(get_pack_doc(pk, index), 1, pk->entries[index].data_len, file);
+    fclose(file);
+    printf("unpacked: %s\n", name);
+}
+
+int unpack_files(char* pack_file, char** names, uint32_t names_count)
+{
+    pack pk;
+    if (open_pack(pack_file, &pk) == 0) return EXIT_FAILURE;
+    if (names_count == 0) {
+        for (uint32_t i = 0; i < pk.header->docs_count; i++) unpack_doc(&pk, i);
+    }
+    for (uint32_t i = 0; i < names_count; i++) {
+        int64_t index = find_in_pack(&pk, names[i]);
+        if (index < 0) printf("  Error: \"%s\" not found in the pack\n", names[i]);
+        else unpack_doc(&pk, index);
+    }
+    close_pack(&pk);
+    return EXIT_SUCCESS;
+}
+
+int render_pack(char* pack_file)
+{
+    pack pk;
+    if (open_pack(pack_file, &pk) == 0) return EXIT_FAILURE;
+    char* result_pack = change_file_extension(pack_file, ".txtpack");
+    if (strcmp(result_pack, pack_file) == 0) strcat(result_pack, ".txtpack");
+    pack_writer pw;
+    if (create_pack(result_pack, &pw) == 0) {
+        close_pack(&pk);
+        free(result_pack);
+        return EXIT_FAILURE;
+    }
+    for (uint32_t i = 0; i < pk.header->docs_count; i++) {
+        set_doc_width(DEFAULT_DOC_WIDTH);
+        clear_doc_vars();
+        char* doc = get_pack_doc(&pk, i);
+        uint64_t len = pk.entries[i].data_len;
+        char* result_name = change_file_extension(get_pack_doc_name(&pk, i), result_file_extension);
+        if (get_span_without(doc, len, "<\f\a\r\v\0", 6) == len) {
+            add_to_pack(&pw, result_name, doc, len);//tag-free document
+        } else {
+            char* result = execute_all_tags(doc);
+            replace_service_symbols(result, strlen(result));
+            add_result_to_pack(&pw, result_name, result);
+            clear_splices();
+            free(result);
+        }
+        free(result_name);
+    }
+    printf("translated %u documents into %s\n", pk.header->docs_count, result_pack);
+    close_pack(&pk);
+    uint8_t ok = finish_pack(&pw);
+    free(result_pack);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int main(int argc, char* argv[]) {
+    print_logo();
+    printf(".txtML translation system v1.0\nCopyright (C) 2023 Dmitriy Eliseev\n\n");
+    int status = EXIT_SUCCESS;
+    set_threads_count(0);
+    while (argc >= 3 && (strcmp(argv[1], "-j") == 0 || strcmp(argv[1], "-w") == 0)) {
+        if (strcmp(argv[1], "-j") == 0) {
+            int threads = atoi(argv[2]);
+            if (threads <= 0) {
+                print_usage();
+                return EXIT_FAILURE;
+            }
+            set_threads_count(threads > UINT16_MAX ? UINT16_MAX : threads);
+        } else if (get_doc_widths(argv[2]) == 0) {
+            print_usage();
+            return EXIT_FAILURE;
+        }
+        argv += 2;
+        argc -= 2;
+    }
+    if (argc == 1) {
+        translate_dir();
+    } else if (argc >= 3 && strcmp(argv[1], "pack") == 0) {
+        status = pack_files(argv[2], &argv[3], argc - 3);
+    } else if (argc >= 3 && strcmp(argv[1], "unpack") == 0) {
+        status = unpack_files(argv[2], &argv[3], argc - 3);
+    } else if (argc == 3 && strcmp(argv[1], "render") == 0) {
+        status = render_pack(argv[2]);
+    } else {
+        print_usage();
+        return EXIT_FAILURE;
+    }
+    print_include_cache_stats();
+    print_expr_cache_stats();
+    free_include_cache();
+    free_expr_cache();
+    free_fragment_cache();
 
-    return 0;
+    return status;
 }
@@ -108,7 +108,7 @@ char* doc_width(char* str, char** attrs)
 
 char* def_width(char* str, char** attrs)
 {
-    set_doc_width(DEFAULT_DOC_WIDTH);
+    set_doc_width(START_DOC_WIDTH);
     char* r = calloc(2, sizeof(char));
     strcpy(r, "");
     return r;
@@ -257,148 +257,129 @@ char* calc(char* str, char** attrs)
 {
     char** expressions = split('\n', str);
     uint16_t expr_count = get_elements_count('\n', str);
-    uint16_t res_len = 0;
-    char* result_str = NULL;
-    char* tmp = NULL;
+    //dec=N, rt and grp format the results, other attributes print the expressions too
+    number_format fmt;
+    uint8_t format_attrs = get_number_format(attrs, &fmt);
+    uint8_t with_expr = (attrs != NULL && get_arr_size(attrs) > format_attrs);
+    str_buf result = {NULL, 0, 0};
+    append_to_buf(&result, "", 0);
+    uint16_t printed = 0;
     for (uint16_t i = 0; i < expr_count; i++) {
-        tmp = calloc(1000, sizeof(char));
-        is_memory_allocated(tmp);
+        //"name(a, b) = expr" lines define document functions, nothing is printed
+        if (define_doc_func(expressions[i])) {
+            free(expressions[i]);
+            continue;
+        }
         int error;
-        double result = te_interp(expressions[i], &error);
-        if (attrs == NULL) {
-            if (error) {
-                sprintf(tmp, "error");
-            } else {
-                sprintf(tmp, "%g", result);
-            }
+        double value;
+        //"name = expr" lines define document variables
+        if (define_doc_var(expressions[i], &value, &error) == 0) value = eval_cached_expr(expressions[i], &error);
+        if (printed++ > 0) append_to_buf(&result, "\n", 1);
+        if (with_expr) {
+            append_to_buf(&result, expressions[i], strlen(expressions[i]));
+            append_to_buf(&result, " = ", 3);
+        }
+        if (error) {
+            append_to_buf(&result, "error", 5);
         } else {
-            if (error) {
-                sprintf(tmp, "%s = error", expressions[i]);
-            } else {
-                sprintf(tmp, "%s = %g", expressions[i], result);
-            }
+            append_number_to_buf(&result, value, &fmt);
         }
-        uint16_t len = strlen(tmp) + 1;
-        res_len += len;
-        free(expressions[i]);
-        expressions[i] = calloc(len, sizeof(char));
-        is_memory_allocated(expressions[i]);
-        strcpy(expressions[i], tmp);
-        free(tmp);
-    }
-    result_str = calloc(res_len, sizeof(char));
-    is_memory_allocated(result_str);
-    for (uint16_t i = 0; i < expr_count; i++) {
-        strcat(result_str, expressions[i]);
-        if (i < expr_count - 1) strcat(result_str, "\n");
         free(expressions[i]);
     }
     free(expressions);
-    return result_str;
+    return result.str;
 }
 
-char* get_table(char* str, char** attrs)
+//lines "name = expr" define document variables and "name(a, b) = expr" functions, nothing is printed
+char* let(char* str, char** attrs)
 {
-    uint16_t  rows_count   = get_rows_count(str);
-    uint16_t* cells_in_row = get_cells_count(str);
-    char***   table_data   = get_table_data(str);
-    uint8_t nb = in_str_array(attrs, "nb");//no border
-    uint8_t nc = in_str_array(attrs, "nc");//no calculations
-    uint8_t na = in_str_array(attrs, "na");//don't align numbers to the right
-    if (nb == 1) na = 1;
-    if (nc == 0) calc_in_table(table_data, rows_count, cells_in_row);
-    align_to_columns(table_data, rows_count, cells_in_row, na);
-    uint16_t* rows_len     = get_rows_len(table_data, rows_count, cells_in_row);
-    uint16_t  max_row_len  = get_max_row_len(table_data, rows_count, cells_in_row);
-    if (max_row_len < DOC_WIDTH - 2) max_row_len = DOC_WIDTH - 2;
-    char*     table        = calloc(rows_count * (max_row_len + 3) + 1, sizeof(char));
-    is_memory_allocated(table);
-    for (uint16_t i = 0; i < rows_count; i++) {
-        if (nb == 0) strcat(table, "|");
-        uint16_t* cells_len = get_cells_len(table_data[i], cells_in_row[i]);
-        uint16_t  align     = max_row_len - rows_len[i];
-
-        while (align > 0) {
-            uint16_t min_cell_i = get_min_index(cells_len, cells_in_row[i]);
-            char*    al_str     = calloc(strlen(table_data[i][min_cell_i]) + 2, sizeof(char));
-            is_memory_allocated(al_str);
-            if (is_number(table_data[i][min_cell_i]) && na == 0) {
-                strcat(al_str, " ");
-                strcat(al_str, table_data[i][min_cell_i]);
-            } else {
-                strcpy(al_str, table_data[i][min_cell_i]);
-                strcat(al_str, " ");
-            }
-            free(table_data[i][min_cell_i]);
-            table_data[i][min_cell_i] = al_str;
-            cells_len[min_cell_i]++;
-            align--;
-        }
-        for (uint16_t j = 0; j < cells_in_row[i]; j++) {
-            strcat(table, table_data[i][j]);
-            if(nb == 0){
-                strcat(table, "|");
-            } else {
-                strcat(table, " ");
-            }
+    char** lines = split('\n', str);
+    uint16_t lines_count = get_elements_count('\n', str);
+    for (uint16_t i = 0; i < lines_count; i++) {
+        double value;
+        int error;
+        if (lines[i][strspn(lines[i], " \t\r")] == '\0' || define_doc_func(lines[i])) {
+            //empty line or a function
+        } else if (define_doc_var(lines[i], &value, &error) == 0) {
+            printf("  Error: wrong variable definition \"%s\". Ignoring\n", lines[i]);
+        } else if (error) {
+            printf("  Error: wrong expression in \"%s\". Ignoring\n", lines[i]);
         }
-        strcat(table, "\n");
-        free(cells_len);
+        free(lines[i]);
     }
-    char* result = (nb == 0) ? add_table_border(table) : table;
-    //Cleaning
-    if (nb == 0) free(table);
-    for (uint16_t i = 0; i < rows_count; i++) {
-        for (uint16_t j = 0; j < cells_in_row[i]; j++) {
-            free(table_data[i][j]);
-        }
-        free(table_data[i]);
+    free(lines);
+    return calloc(1, sizeof(char));
+}
+
+char* get_table(char* str, char** attrs)
+{
+    table_options opt;
+    get_table_options(attrs, &opt);
+    uint8_t arranged = (opt.sort > 0 || opt.filter_col > 0 || opt.top > 0);//rows are needed all at once
+    if (TAG_DEPTH == 0 && !arranged && get_table_source_size(str, &opt) >= SPLICE_THRESHOLD) {
+        //large tables are rendered straight into the output file
+        return get_splice_marker(add_table_splice(str, &opt));
     }
-    free(table_data);
-    free(rows_len);
-    free(cells_in_row);
+    table tbl;
+    read_table(str, &opt, &tbl);
+    process_table(&tbl, &opt);
+    char* result = render_table(&tbl, &opt);
+    free_table(&tbl);
+    free_table_options(&opt);
 
     return result;
 }
 
 char* get_histogram(char* str, char** attrs)
 {
-    char sym = '#';
-
-    if (attrs != NULL) {
-        if (attrs[0] != NULL) {
-            sym = attrs[0][0];
+    char sym = get_histogram_sym(attrs);
+    uint16_t lines_count;
+    char** names;
+    char** values;
+    if (is_sample_histogram(attrs)) {
+        //bins of raw samples
+        lines_count = get_sample_histogram_data(str, attrs, &names, &values);
+        if (lines_count == 0) {
+            free(names);
+            free(values);
+            char* empty = calloc(1, sizeof(char));
+            is_memory_allocated(empty);
+            return empty;
         }
+    } else {
+        lines_count = get_elements_count('\n', str);
+        names = calloc(lines_count, sizeof(char*));
+        is_memory_allocated(names);
+        values = calloc(lines_count, sizeof(char*));
+        is_memory_allocated(values);
+        get_histogram_data(str, names, values);
     }
-    uint16_t lines_count = get_elements_count('\n', str);
-    char** names = calloc(lines_count, sizeof(char*));
-    is_memory_allocated(names);
-    char** values = calloc(lines_count, sizeof(char*));
-    is_memory_allocated(values);
-    get_histogram_data(str, names, values);
-
-    uint32_t len = (DOC_WIDTH + 1) * lines_count;
-    char* histogram = calloc(len, sizeof(char));
-    is_memory_allocated(histogram);
 
     char* tmp = NULL;
-    uint16_t max_name = get_max_len(names, lines_count);
+    uint32_t max_name = get_max_len(names, lines_count);
     double max_value = get_max_value(values, lines_count);
-    uint16_t max_value_len = get_max_len(values, lines_count);
-    uint16_t hist_width = DOC_WIDTH - max_name - max_value_len - 8;
+    uint32_t max_value_len = get_max_len(values, lines_count);
+    //long names (bin ranges) don't leave room for bars in a narrow document, the lines get longer then
+    int64_t hist_width = (int64_t)DOC_WIDTH - max_name - max_value_len - 8;
+    if (hist_width < MIN_HISTOGRAM_WIDTH) hist_width = MIN_HISTOGRAM_WIDTH;
     double hist_sym = max_value / (double)(hist_width);
+    uint64_t line_len = max_name + hist_width + max_value_len + 8;
+
+    uint64_t len = (line_len + 1) * lines_count + 1;
+    char* histogram = calloc(len, sizeof(char));
+    is_memory_allocated(histogram);
 
     for (uint16_t i = 0; i < lines_count; i++) {
         if (strcmp(values[i], " ") != 0){
             char* al = get_str_from_sym(' ', max_name - strlen(names[i]));
-            tmp = calloc(DOC_WIDTH + 1, sizeof(char));
+            tmp = calloc(line_len + 1, sizeof(char));
             sprintf(tmp, " %s%s | ", al, names[i]);
             free(al);
             double v = 0;
             char* tmp2 = calloc(strlen(values[i]) + 5, sizeof(char));
             sprintf(tmp2, " | %s ", values[i]);
-            if (is_num(values[i]) == 1) v = strtod(values[i], NULL);
-            uint16_t hist_len = (uint16_t)round(v / (double)hist_sym);
+            parse_number(values[i], strlen(values[i]), &v, NULL);
+            uint16_t hist_len = (hist_sym > 0) ? (uint16_t)round(fabs(v) / hist_sym) : 0;
             char* h = get_str_from_sym(sym, hist_len);
             strcat(tmp, h);
             free(h);
@@ -423,6 +404,26 @@ char* get_histogram(char* str, char** attrs)
 }
 
 
+//summary statistics of samples in a table, the table attributes (nb, na, dp, cols) work
+char* stats(char* str, char** attrs)
+{
+    table_options opt;
+    get_table_options(attrs, &opt);
+    free(opt.source);
+    opt.source = NULL;//the samples are read from src=file
+    opt.nc = 1;//the numbers are already calculated
+    char* tbl_str = get_stats_table(str, attrs, &opt.num);
+    table tbl;
+    read_table(tbl_str, &opt, &tbl);
+    process_table(&tbl, &opt);
+    char* result = render_table(&tbl, &opt);
+    free(tbl_str);
+    free_table(&tbl);
+    free_table_options(&opt);
+
+    return result;
+}
+
 /***************************************************************************
 * Files
 ***************************************************************************/
@@ -432,16 +433,22 @@ char* insert(char* str, char** attrs)
     uint64_t ins_len = 0;
     if (attrs != NULL) {
         uint16_t files_count = get_arr_size(attrs);
+        uint8_t tml = in_str_array(attrs, "tml");//render inserted .tml files
         char** file_contents = calloc(files_count, sizeof(char*));
         is_memory_allocated(file_contents);
         for (uint16_t i = 0; i < files_count; i++) {
-            if (attrs[i] != NULL) {
-                file_contents[i] = get_file_content(attrs[i]);
-                if (file_contents[i] != NULL) {
-                    change_symbols('<', '\f', file_contents[i]);
-                    change_symbols('>', '\a', file_contents[i]);
-                    ins_len += strlen(file_contents[i]);
-                }
+            if (tml == 1 && strcmp(attrs[i], "tml") == 0) {
+                file_contents[i] = NULL;
+            } else if (tml == 1) {
+                file_contents[i] = get_rendered_fragment(attrs[i]);
+                if (file_contents[i] != NULL) ins_len += strlen(file_contents[i]);
+            } else if (attrs[i] != NULL) {
+                struct stat st;
+                if (TAG_DEPTH == 0 && stat(attrs[i], &st) == 0 && st.st_size >= SPLICE_THRESHOLD) {
+                    //large file at the top level is written directly to the result file
+                    file_contents[i] = get_splice_marker(add_file_splice(attrs[i]));
+                } else file_contents[i] = get_include_content(attrs[i]);
+                if (file_contents[i] != NULL) ins_len += strlen(file_contents[i]);
             } else file_contents[i] = NULL;
         }
         ins_len += files_count * 3;
@@ -449,6 +456,7 @@ char* insert(char* str, char** attrs)
         is_memory_allocated(inserting_text);
         strcat(inserting_text, "\n");
         for (uint16_t i = 0; i < files_count; i++) {
+            if (tml == 1 && strcmp(attrs[i], "tml") == 0) continue;
             if (file_contents[i] != NULL) {
                 strcat(inserting_text, file_contents[i]);
                 strcat(inserting_text, "\n");
@@ -32,6 +32,8 @@ char* get_lines(char* str, char** attrs);
 char* calc(char* str, char** attrs);
 char* get_table(char* str, char** attrs);
 char* get_histogram(char* str, char** attrs);
+char* stats(char* str, char** attrs);
+char* let(char* str, char** attrs);
 
 //files
 char* insert(char* str, char** attrs);
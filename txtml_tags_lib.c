@@ -2,6 +2,7 @@
 
 const uint8_t DEFAULT_DOC_WIDTH = 80;
 uint8_t DOC_WIDTH = DEFAULT_DOC_WIDTH;
+uint8_t START_DOC_WIDTH = DEFAULT_DOC_WIDTH;//width the document is rendered from, <def_width> returns to it
 /***************************************************************************
 * functions for working with errors
 ***************************************************************************/
@@ -39,13 +40,13 @@ void print_tag_error(char* tag)
 /***************************************************************************
 * functions for working with files
 ***************************************************************************/
-uint16_t get_files_count(char* dirname, char* file_extension)
+uint32_t get_files_count(char* dirname, char* file_extension)
 {
     DIR *dir = opendir(dirname);
     is_directory_opened(dir);
 
     struct dirent *file;
-    uint16_t i = 0;
+    uint32_t i = 0;
     while ((file = readdir(dir)) != NULL) {
         char* extension = strrchr(file->d_name, '.');//find start of file extension
         if (extension != NULL && strcmp(extension, file_extension) == 0) i++;
@@ -56,14 +57,14 @@ uint16_t get_files_count(char* dirname, char* file_extension)
 
 char** get_files_in_dir(char* dirname, char* file_extension)
 {
-    uint16_t files_count = get_files_count(dirname, file_extension);
+    uint32_t files_count = get_files_count(dirname, file_extension);
     struct dirent *file;
     DIR *dir = opendir(dirname);
     is_directory_opened(dir);
 
     char** file_names = calloc(files_count, sizeof(char*));
     is_memory_allocated(file_names);
-    uint16_t i = 0;
+    uint32_t i = 0;
     while ((file = readdir(dir)) != NULL) {
         char* extension = strrchr(file->d_name, '.');//find start of file extension
         if (extension != NULL && strcmp(extension, file_extension) == 0) {
@@ -101,11 +102,66 @@ void write_to_file(char* filename, char* str)
 {
     FILE *file;
     file = fopen(filename, "w");
-    if (file==NULL) print_file_error(filename);
-    fprintf(file, "%s", str);
+    if (file==NULL) {print_file_error(filename); return;}
+    write_result(file, str);
     fclose(file);
 }
 
+static uint8_t write_all(int fd, const char* data, uint64_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        data += n;
+        len -= n;
+    }
+    return 1;
+}
+
+static uint8_t copy_file_data(int in, int out, const char* data, uint64_t size)
+{
+    //the kernel copies the file without passing it through user space;
+    //whatever it could not copy is written from the mapping
+    loff_t offset = 0;
+    while (offset < (loff_t)size) {
+        ssize_t n = copy_file_range(in, &offset, out, NULL, size - offset, 0);
+        if (n <= 0) break;
+    }
+    off_t s_offset = offset;
+    while (s_offset < (off_t)size) {
+        ssize_t n = sendfile(out, in, &s_offset, size - s_offset);
+        if (n <= 0) break;
+    }
+    return write_all(out, data + s_offset, size - s_offset);
+}
+
+uint8_t copy_plain_file(char* src_filename, char* dst_filename)
+{
+    int in = open(src_filename, O_RDONLY);
+    if (in < 0) return 0;
+    struct stat st;
+    if (fstat(in, &st) != 0 || st.st_size == 0) {close(in); return 0;}
+    uint64_t size = st.st_size;
+    char* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, in, 0);
+    if (data == MAP_FAILED) {close(in); return 0;}
+
+    //no tags and no symbols that are replaced in the result
+    uint8_t copied = 0;
+    if (get_span_without(data, size, "<\f\a\r\v\0", 6) == size) {
+        int out = open(dst_filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (out < 0) {
+            print_file_error(dst_filename);
+        } else {
+            copied = copy_file_data(in, out, data, size);
+            close(out);
+        }
+    }
+    munmap(data, size);
+    close(in);
+    return copied;
+}
+
 char* change_file_extension(char* filename, char* extension)
 {
     char* result = calloc(strlen(filename) + strlen(extension) + 1, sizeof(char));
@@ -118,777 +174,4355 @@ char* change_file_extension(char* filename, char* extension)
 
 
 /***************************************************************************
-* functions for working with TAGS
+* functions for working with the include cache
 ***************************************************************************/
-char tag_list[][20] = { "date", "time", "datetime", "right", "center", "h1", "h2", "h3", "h4",
-                        "doc_width", "def_width", "sep", "p", "frame", "list", "lines", "calc", "table",
-                        "histogram", "insert"};
-const int tag_count = sizeof(tag_list) / sizeof(tag_list[0]);
-char* (*tag_functions[])(char*, char**) = { get_date, get_time, get_datetime, right, center, h1,
-                                            h2, h3, h4, doc_width, def_width, separator, p, get_framed_text,
-                                            get_list, get_lines, calc, get_table, get_histogram, insert };
-char single_tags[][20] = { "date", "time", "datetime", "doc_width", "def_width", "sep", "lines", "insert" };
-const int single_tags_count = sizeof(single_tags) / sizeof(single_tags[0]);
+#define INCLUDE_CACHE_SIZE 256
 
+typedef struct include_entry {
+    char*    path;
+    dev_t    dev;
+    ino_t    ino;
+    off_t    size;
+    struct timespec mtime;
+    char*    content;//file content with escaped tag symbols
+    uint64_t len;
+    struct include_entry* next;
+} include_entry;
 
-int8_t have_attributes(char* tag)
+static include_entry*  include_cache[INCLUDE_CACHE_SIZE];
+static pthread_mutex_t include_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t        include_bytes_read = 0;
+static uint64_t        include_bytes_cached = 0;
+
+static uint8_t is_same_file(include_entry* entry, struct stat* st)
 {
-    uint16_t elements_count= get_elements_count(' ', tag);
-    if (elements_count == 1) {
-        return 0;
+    return entry->dev == st->st_dev && entry->ino == st->st_ino && entry->size == st->st_size &&
+           entry->mtime.tv_sec == st->st_mtim.tv_sec && entry->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+char* get_include_content(char* filename)
+{
+    struct stat st;
+    if (stat(filename, &st) != 0) {print_file_error(filename); return NULL;}
+    uint32_t bucket = get_str_hash(filename) % INCLUDE_CACHE_SIZE;
+    char* result = NULL;
+
+    pthread_mutex_lock(&include_cache_mutex);
+    for (include_entry* entry = include_cache[bucket]; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->path, filename) == 0 && is_same_file(entry, &st)) {
+            result = malloc(entry->len + 1);
+            is_memory_allocated(result);
+            memcpy(result, entry->content, entry->len + 1);
+            include_bytes_cached += entry->len;
+            break;
+        }
     }
-    return elements_count;
+    pthread_mutex_unlock(&include_cache_mutex);
+    if (result != NULL) return result;
+
+    //reading is done without the lock, so other documents are not blocked by the disk
+    char* content = get_file_content(filename);
+    if (content == NULL) return NULL;
+    escape_tag_symbols(content);
+    uint64_t len = strlen(content);
+    result = malloc(len + 1);
+    is_memory_allocated(result);
+    memcpy(result, content, len + 1);
+
+    pthread_mutex_lock(&include_cache_mutex);
+    include_bytes_read += len;
+    include_entry** link = &include_cache[bucket];
+    while (*link != NULL && strcmp((*link)->path, filename) != 0) link = &(*link)->next;
+    include_entry* entry = *link;
+    if (entry == NULL) {
+        entry = calloc(1, sizeof(include_entry));
+        is_memory_allocated(entry);
+        entry->path = strdup(filename);
+        is_memory_allocated(entry->path);
+        *link = entry;
+    } else free(entry->content);//file was changed since it was cached
+    entry->dev = st.st_dev;
+    entry->ino = st.st_ino;
+    entry->size = st.st_size;
+    entry->mtime = st.st_mtim;
+    entry->content = content;
+    entry->len = len;
+    pthread_mutex_unlock(&include_cache_mutex);
+    return result;
 }
 
-char** get_tag_attributes(char* tag)
+void print_include_cache_stats(void)
 {
-    char** attrs = NULL;
-    if (have_attributes(tag) != 0) {
-        attrs = (char**)calloc(have_attributes(tag),  sizeof(char*));
-        is_memory_allocated(attrs);
-        char** tag_attr = split(' ', tag);
-        free(tag_attr[0]);
-        for (uint16_t i = 1; i < have_attributes(tag); i++) {
-            attrs[i-1] = calloc(strlen(tag_attr[i]) + 1, sizeof(char));
-            is_memory_allocated(attrs[i-1]);
-            strcpy(attrs[i-1], tag_attr[i]);
-            free(tag_attr[i]);
+    pthread_mutex_lock(&include_cache_mutex);
+    if (include_bytes_read + include_bytes_cached > 0) {
+        printf("include cache: %llu bytes read, %llu bytes served from cache\n",
+               (unsigned long long)include_bytes_read, (unsigned long long)include_bytes_cached);
+    }
+    pthread_mutex_unlock(&include_cache_mutex);
+}
+
+void free_include_cache(void)
+{
+    pthread_mutex_lock(&include_cache_mutex);
+    for (uint16_t i = 0; i < INCLUDE_CACHE_SIZE; i++) {
+        include_entry* entry = include_cache[i];
+        while (entry != NULL) {
+            include_entry* next = entry->next;
+            free(entry->path);
+            free(entry->content);
+            free(entry);
+            entry = next;
         }
-        free(tag_attr);
-        attrs[have_attributes(tag) - 1] = NULL;
+        include_cache[i] = NULL;
     }
-    return attrs;
+    pthread_mutex_unlock(&include_cache_mutex);
 }
 
-char* get_tag_name(char* tag)
+
+/***************************************************************************
+* functions for working with fragments
+***************************************************************************/
+//.tml files inserted with <insert tml ...> are rendered once per document
+//width and the result is shared by all documents that include them
+#define MAX_INCLUDE_DEPTH 16
+
+typedef struct fragment {
+    char*    path;
+    dev_t    dev;
+    ino_t    ino;
+    off_t    size;
+    struct timespec mtime;
+    uint8_t  width_start;//width the document was started with
+    uint8_t  width_in; //document width before rendering
+    uint8_t  width_out;//document width after rendering (fragment may change it)
+    char*    text;
+    struct fragment* next;
+} fragment;
+
+static fragment*       fragment_cache[INCLUDE_CACHE_SIZE];
+static pthread_mutex_t fragment_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct stat     include_stack[MAX_INCLUDE_DEPTH];
+static uint8_t         include_depth = 0;
+
+static uint8_t is_same_fragment(fragment* frg, char* filename, struct stat* st)
 {
-    int8_t attr = have_attributes(tag);
-    if (attr != 0) {
-        char** tmp = split(' ', tag);
-        char* res = strdup(tmp[0]);
-        for (uint16_t i = 0; i < get_elements_count(' ', tag); i++) free(tmp[i]);
-        free(tmp);
-        return res;
+    return frg->width_in == DOC_WIDTH && frg->width_start == START_DOC_WIDTH && strcmp(frg->path, filename) == 0 &&
+           frg->dev == st->st_dev && frg->ino == st->st_ino && frg->size == st->st_size &&
+           frg->mtime.tv_sec == st->st_mtim.tv_sec && frg->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+char* get_rendered_fragment(char* filename)
+{
+    struct stat st;
+    if (stat(filename, &st) != 0) {print_file_error(filename); return NULL;}
+    for (uint8_t i = 0; i < include_depth; i++) {
+        if (include_stack[i].st_dev == st.st_dev && include_stack[i].st_ino == st.st_ino) {
+            printf("  Error: include cycle on \"%s\". Ignoring\n", filename);
+            return NULL;
+        }
     }
-    return tag;
+    if (include_depth >= MAX_INCLUDE_DEPTH) {
+        printf("  Error: include depth limit (%d) reached on \"%s\". Ignoring\n", MAX_INCLUDE_DEPTH, filename);
+        return NULL;
+    }
+    uint32_t bucket = get_str_hash(filename) % INCLUDE_CACHE_SIZE;
+    char* result = NULL;
+    //with document variables the text depends on them, so the fragment is rendered every time
+    uint8_t cacheable = (get_doc_vars_count() == 0);
+
+    if (cacheable) {
+        pthread_mutex_lock(&fragment_cache_mutex);
+        for (fragment* frg = fragment_cache[bucket]; frg != NULL; frg = frg->next) {
+            if (is_same_fragment(frg, filename, &st)) {
+                result = strdup(frg->text);
+                is_memory_allocated(result);
+                set_doc_width(frg->width_out);
+                break;
+            }
+        }
+        pthread_mutex_unlock(&fragment_cache_mutex);
+    }
+    if (result != NULL) return result;
+
+    char* content = get_file_content(filename);
+    if (content == NULL) return NULL;
+    uint8_t width_in = DOC_WIDTH;
+    uint32_t vars_version = get_doc_vars_version();
+    include_stack[include_depth++] = st;
+    TAG_DEPTH++;//the fragment text is shared, so it must not contain splices
+    char* text = execute_all_tags(content);
+    TAG_DEPTH--;
+    include_depth--;
+    free(content);
+    escape_tag_symbols(text);
+    result = strdup(text);
+    is_memory_allocated(result);
+    //a fragment that defines variables or functions (<let>) is not shared
+    if (!cacheable || get_doc_vars_version() != vars_version) {
+        free(text);
+        return result;
+    }
+
+    fragment* frg = calloc(1, sizeof(fragment));
+    is_memory_allocated(frg);
+    frg->path = strdup(filename);
+    is_memory_allocated(frg->path);
+    frg->dev = st.st_dev;
+    frg->ino = st.st_ino;
+    frg->size = st.st_size;
+    frg->mtime = st.st_mtim;
+    frg->width_start = START_DOC_WIDTH;
+    frg->width_in = width_in;
+    frg->width_out = DOC_WIDTH;
+    frg->text = text;
+    pthread_mutex_lock(&fragment_cache_mutex);
+    frg->next = fragment_cache[bucket];
+    fragment_cache[bucket] = frg;
+    pthread_mutex_unlock(&fragment_cache_mutex);
+    return result;
 }
 
-int8_t is_valid_tag(char* tag)
+void free_fragment_cache(void)
 {
-    char* tag_name = get_tag_name(tag);
-    for (uint8_t i = 0; i < tag_count; i++) {
-        if (strcmp(tag_list[i], tag_name) == 0) {
-            if (tag != tag_name) free(tag_name);
-            return i;
+    pthread_mutex_lock(&fragment_cache_mutex);
+    for (uint16_t i = 0; i < INCLUDE_CACHE_SIZE; i++) {
+        fragment* frg = fragment_cache[i];
+        while (frg != NULL) {
+            fragment* next = frg->next;
+            free(frg->path);
+            free(frg->text);
+            free(frg);
+            frg = next;
         }
+        fragment_cache[i] = NULL;
+    }
+    pthread_mutex_unlock(&fragment_cache_mutex);
+}
+
+
+/***************************************************************************
+* functions for working with shared tag results
+***************************************************************************/
+//When a document is rendered at several widths (txtml -w 60,80,120), tags that
+//don't depend on the width are executed once and the result is shared by the
+//renders. The key is the tag with attributes and its content. Results are not
+//shared while there are document variables, <calc> may use or define them.
+#define SHARED_RESULTS_SIZE 256
+
+typedef struct shared_result {
+    char*    tag;
+    char*    content;
+    char*    result;
+    struct shared_result* next;
+} shared_result;
+
+static const char*    width_independent_tags[] = {"date", "time", "datetime", "calc", NULL};
+static shared_result* shared_results[SHARED_RESULTS_SIZE];
+static uint8_t        sharing_results = 0;
+static uint64_t       shared_results_hits = 0;
+
+static uint32_t get_shared_result_bucket(char* tag, char* content)
+{
+    return (get_str_hash(tag) ^ get_str_hash(content) * 31) % SHARED_RESULTS_SIZE;
+}
+
+void start_sharing_tag_results(void)
+{
+    sharing_results = 1;
+}
+
+//tag_name is the name of a valid tag, tag is the tag with attributes
+char* get_shared_tag_result(char* tag_name, char* tag, char* content)
+{
+    if (sharing_results == 0 || get_doc_vars_count() > 0 ||
+        in_str_array((char**)width_independent_tags, tag_name) == 0) return NULL;
+    for (shared_result* sr = shared_results[get_shared_result_bucket(tag, content)]; sr != NULL; sr = sr->next) {
+        if (strcmp(sr->tag, tag) == 0 && strcmp(sr->content, content) == 0) {
+            shared_results_hits++;
+            char* result = strdup(sr->result);
+            is_memory_allocated(result);
+            return result;
+        }
+    }
+    return NULL;
+}
+
+void add_shared_tag_result(char* tag_name, char* tag, char* content, char* result)
+{
+    if (sharing_results == 0 || get_doc_vars_count() > 0 ||
+        in_str_array((char**)width_independent_tags, tag_name) == 0) return;
+    shared_result* sr = calloc(1, sizeof(shared_result));
+    is_memory_allocated(sr);
+    sr->tag = strdup(tag);
+    is_memory_allocated(sr->tag);
+    sr->content = strdup(content);
+    is_memory_allocated(sr->content);
+    sr->result = strdup(result);
+    is_memory_allocated(sr->result);
+    uint32_t bucket = get_shared_result_bucket(tag, content);
+    sr->next = shared_results[bucket];
+    shared_results[bucket] = sr;
+}
+
+void stop_sharing_tag_results(void)
+{
+    for (uint16_t i = 0; i < SHARED_RESULTS_SIZE; i++) {
+        shared_result* sr = shared_results[i];
+        while (sr != NULL) {
+            shared_result* next = sr->next;
+            free(sr->tag);
+            free(sr->content);
+            free(sr->result);
+            free(sr);
+            sr = next;
+        }
+        shared_results[i] = NULL;
+    }
+    if (shared_results_hits > 0) printf("  shared tag results: %llu\n", (unsigned long long)shared_results_hits);
+    shared_results_hits = 0;
+    sharing_results = 0;
+}
+
+
+/***************************************************************************
+* functions for working with document variables
+***************************************************************************/
+//Variables are defined with <let> or "name = expr" lines of <calc> and live
+//until the end of the document. Expressions are compiled with them bound by
+//address, so a new value is seen without compiling again. The version changes
+//when a variable is added or the variables are cleared.
+//Functions ("name(a, b) = expr" lines) are in the same table as closures.
+#define MAX_DOC_VARS 1024
+#define MAX_VAR_NAME_LEN 63
+#define MAX_DOC_FUNCS 256
+#define MAX_FUNC_PARAMS 7
+
+typedef struct doc_func {
+    te_program* body;//parameters are the arguments of te_run_args()
+} doc_func;
+
+static char        doc_var_names[MAX_DOC_VARS][MAX_VAR_NAME_LEN + 1];
+static double      doc_var_values[MAX_DOC_VARS];
+static te_variable doc_vars[MAX_DOC_VARS];
+static uint32_t    doc_vars_count = 0;
+static uint32_t    doc_vars_version = 1;
+static doc_func    doc_funcs[MAX_DOC_FUNCS];
+static uint32_t    doc_funcs_count = 0;
+
+//length of the name at the start of str, 0 if there is no name
+uint32_t get_var_name_len(const char* str)
+{
+    if (!isalpha((unsigned char)str[0])) return 0;
+    uint32_t len = 1;
+    while (isalnum((unsigned char)str[len]) || str[len] == '_') len++;
+    return len;
+}
+
+//index of the variable or function, -1 if there is no such name
+static int32_t find_doc_var(const char* name, uint32_t len)
+{
+    for (uint32_t i = 0; i < doc_vars_count; i++) {
+        if (strncmp(doc_var_names[i], name, len) == 0 && doc_var_names[i][len] == '\0') return i;
     }
-    if (tag != tag_name) free(tag_name);
     return -1;
 }
 
-int8_t is_single_tag(char* tag)
+uint8_t set_doc_var(const char* name, uint32_t len, double value)
 {
-    char* tag_name = get_tag_name(tag);
-    for (uint8_t i = 0; i < single_tags_count; i++) {
-        if (strcmp(single_tags[i], tag_name) == 0) {
-            if (tag != tag_name) free(tag_name);
-            return 1;
+    int32_t found = find_doc_var(name, len);
+    if (found >= 0) {
+        if (doc_vars[found].type != TE_VARIABLE) return 0;//a function
+        doc_var_values[found] = value;
+        return 1;
+    }
+    if (len == 0 || len > MAX_VAR_NAME_LEN || te_is_builtin(name, len) || doc_vars_count == MAX_DOC_VARS) return 0;
+    uint32_t i = doc_vars_count++;
+    memcpy(doc_var_names[i], name, len);
+    doc_var_names[i][len] = '\0';
+    doc_var_values[i] = value;
+    doc_vars[i] = (te_variable){doc_var_names[i], &doc_var_values[i], TE_VARIABLE, NULL};
+    doc_vars_version++;
+    return 1;
+}
+
+uint32_t get_doc_vars_count(void)
+{
+    return doc_vars_count;
+}
+
+//changes when variables or functions are defined or cleared
+uint32_t get_doc_vars_version(void)
+{
+    return doc_vars_version;
+}
+
+void clear_doc_vars(void)
+{
+    if (doc_vars_count == 0) return;
+    for (uint32_t i = 0; i < doc_funcs_count; i++) te_program_free(doc_funcs[i].body);
+    doc_funcs_count = 0;
+    doc_vars_count = 0;
+    doc_vars_version++;
+}
+
+//Defines the variable of the "name = expr" line, returns 0 if it is not such a line.
+//The value is put into value and error is not 0 if the expression has an error.
+uint8_t define_doc_var(const char* line, double* value, int* error)
+{
+    while (*line == ' ' || *line == '\t') line++;
+    uint32_t len = get_var_name_len(line);
+    const char* eq = &line[len];
+    while (*eq == ' ' || *eq == '\t') eq++;
+    if (len == 0 || *eq != '=') return 0;
+    *value = eval_cached_expr(eq + 1, error);
+    if (*error == 0 && set_doc_var(line, len, *value) == 0) {
+        printf("  Error: can't define the variable \"%.*s\". Ignoring\n", (int)len, line);
+    }
+    return 1;
+}
+
+
+/***************************************************************************
+* functions for working with the expression cache
+***************************************************************************/
+//Compiled expressions of <calc> and table cells are kept by their text, so the
+//same expression is parsed once. The cache is bounded: when it is full, an
+//entry is evicted with the CLOCK algorithm (entries used since the last pass of
+//the hand get a second chance). Entries being evaluated by other threads are
+//not evicted. Expressions with names of document variables are kept for the
+//version of the variables they were compiled with.
+//Expressions are kept as bytecode (te_run()). The tree is parsed in an arena on
+//the stack, so compiling takes no allocations for the nodes.
+#define EXPR_CACHE_SIZE    4096
+#define EXPR_CACHE_BUCKETS 8192
+#define MAX_CACHED_EXPR_LEN 1024
+#define EXPR_ARENA_SIZE    8192 //bytes for the nodes of an expression on the stack
+
+typedef struct expr_entry {
+    char*    text;   //normalized expression, NULL - free entry
+    te_expr* expr;   //tree of an expression that can't be lowered, NULL - no tree
+    te_program* program;//bytecode of the expression, NULL - the tree is evaluated
+    int      error;
+    uint32_t version;//version of the document variables, 0 - no variables
+    uint32_t hash;
+    uint32_t users;  //threads evaluating the expression now
+    uint8_t  used;   //used since the last pass of the clock hand
+    uint32_t next;   //next entry of the bucket + 1, 0 - no more entries
+} expr_entry;
+
+static expr_entry      expr_cache[EXPR_CACHE_SIZE];
+static uint32_t        expr_buckets[EXPR_CACHE_BUCKETS];//first entry + 1, 0 - empty bucket
+static uint32_t        expr_clock_hand = 0;
+static uint32_t        expr_count = 0;
+static pthread_mutex_t expr_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t        expr_hits = 0;
+static uint64_t        expr_misses = 0;
+static uint64_t        expr_evictions = 0;
+
+static uint8_t is_token_sym(char sym)
+{
+    return isalnum((unsigned char)sym) || sym == '.' || sym == '_';
+}
+
+//the text ends with the start of an exponent like "1e" or "1e-"
+static uint8_t is_exponent_start(const char* str, uint32_t len)
+{
+    if (len > 0 && (str[len - 1] == '+' || str[len - 1] == '-')) len--;
+    return len > 1 && (str[len - 1] == 'e' || str[len - 1] == 'E') &&
+           (isdigit((unsigned char)str[len - 2]) || str[len - 2] == '.');
+}
+
+//Spaces that tinyexpr skips are dropped, except one between two symbols of
+//names or numbers and one inside an exponent ("1e -5" is not 1e-5).
+static void normalize_expr(const char* str, char* out)
+{
+    uint32_t len = 0;
+    uint8_t space = 0;
+    for (; *str != '\0'; str++) {
+        if (*str == ' ' || *str == '\t' || *str == '\n' || *str == '\r') {
+            space = 1;
+            continue;
         }
+        if (space && len > 0 && ((is_token_sym(out[len - 1]) && is_token_sym(*str)) ||
+                                 (is_exponent_start(out, len) && (*str == '+' || *str == '-' || is_token_sym(*str))))) {
+            out[len++] = ' ';
+        }
+        space = 0;
+        out[len++] = *str;
     }
-    if (tag != tag_name) free(tag_name);
-    return 0;
+    out[len] = '\0';
 }
 
-char* get_open_tag(char* tag)
+//the expression has names that are not builtin, they may be document variables
+static uint8_t have_var_names(const char* str)
 {
-    char* open_tag = (char*)calloc(strlen(tag) + 3,  sizeof(char));
-    is_memory_allocated(open_tag);
-    sprintf(open_tag, "<%s>", tag);
-    return open_tag;
+    for (uint32_t i = 0; str[i] != '\0'; i++) {
+        if (i > 0 && (isalnum((unsigned char)str[i - 1]) || str[i - 1] == '.' || str[i - 1] == '_')) continue;
+        uint32_t len = get_var_name_len(&str[i]);
+        if (len > 0 && !te_is_builtin(&str[i], len)) return 1;
+        if (len > 0) i += len - 1;
+    }
+    return 0;
 }
 
-char* get_close_tag(char* tag)
+static expr_entry* find_expr(const char* text, uint32_t hash, uint32_t version)
 {
-    char* t_tag = strdup(tag);
-    t_tag = rm_spaces_start_end(t_tag);
-    if (is_single_tag(t_tag) == 0) {
-        char* close_tag = NULL;
-        char* tag_name = get_tag_name(t_tag);
-        close_tag = (char*) calloc(strlen(tag_name) + 4,  sizeof(char));
-        is_memory_allocated(close_tag);
-        sprintf(close_tag, "</%s>", tag_name);
-        free(tag_name);
-        if (t_tag != tag_name) free(t_tag);
-        return close_tag;
-    } else {
-        free(t_tag);
-        return get_open_tag(tag);
+    for (uint32_t e = expr_buckets[hash % EXPR_CACHE_BUCKETS]; e != 0; e = expr_cache[e - 1].next) {
+        expr_entry* entry = &expr_cache[e - 1];
+        if (entry->hash == hash && entry->version == version && strcmp(entry->text, text) == 0) return entry;
     }
+    return NULL;
 }
 
-char* get_tag(const char* str)
+//a free entry, the clock hand evicts one if the cache is full
+static expr_entry* get_free_expr_entry(void)
 {
-    if (str == NULL) return NULL;
-    char* tag = NULL;
-    char* start = strchr(str, '<') + 1;
-    char* end = strchr(str, '>');
-    if (start == NULL || end == NULL) return NULL;
-    if (end > start) {
-        if (*start != '/') {
-            tag = (char*)calloc(end - start + 1,  sizeof(char));
-            is_memory_allocated(tag);
-            memcpy(tag, start, end - start);
-            tag[end - start] = '\0';
+    if (expr_count < EXPR_CACHE_SIZE) return &expr_cache[expr_count++];
+    while (1) {
+        expr_entry* entry = &expr_cache[expr_clock_hand];
+        expr_clock_hand = (expr_clock_hand + 1) % EXPR_CACHE_SIZE;
+        if (__atomic_load_n(&entry->users, __ATOMIC_ACQUIRE) > 0) continue;
+        if (entry->used) {
+            entry->used = 0;
+            continue;
         }
+        uint32_t* link = &expr_buckets[entry->hash % EXPR_CACHE_BUCKETS];
+        while (*link != (uint32_t)(entry - expr_cache) + 1) link = &expr_cache[*link - 1].next;
+        *link = entry->next;
+        free(entry->text);
+        te_free(entry->expr);
+        te_program_free(entry->program);
+        memset(entry, 0, sizeof(expr_entry));
+        expr_evictions++;
+        return entry;
     }
-    return tag;
 }
 
-char* get_tag_content(char* str, char* tag)
+static expr_entry* add_expr(const char* text, uint32_t hash, uint32_t version, te_program* program,
+                            te_expr* expr, int error)
 {
-    char* tag_content = NULL;
-    if (is_single_tag(tag) != 0) {
-        tag_content = (char *) calloc(3,  sizeof(char));
-        is_memory_allocated(tag_content);
-        strcpy(tag_content, " ");
-        return tag_content;
+    expr_entry* entry = get_free_expr_entry();
+    entry->text = strdup(text);
+    is_memory_allocated(entry->text);
+    entry->program = program;
+    entry->expr = expr;
+    entry->error = error;
+    entry->version = version;
+    entry->hash = hash;
+    entry->next = expr_buckets[hash % EXPR_CACHE_BUCKETS];
+    expr_buckets[hash % EXPR_CACHE_BUCKETS] = (entry - expr_cache) + 1;
+    return entry;
+}
+
+//bytecode of the expression, the tree is compiled with malloc() and kept only if
+//it can't be lowered. NULL and NULL tree if the expression has an error
+static te_program* compile_expr(const char* str, const te_variable* vars, int vars_count, te_expr** tree, int* error)
+{
+    char buffer[EXPR_ARENA_SIZE];
+    te_arena arena;
+    te_arena_init(&arena, buffer, sizeof(buffer));
+    te_expr* expr = te_compile_arena(str, vars, vars_count, error, &arena);
+    te_program* program = te_lower(expr);
+    te_arena_release(&arena);
+    *tree = (expr != NULL && program == NULL) ? te_compile(str, vars, vars_count, error) : NULL;
+    return program;
+}
+
+//same as te_interp(): NAN and not 0 error if the expression has an error
+double eval_cached_expr(const char* str, int* error)
+{
+    if (strlen(str) > MAX_CACHED_EXPR_LEN) {
+        char buffer[EXPR_ARENA_SIZE];
+        te_arena arena;
+        te_arena_init(&arena, buffer, sizeof(buffer));
+        te_expr* expr = te_compile_arena(str, doc_vars, doc_vars_count, error, &arena);
+        double value = (expr != NULL) ? te_eval(expr) : NAN;
+        te_arena_release(&arena);
+        return value;
     }
-    char* open_tag = get_open_tag(tag);
-    char* close_tag = get_close_tag(tag);
-    char *start = strstr(str, open_tag) +
-                  sizeof(char) * strlen(open_tag);
-    char *end = strstr(str, close_tag);
-    free(open_tag);
-    free(close_tag);
-    if (end == NULL || end - start == 0) {
-        tag_content = (char *)  calloc(3,  sizeof(char));
-        is_memory_allocated(tag_content);
-        if (end != NULL && end - start == 0) {
-            strcpy(tag_content, "\v");
-        } 
-        if (end == NULL) {
-            strcpy(tag_content, "\r");
+    char text[MAX_CACHED_EXPR_LEN + 1];
+    normalize_expr(str, text);
+    uint32_t hash = get_str_hash(text);
+    uint32_t version = (doc_vars_count > 0 && have_var_names(text)) ? doc_vars_version : 0;
+
+    pthread_mutex_lock(&expr_cache_mutex);
+    expr_entry* entry = find_expr(text, hash, version);
+    if (entry == NULL) {
+        expr_misses++;
+        pthread_mutex_unlock(&expr_cache_mutex);
+        //compiled without the lock, so another thread may add the expression meanwhile
+        int compile_error = 0;
+        te_expr* expr;
+        te_program* program = compile_expr(text, (version > 0) ? doc_vars : NULL, (version > 0) ? doc_vars_count : 0,
+                                           &expr, &compile_error);
+        pthread_mutex_lock(&expr_cache_mutex);
+        entry = find_expr(text, hash, version);
+        if (entry != NULL) {
+            te_free(expr);
+            te_program_free(program);
+        } else {
+            entry = add_expr(text, hash, version, program, expr, compile_error);
         }
-        return tag_content;
+    } else {
+        expr_hits++;
     }
-    tag_content = (char *) calloc(end - start + 1, sizeof(char));
-    is_memory_allocated(tag_content);
-    memcpy(tag_content, start, end - start);
-    tag_content[end - start] = '\0';
+    entry->used = 1;
+    __atomic_add_fetch(&entry->users, 1, __ATOMIC_ACQUIRE);//the entry is not evicted while it is used
+    pthread_mutex_unlock(&expr_cache_mutex);
 
-    if (tag_content[0] == '\n') {
-        char *tmp = calloc(strlen(tag_content), sizeof(char));
-        is_memory_allocated(tmp);
-        strcpy(tmp, &tag_content[1]);
-        free(tag_content);
-        tag_content = tmp;
+    *error = entry->error;
+    double value = (entry->program != NULL) ? te_run(entry->program) :
+                   (entry->expr != NULL) ? te_eval(entry->expr) : NAN;
+    __atomic_sub_fetch(&entry->users, 1, __ATOMIC_RELEASE);
+    return value;
+}
+
+void print_expr_cache_stats(void)
+{
+    pthread_mutex_lock(&expr_cache_mutex);
+    uint64_t lookups = expr_hits + expr_misses;
+    if (lookups > 0) {
+        printf("expression cache: %llu hits, %llu misses, %llu evictions, hit rate %.1f%%\n",
+               (unsigned long long)expr_hits, (unsigned long long)expr_misses,
+               (unsigned long long)expr_evictions, 100.0 * expr_hits / lookups);
     }
-    if (tag_content[strlen(tag_content) - 1] == '\n') tag_content[strlen(tag_content) - 1] = '\0';
+    pthread_mutex_unlock(&expr_cache_mutex);
+}
 
-    return tag_content;
+void free_expr_cache(void)
+{
+    pthread_mutex_lock(&expr_cache_mutex);
+    for (uint32_t i = 0; i < expr_count; i++) {
+        free(expr_cache[i].text);
+        te_free(expr_cache[i].expr);
+        te_program_free(expr_cache[i].program);
+    }
+    memset(expr_cache, 0, sizeof(expr_cache));
+    memset(expr_buckets, 0, sizeof(expr_buckets));
+    expr_count = 0;
+    expr_clock_hand = 0;
+    pthread_mutex_unlock(&expr_cache_mutex);
+}
+
+
+/***************************************************************************
+* functions for working with document functions
+***************************************************************************/
+//Functions are defined with "name(a, b) = expr" lines of <let> or <calc> and
+//live until the end of the document like the variables. They are kept in the
+//table of the variables as closures, so <calc> and table cells call the body
+//compiled once instead of parsing it again.
+
+//The context of the closure is the doc_func. Every call has its own arguments,
+//so the body may run on several threads.
+static double call_doc_func0(void* f)
+{
+    return te_run_args(((doc_func*)f)->body, NULL);
+}
+
+static double call_doc_func1(void* f, double a)
+{
+    return te_run_args(((doc_func*)f)->body, (double[]){a});
+}
+
+static double call_doc_func2(void* f, double a, double b)
+{
+    return te_run_args(((doc_func*)f)->body, (double[]){a, b});
+}
+
+static double call_doc_func3(void* f, double a, double b, double c)
+{
+    return te_run_args(((doc_func*)f)->body, (double[]){a, b, c});
+}
+
+static double call_doc_func4(void* f, double a, double b, double c, double d)
+{
+    return te_run_args(((doc_func*)f)->body, (double[]){a, b, c, d});
+}
+
+static double call_doc_func5(void* f, double a, double b, double c, double d, double e)
+{
+    return te_run_args(((doc_func*)f)->body, (double[]){a, b, c, d, e});
+}
+
+static double call_doc_func6(void* f, double a, double b, double c, double d, double e, double g)
+{
+    return te_run_args(((doc_func*)f)->body, (double[]){a, b, c, d, e, g});
+}
+
+static double call_doc_func7(void* f, double a, double b, double c, double d, double e, double g, double h)
+{
+    return te_run_args(((doc_func*)f)->body, (double[]){a, b, c, d, e, g, h});
+}
+
+static const void* doc_func_calls[MAX_FUNC_PARAMS + 1] = {
+    call_doc_func0, call_doc_func1, call_doc_func2, call_doc_func3,
+    call_doc_func4, call_doc_func5, call_doc_func6, call_doc_func7
+};
+
+//the name is a function of the document
+static uint8_t is_doc_func(const char* name, uint32_t len)
+{
+    int32_t found = (doc_funcs_count > 0) ? find_doc_var(name, len) : -1;
+    return found >= 0 && doc_vars[found].type != TE_VARIABLE;
+}
+
+//adds the functions of the document to vars, returns their number
+static uint32_t add_doc_funcs(te_variable* vars)
+{
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < doc_vars_count && doc_funcs_count > 0; i++) {
+        if (doc_vars[i].type != TE_VARIABLE) vars[count++] = doc_vars[i];
+    }
+    return count;
+}
+
+//parameters of "(a, b)" are put into params, returns the length of the list or 0 if it is wrong
+static uint32_t get_func_params(const char* str, char params[][MAX_VAR_NAME_LEN + 1], uint8_t* count)
+{
+    const char* p = str + 1;//'('
+    *count = 0;
+    while (*p == ' ' || *p == '\t') p++;
+    while (*p != ')') {
+        uint32_t len = get_var_name_len(p);
+        if (len == 0 || len > MAX_VAR_NAME_LEN || *count == MAX_FUNC_PARAMS) return 0;
+        memcpy(params[*count], p, len);
+        params[(*count)++][len] = '\0';
+        p += len;
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == ',') {
+            p++;
+            while (*p == ' ' || *p == '\t') p++;
+        } else if (*p != ')') {
+            return 0;
+        }
+    }
+    return p - str + 1;
+}
+
+//Defines the function of the "name(a, b) = expr" line, returns 0 if it is not such a line.
+//The body is compiled once into bytecode, the parameters are its arguments and names
+//of the body are variables and functions defined before. A function may be defined
+//again, expressions compiled after it call the new one.
+uint8_t define_doc_func(const char* line)
+{
+    while (*line == ' ' || *line == '\t') line++;
+    uint32_t len = get_var_name_len(line);
+    if (len == 0 || line[len] != '(') return 0;
+    char params[MAX_FUNC_PARAMS][MAX_VAR_NAME_LEN + 1];
+    uint8_t params_count;
+    uint32_t params_len = get_func_params(&line[len], params, &params_count);
+    const char* eq = &line[len + params_len];
+    while (*eq == ' ' || *eq == '\t') eq++;
+    if (params_len == 0 || *eq != '=') return 0;
+
+    //parameters are bound to args and hide the variables with the same names
+    double args[MAX_FUNC_PARAMS];
+    te_variable* vars = calloc(doc_vars_count + MAX_FUNC_PARAMS, sizeof(te_variable));
+    is_memory_allocated(vars);
+    for (uint8_t k = 0; k < params_count; k++) vars[k] = (te_variable){params[k], &args[k], TE_VARIABLE, NULL};
+    memcpy(&vars[params_count], doc_vars, doc_vars_count * sizeof(te_variable));
+    char buffer[EXPR_ARENA_SIZE];
+    te_arena arena;
+    te_arena_init(&arena, buffer, sizeof(buffer));
+    int error;
+    te_expr* expr = te_compile_arena(eq + 1, vars, params_count + doc_vars_count, &error, &arena);
+    te_program* body = te_lower_function(expr, args, params_count);
+    te_arena_release(&arena);
+    free(vars);
+
+    int32_t found = find_doc_var(line, len);
+    uint8_t ok = (body != NULL && doc_funcs_count < MAX_DOC_FUNCS && len <= MAX_VAR_NAME_LEN && !te_is_builtin(line, len));
+    if (found >= 0 && doc_vars[found].type == TE_VARIABLE) ok = 0;
+    if (found < 0 && doc_vars_count == MAX_DOC_VARS) ok = 0;
+    if (ok == 0) {
+        printf("  Error: can't define the function \"%.*s\". Ignoring\n", (int)len, line);
+        te_program_free(body);
+        return 1;
+    }
+    doc_func* f = &doc_funcs[doc_funcs_count++];
+    f->body = body;
+    uint32_t i = (found >= 0) ? (uint32_t)found : doc_vars_count++;
+    memcpy(doc_var_names[i], line, len);
+    doc_var_names[i][len] = '\0';
+    doc_vars[i] = (te_variable){doc_var_names[i], doc_func_calls[params_count], TE_CLOSURE0 + params_count, f};
+    doc_vars_version++;
+    return 1;
+}
+
+
+/***************************************************************************
+* functions for working with splices
+***************************************************************************/
+//Large files inserted at the top level of a document are not copied into the
+//text. insert() puts the marker "\x1e<index>\x1f" instead, and write_result()
+//copies the file into the output with copy_file_range()/sendfile().
+//Large top-level tables are kept as a marker too and are rendered straight
+//into the output by write_table_stream().
+const uint32_t SPLICE_THRESHOLD = 1024 * 1024;
+
+typedef struct file_splice {
+    char*         path;  //inserted file or NULL for a table
+    char*         text;  //table text
+    table_options opt;
+} file_splice;
+
+static file_splice* splices = NULL;
+static uint32_t splices_count = 0;
+
+static uint32_t add_splice(void)
+{
+    splices = realloc(splices, (splices_count + 1) * sizeof(file_splice));
+    is_memory_allocated(splices);
+    memset(&splices[splices_count], 0, sizeof(file_splice));
+    return splices_count++;
+}
+
+uint32_t add_file_splice(char* filename)
+{
+    uint32_t index = add_splice();
+    splices[index].path = strdup(filename);
+    is_memory_allocated(splices[index].path);
+    return index;
+}
+
+uint32_t add_table_splice(char* tbl_str, const table_options* opt)
+{
+    uint32_t index = add_splice();
+    splices[index].text = strdup(tbl_str);
+    is_memory_allocated(splices[index].text);
+    splices[index].opt = *opt;
+    return index;
+}
+
+char* get_splice_marker(uint32_t index)
+{
+    char* marker = calloc(16, sizeof(char));
+    is_memory_allocated(marker);
+    sprintf(marker, "\x1e%u\x1f", index);
+    return marker;
+}
+
+uint8_t write_splice(FILE* file, uint32_t index)
+{
+    if (splices[index].path == NULL) {
+        return write_table_stream(file, splices[index].text, &splices[index].opt);
+    }
+    char* path = splices[index].path;
+    int in = open(path, O_RDONLY);
+    if (in < 0) {print_file_error(path); return 0;}
+    struct stat st;
+    if (fstat(in, &st) != 0 || st.st_size == 0) {close(in); return 1;}
+    uint64_t size = st.st_size;
+    char* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, in, 0);
+    if (data == MAP_FAILED) {print_file_error(path); close(in); return 0;}
+    madvise(data, size, MADV_SEQUENTIAL);
+
+    fflush(file);
+    uint8_t ok = 0;
+    if (get_span_without(data, size, "\f\a\r\v", 4) == size) {
+        ok = copy_file_data(in, fileno(file), data, size);
+    } else {
+        //same replacements as for the document text: \f -> <, \a -> >, \r and \v -> space
+        char buf[65536];
+        ok = 1;
+        for (uint64_t i = 0; i < size && ok; i += sizeof(buf)) {
+            uint64_t len = (size - i < sizeof(buf)) ? size - i : sizeof(buf);
+            memcpy(buf, &data[i], len);
+            replace_service_symbols(buf, len);
+            ok = write_all(fileno(file), buf, len);
+        }
+    }
+    munmap(data, size);
+    close(in);
+    fseek(file, 0, SEEK_CUR);//sync stream position with the descriptor
+    return ok;
+}
+
+void write_result(FILE* file, char* str)
+{
+    char* start = str;
+    char* marker = (splices_count > 0) ? strchr(str, '\x1e') : NULL;
+    while (marker != NULL) {
+        char* end = marker + 1;
+        uint32_t index = 0;
+        while (isdigit(*end)) index = index * 10 + (*end++ - '0');
+        if (end != marker + 1 && *end == '\x1f' && index < splices_count) {
+            fwrite(start, 1, marker - start, file);
+            write_splice(file, index);
+            start = end + 1;
+        }
+        marker = strchr(marker + 1, '\x1e');
+    }
+    fwrite(start, 1, strlen(start), file);
+}
+
+void clear_splices(void)
+{
+    for (uint32_t i = 0; i < splices_count; i++) {
+        free(splices[i].path);
+        free(splices[i].text);
+        free_table_options(&splices[i].opt);
+    }
+    free(splices);
+    splices = NULL;
+    splices_count = 0;
+}
+
+
+/***************************************************************************
+* functions for working with packs
+***************************************************************************/
+//Pack is a single file with many named documents:
+//  header | name\0 data\0 ... | pack_entry[docs_count] | uint32_t buckets[buckets_count]
+//Names are found through the hash buckets, documents are read through mmap and
+//are NUL-terminated, so they can be used as strings directly.
+static const char pack_magic[8] = {'T', 'M', 'L', 'P', 'A', 'C', 'K', '1'};
+
+//the array of count elements of the size at the offset is in the pack and aligned like finish_pack() does
+static uint8_t is_in_pack(const pack* pk, uint64_t offset, uint64_t count, uint64_t size)
+{
+    return offset <= pk->size && offset % 8 == 0 && count <= (pk->size - offset) / size;
+}
+
+//every offset, length and index of the pack is checked once, so the pack
+//functions can trust them: a broken pack must not crash or hang txtml
+static uint8_t is_valid_pack(pack* pk)
+{
+    const pack_header* h = pk->header;
+    if (memcmp(h->magic, pack_magic, sizeof(pack_magic)) != 0 || h->buckets_count == 0 ||
+        !is_in_pack(pk, h->index_offset, h->docs_count, sizeof(pack_entry)) ||
+        !is_in_pack(pk, h->buckets_offset, h->buckets_count, sizeof(uint32_t))) return 0;
+    pk->entries = (const pack_entry*)&pk->data[h->index_offset];
+    pk->buckets = (const uint32_t*)&pk->data[h->buckets_offset];
+    for (uint32_t i = 0; i < h->docs_count; i++) {
+        const pack_entry* e = &pk->entries[i];
+        //the name and the data end with '\0' inside the pack
+        if (e->name_offset >= pk->size || e->name_len >= pk->size - e->name_offset ||
+            pk->data[e->name_offset + e->name_len] != '\0' ||
+            e->data_offset >= pk->size || e->data_len >= pk->size - e->data_offset ||
+            pk->data[e->data_offset + e->data_len] != '\0') return 0;
+        //chains go to the next documents only, so they can't loop
+        if (e->next != UINT32_MAX && (e->next <= i || e->next >= h->docs_count)) return 0;
+    }
+    for (uint32_t i = 0; i < h->buckets_count; i++) {
+        if (pk->buckets[i] != UINT32_MAX && pk->buckets[i] >= h->docs_count) return 0;
+    }
+    return 1;
+}
+
+uint8_t open_pack(char* filename, pack* pk)
+{
+    memset(pk, 0, sizeof(pack));
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {print_file_error(filename); return 0;}
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(pack_header)) {
+        printf("  Error: \"%s\" is not a pack\n", filename);
+        close(fd);
+        return 0;
+    }
+    pk->size = st.st_size;
+    pk->data = mmap(NULL, pk->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (pk->data == MAP_FAILED) {print_file_error(filename); pk->data = NULL; return 0;}
+
+    pk->header = (const pack_header*)pk->data;
+    if (is_valid_pack(pk) == 0) {
+        printf("  Error: \"%s\" is not a pack\n", filename);
+        close_pack(pk);
+        return 0;
+    }
+    return 1;
+}
+
+void close_pack(pack* pk)
+{
+    if (pk->data != NULL) munmap(pk->data, pk->size);
+    memset(pk, 0, sizeof(pack));
+}
+
+int64_t find_in_pack(const pack* pk, char* name)
+{
+    uint32_t i = pk->buckets[get_str_hash(name) % pk->header->buckets_count];
+    while (i < pk->header->docs_count) {
+        if (strcmp(get_pack_doc_name(pk, i), name) == 0) return i;
+        i = pk->entries[i].next;
+    }
+    return -1;
+}
+
+char* get_pack_doc_name(const pack* pk, uint32_t index)
+{
+    return &pk->data[pk->entries[index].name_offset];
+}
+
+char* get_pack_doc(const pack* pk, uint32_t index)
+{
+    return &pk->data[pk->entries[index].data_offset];
+}
+
+uint8_t create_pack(char* filename, pack_writer* pw)
+{
+    memset(pw, 0, sizeof(pack_writer));
+    pw->file = fopen(filename, "wb");
+    if (pw->file == NULL) {print_file_error(filename); return 0;}
+    pw->filename = filename;
+    pack_header header = {{0}, 0, 0, 0, 0};
+    fwrite(&header, sizeof(header), 1, pw->file);//real header is written by finish_pack()
+    return 1;
+}
+
+static pack_entry* add_pack_entry(pack_writer* pw, char* name)
+{
+    if ((pw->count & (pw->count - 1)) == 0) {//grow on powers of two
+        uint32_t size = (pw->count == 0) ? 1 : pw->count * 2;
+        pw->entries = realloc(pw->entries, size * sizeof(pack_entry));
+        is_memory_allocated(pw->entries);
+        pw->hashes = realloc(pw->hashes, size * sizeof(uint32_t));
+        is_memory_allocated(pw->hashes);
+    }
+    pack_entry* entry = &pw->entries[pw->count];
+    pw->hashes[pw->count] = get_str_hash(name);
+    pw->count++;
+    entry->name_len = strlen(name);
+    entry->name_offset = ftell(pw->file);
+    fwrite(name, 1, entry->name_len + 1, pw->file);
+    entry->data_offset = ftell(pw->file);
+    return entry;
+}
+
+void add_to_pack(pack_writer* pw, char* name, char* str, uint64_t len)
+{
+    pack_entry* entry = add_pack_entry(pw, name);
+    fwrite(str, 1, len, pw->file);
+    fputc('\0', pw->file);
+    entry->data_len = len;
+}
+
+void add_result_to_pack(pack_writer* pw, char* name, char* result)
+{
+    pack_entry* entry = add_pack_entry(pw, name);
+    write_result(pw->file, result);
+    entry->data_len = ftell(pw->file) - entry->data_offset;
+    fputc('\0', pw->file);
+}
+
+uint8_t finish_pack(pack_writer* pw)
+{
+    pack_header header;
+    memcpy(header.magic, pack_magic, sizeof(pack_magic));
+    header.docs_count = pw->count;
+    header.buckets_count = 1;
+    while (header.buckets_count < pw->count) header.buckets_count *= 2;
+
+    uint32_t* buckets = malloc(header.buckets_count * sizeof(uint32_t));
+    is_memory_allocated(buckets);
+    memset(buckets, 0xFF, header.buckets_count * sizeof(uint32_t));
+    for (uint32_t i = pw->count; i > 0; i--) {//chains keep the order of documents
+        uint32_t bucket = pw->hashes[i - 1] % header.buckets_count;
+        pw->entries[i - 1].next = buckets[bucket];
+        buckets[bucket] = i - 1;
+    }
+    while (ftell(pw->file) % 8 != 0) fputc('\0', pw->file);
+    header.index_offset = ftell(pw->file);
+    fwrite(pw->entries, sizeof(pack_entry), pw->count, pw->file);
+    header.buckets_offset = ftell(pw->file);
+    fwrite(buckets, sizeof(uint32_t), header.buckets_count, pw->file);
+    fseek(pw->file, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, pw->file);
+
+    uint8_t ok = (ferror(pw->file) == 0);
+    if (fclose(pw->file) != 0) ok = 0;
+    if (ok == 0) print_file_error(pw->filename);
+    free(buckets);
+    free(pw->entries);
+    free(pw->hashes);
+    memset(pw, 0, sizeof(pack_writer));
+    return ok;
+}
+
+
+/***************************************************************************
+* functions for working with TAGS
+***************************************************************************/
+char tag_list[][20] = { "date", "time", "datetime", "right", "center", "h1", "h2", "h3", "h4",
+                        "doc_width", "def_width", "sep", "p", "frame", "list", "lines", "calc", "table",
+                        "histogram", "insert", "let", "stats"};
+const int tag_count = sizeof(tag_list) / sizeof(tag_list[0]);
+char* (*tag_functions[])(char*, char**) = { get_date, get_time, get_datetime, right, center, h1,
+                                            h2, h3, h4, doc_width, def_width, separator, p, get_framed_text,
+                                            get_list, get_lines, calc, get_table, get_histogram, insert, let, stats };
+char single_tags[][20] = { "date", "time", "datetime", "doc_width", "def_width", "sep", "lines", "insert" };
+const int single_tags_count = sizeof(single_tags) / sizeof(single_tags[0]);
+
+
+uint16_t TAG_DEPTH = 0;//nesting level of the tag being executed
+
+
+int8_t have_attributes(char* tag)
+{
+    uint16_t elements_count= get_elements_count(' ', tag);
+    if (elements_count == 1) {
+        return 0;
+    }
+    return elements_count;
+}
+
+char** get_tag_attributes(char* tag)
+{
+    char** attrs = NULL;
+    if (have_attributes(tag) != 0) {
+        attrs = (char**)calloc(have_attributes(tag),  sizeof(char*));
+        is_memory_allocated(attrs);
+        char** tag_attr = split(' ', tag);
+        free(tag_attr[0]);
+        for (uint16_t i = 1; i < have_attributes(tag); i++) {
+            attrs[i-1] = calloc(strlen(tag_attr[i]) + 1, sizeof(char));
+            is_memory_allocated(attrs[i-1]);
+            strcpy(attrs[i-1], tag_attr[i]);
+            free(tag_attr[i]);
+        }
+        free(tag_attr);
+        attrs[have_attributes(tag) - 1] = NULL;
+    }
+    return attrs;
+}
+
+char* get_tag_name(char* tag)
+{
+    int8_t attr = have_attributes(tag);
+    if (attr != 0) {
+        char** tmp = split(' ', tag);
+        char* res = strdup(tmp[0]);
+        for (uint16_t i = 0; i < get_elements_count(' ', tag); i++) free(tmp[i]);
+        free(tmp);
+        return res;
+    }
+    return tag;
+}
+
+int8_t is_valid_tag(char* tag)
+{
+    char* tag_name = get_tag_name(tag);
+    for (uint8_t i = 0; i < tag_count; i++) {
+        if (strcmp(tag_list[i], tag_name) == 0) {
+            if (tag != tag_name) free(tag_name);
+            return i;
+        }
+    }
+    if (tag != tag_name) free(tag_name);
+    return -1;
+}
+
+int8_t is_single_tag(char* tag)
+{
+    char* tag_name = get_tag_name(tag);
+    for (uint8_t i = 0; i < single_tags_count; i++) {
+        if (strcmp(single_tags[i], tag_name) == 0) {
+            if (tag != tag_name) free(tag_name);
+            return 1;
+        }
+    }
+    if (tag != tag_name) free(tag_name);
+    return 0;
+}
+
+char* get_open_tag(char* tag)
+{
+    char* open_tag = (char*)calloc(strlen(tag) + 3,  sizeof(char));
+    is_memory_allocated(open_tag);
+    sprintf(open_tag, "<%s>", tag);
+    return open_tag;
+}
+
+char* get_close_tag(char* tag)
+{
+    char* t_tag = strdup(tag);
+    t_tag = rm_spaces_start_end(t_tag);
+    if (is_single_tag(t_tag) == 0) {
+        char* close_tag = NULL;
+        char* tag_name = get_tag_name(t_tag);
+        close_tag = (char*) calloc(strlen(tag_name) + 4,  sizeof(char));
+        is_memory_allocated(close_tag);
+        sprintf(close_tag, "</%s>", tag_name);
+        free(tag_name);
+        if (t_tag != tag_name) free(t_tag);
+        return close_tag;
+    } else {
+        free(t_tag);
+        return get_open_tag(tag);
+    }
+}
+
+char* get_tag(const char* str)
+{
+    if (str == NULL) return NULL;
+    char* tag = NULL;
+    char* start = strchr(str, '<');
+    char* end = strchr(str, '>');
+    if (start == NULL || end == NULL) return NULL;
+    start++;
+    if (end > start) {
+        if (*start != '/') {
+            tag = (char*)calloc(end - start + 1,  sizeof(char));
+            is_memory_allocated(tag);
+            memcpy(tag, start, end - start);
+            tag[end - start] = '\0';
+        }
+    }
+    return tag;
+}
+
+char* get_tag_content(char* str, char* tag)
+{
+    char* tag_content = NULL;
+    if (is_single_tag(tag) != 0) {
+        tag_content = (char *) calloc(3,  sizeof(char));
+        is_memory_allocated(tag_content);
+        strcpy(tag_content, " ");
+        return tag_content;
+    }
+    char* open_tag = get_open_tag(tag);
+    char* close_tag = get_close_tag(tag);
+    char *start = strstr(str, open_tag) +
+                  sizeof(char) * strlen(open_tag);
+    char *end = strstr(str, close_tag);
+    free(open_tag);
+    free(close_tag);
+    if (end == NULL || end - start == 0) {
+        tag_content = (char *)  calloc(3,  sizeof(char));
+        is_memory_allocated(tag_content);
+        if (end != NULL && end - start == 0) {
+            strcpy(tag_content, "\v");
+        } 
+        if (end == NULL) {
+            strcpy(tag_content, "\r");
+        }
+        return tag_content;
+    }
+    tag_content = (char *) calloc(end - start + 1, sizeof(char));
+    is_memory_allocated(tag_content);
+    memcpy(tag_content, start, end - start);
+    tag_content[end - start] = '\0';
+
+    if (tag_content[0] == '\n') {
+        char *tmp = calloc(strlen(tag_content), sizeof(char));
+        is_memory_allocated(tmp);
+        strcpy(tmp, &tag_content[1]);
+        free(tag_content);
+        tag_content = tmp;
+    }
+    if (tag_content[strlen(tag_content) - 1] == '\n') tag_content[strlen(tag_content) - 1] = '\0';
+
+    return tag_content;
+}
+
+char* get_text_before_tag(char* str, char* tag)
+{
+    char* open_tag = get_open_tag(tag);
+    char* start_tag = strstr(str, open_tag);
+    char* text_before_tag = (char*)calloc(start_tag - &str[0] + 1, sizeof(char));
+    is_memory_allocated(text_before_tag);
+    memcpy(text_before_tag, &str[0], start_tag - &str[0]);
+    text_before_tag[start_tag - &str[0]] = '\0';
+    free(open_tag);
+    return text_before_tag;
+}
+
+char* get_text_after_tag(char* str, char* tag)
+{
+    char* close_tag = get_close_tag(tag);
+    char* end_tag = strstr(str, close_tag);
+    if (end_tag == NULL) {
+        if (is_valid_tag(tag) != -1) {
+            printf("  Error: no closing tag found for \"%s\". Ignoring\n", tag);
+        } else print_tag_error(tag);
+        free(close_tag);
+        close_tag = get_open_tag(tag);
+        end_tag = strstr(str, close_tag);
+    } else if (is_valid_tag(tag) == -1) print_tag_error(tag);
+    end_tag = end_tag + sizeof(char) * strlen(close_tag);
+    free(close_tag);
+    char* text_after_tag = (char*)calloc(strlen(str) - (end_tag - &str[0]) + 1, sizeof(char));
+    is_memory_allocated(text_after_tag);
+    strcpy(text_after_tag, end_tag);
+    return text_after_tag;
+}
+
+
+
+char* execute_tag(char* tag, char* tag_content)
+{
+    char* t_tag = strdup(tag);
+    t_tag = rm_spaces_start_end(t_tag);
+    int8_t tag_i = is_valid_tag(t_tag);
+    
+    if (tag_i != -1 && strcmp(tag_content, "\r") != 0) {
+        char* shared = get_shared_tag_result(tag_list[tag_i], t_tag, tag_content);
+        if (shared != NULL) {
+            free(t_tag);
+            return shared;
+        }
+        char** attr = get_tag_attributes(t_tag);
+        char* tag_result = (*tag_functions[tag_i])(tag_content, attr);
+        add_shared_tag_result(tag_list[tag_i], t_tag, tag_content, tag_result);
+        for (uint16_t i = 0; i < have_attributes(tag) - 1; i++) {
+            if (attr[i] != NULL) free(attr[i]);
+            else break;
+        }
+        free(t_tag);
+        free(attr);
+        return tag_result;
+    }
+    free(t_tag);
+    return tag_content;
+}
+
+char* execute_nested_tags(char* str)
+{
+    char* tag = get_tag(str);
+    if (tag != NULL) {
+        char* t_tag = strdup(tag);
+        t_tag = rm_spaces_start_end(t_tag);
+
+        char* tag_content = get_tag_content(str, tag);
+        TAG_DEPTH++;
+        char* res = execute_nested_tags(tag_content);
+        TAG_DEPTH--;
+
+        char* text_before_tag = get_text_before_tag(str, tag);
+        char* text_after_tag = get_text_after_tag(str, t_tag);
+
+        char* result = NULL;
+        char* tag_result = execute_tag(tag, res);
+        uint32_t len = strlen(text_before_tag) + strlen(tag_result) + strlen(text_after_tag) + 1;
+        result = (char*)calloc(len,  sizeof(char));
+        is_memory_allocated(result);
+        sprintf(result, "%s%s%s", text_before_tag, tag_result, text_after_tag);
+        free(text_before_tag);
+        free(tag_result);
+        free(text_after_tag);
+        free(t_tag);
+        if (tag_content != tag_result) free(tag_content);
+        if (res != tag_content) free(res);
+        free(tag);
+        return result;
+    }
+    free(tag);
+    return str;
+}
+
+char* execute_all_tags(char* str)
+{
+    //Text before the first '<' or '>' is not changed by the following passes,
+    //so it goes to the result once instead of being copied on every pass
+    str_buf result = {NULL, 0, 0};
+    uint64_t len = strlen(str);
+    uint64_t span = get_span_without(str, len, "<>", 2);
+    append_to_buf(&result, str, span);
+    if (span == len) return result.str;
+
+    char* text = strdup(&str[span]);
+    is_memory_allocated(text);
+    char* current = text;
+    char* tag = get_tag(current);
+    while (tag != NULL) {
+        char* tmp = execute_nested_tags(current);
+        free(text);
+        free(tag);
+        text = tmp;
+        len = strlen(text);
+        span = get_span_without(text, len, "<>", 2);
+        append_to_buf(&result, text, span);
+        current = &text[span];
+        tag = get_tag(current);
+    }
+    append_to_buf(&result, current, strlen(current));
+    free(text);
+    return result.str;
+}
+
+
+
+/***************************************************************************
+* functions for working with strings
+***************************************************************************/
+uint16_t get_elements_count(char sym, char* str)
+{
+    uint16_t count = 0;
+    char* delims = calloc(3,  sizeof(char));
+    is_memory_allocated(delims);
+    sprintf(delims, "%c", sym);
+    char* temp_str = strdup(str);
+    char* token = strtok(temp_str, delims);
+    while (token != NULL) {
+        count++;
+        token = strtok(NULL, delims);
+    }
+    free(delims);
+    free(temp_str);
+    return count;
+}
+
+char** split(char sym, char* str)
+{
+    char* delims = calloc(3, sizeof(char));
+    is_memory_allocated(delims);
+    sprintf(delims, "%c", sym);
+    uint16_t count = get_elements_count(sym, str);
+    char** elements = (char**)calloc(count, sizeof(char*));
+    is_memory_allocated(elements);
+    char* temp_str = strdup(str);
+    count = 0;
+    char* token = strtok(temp_str, delims);
+    while (token != NULL) {
+        elements[count] = strdup(token);
+        is_memory_allocated(elements[count]);
+        count++;
+        token = strtok(NULL, delims);
+    }
+    free(delims);
+    free(temp_str);
+    return elements;
+}
+
+char* get_str_from_sym(char sym, uint16_t count)
+{
+    char* str = calloc(count + 1, sizeof(char));
+    is_memory_allocated(str);
+    char* symbol = calloc(2, sizeof(char));
+    is_memory_allocated(symbol);
+    sprintf(symbol, "%c", sym);
+    for (uint16_t i = 0; i < count; i++) {
+        strcat(str, symbol);
+    }
+    free(symbol);
+    return str;
+}
+
+void change_symbols(char from, char to, char* str)
+{
+    uint64_t len = strlen(str);
+    for (uint64_t i = 0; i < len; i++) {
+        if (str[i] == from) str[i] = to;
+    }
+}
+
+void replace_service_symbols(char* str, uint64_t len)
+{
+    //\f and \a are escaped tag symbols, \r and \v mark missing and empty tag content
+    for (uint64_t i = 0; i < len; i++) {
+        char c = str[i];
+        c = (c == '\f') ? '<' : c;
+        c = (c == '\a') ? '>' : c;
+        c = (c == '\r' || c == '\v') ? ' ' : c;
+        str[i] = c;
+    }
+}
+
+uint64_t get_span_without(const char* str, uint64_t len, const char* syms, uint8_t syms_count)
+{
+    //checks 8 bytes at a time: a byte equal to sym gives a zero byte in (word ^ sym_mask)
+    const uint64_t ones = 0x0101010101010101ULL;
+    const uint64_t highs = 0x8080808080808080ULL;
+    uint64_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, &str[i], 8);
+        uint64_t found = 0;
+        for (uint8_t j = 0; j < syms_count; j++) {
+            uint64_t x = word ^ (ones * (uint8_t)syms[j]);
+            found |= (x - ones) & ~x & highs;
+        }
+        if (found != 0) return i + __builtin_ctzll(found) / 8;
+    }
+    for (; i < len; i++) {
+        if (memchr(syms, str[i], syms_count) != NULL) return i;
+    }
+    return len;
+}
+
+void append_to_buf(str_buf* buf, const char* str, uint64_t len)
+{
+    if (buf->len + len + 1 > buf->size) {
+        uint64_t size = (buf->size == 0) ? 64 : buf->size;
+        while (size < buf->len + len + 1) size *= 2;
+        buf->str = realloc(buf->str, size);
+        is_memory_allocated(buf->str);
+        buf->size = size;
+    }
+    memcpy(&buf->str[buf->len], str, len);
+    buf->len += len;
+    buf->str[buf->len] = '\0';
+}
+
+void append_sym_to_buf(str_buf* buf, char sym, uint64_t count)
+{
+    if (buf->len + count + 1 > buf->size) append_to_buf(buf, "", 0);//initial allocation
+    while (buf->len + count + 1 > buf->size) {
+        buf->size *= 2;
+        buf->str = realloc(buf->str, buf->size);
+        is_memory_allocated(buf->str);
+    }
+    memset(&buf->str[buf->len], sym, count);
+    buf->len += count;
+    buf->str[buf->len] = '\0';
+}
+
+void escape_tag_symbols(char* str)
+{
+    for (; *str != '\0'; str++) {
+        if (*str == '<') *str = '\f';
+        else if (*str == '>') *str = '\a';
+    }
+}
+
+uint32_t get_str_hash(const char* str)
+{
+    uint32_t hash = 2166136261u;//FNV-1a
+    for (; *str != '\0'; str++) {
+        hash ^= (uint8_t)*str;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+uint8_t is_num(char* str)
+{
+    uint8_t result = 0;
+    for (; *str != '\0'; str++) {
+        if (isdigit(*str) || *str == '-' || *str == '.' || *str == ' ') {
+            result = 1;
+        } else return 0;
+    }
+    return result;
+}
+
+uint8_t is_number_len(const char* str, uint32_t len)
+{
+    uint8_t result = 0;
+    for (uint32_t i = 0; i < len; i++) {
+        if (isdigit(str[i]) || str[i] == '-' || str[i] == '.' || str[i] == ',' || str[i] == ' ') {
+            result = 1;
+        } else return 0;
+    }
+    return result;
+}
+
+uint16_t get_number_len(uint16_t number)
+{
+    char* num_str = calloc(20, sizeof(char));
+    is_memory_allocated(num_str);
+    sprintf(num_str, "%d", number);
+    uint16_t len = strlen(num_str);
+    free(num_str);
+    return len;
+}
+
+char* rm_spaces_start_end(char* str)
+{
+    uint64_t start = 0;
+    uint64_t end = 0;
+    for (uint64_t i = 0; i < strlen(str); i++) {
+        if (str[i] != ' ') {
+            start = i;
+            break;
+        }
+    }
+    for (uint64_t i = strlen(str) - 1; i >= 0; i--) {
+        if (str[i] != ' ') {
+            end = i;
+            break;
+        }
+    }
+    end += 1;
+    char* result = calloc(end - start + 2, sizeof(char));
+    is_memory_allocated(result);
+    memcpy(result, &str[start], end-start);
+    result[end-start] = '\0';
+    free(str);
+    return result;
+}
+
+
+/***************************************************************************
+* functions for working with numbers
+***************************************************************************/
+//Numbers of the text are [spaces][sign]digits[.digits][e[sign]digits][spaces],
+//the decimal separator is '.' or ','. The number is read in one pass: up to
+//19 digits are collected in an integer, which gives the exact result right
+//away if it and the power of 10 are exact doubles; other numbers are read by
+//strtod() from a copy of the text.
+#define MAX_EXACT_MANTISSA (1ULL << 53)
+#define MAX_EXACT_POW10 22
+#define NUMBER_COPY_SIZE 128 //longer numbers are copied to the heap for strtod()
+
+static const double exact_pow10[MAX_EXACT_POW10 + 1] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static double read_number_copy(const char* str, uint32_t len)
+{
+    char buf[NUMBER_COPY_SIZE];
+    char* num = (len < sizeof(buf)) ? buf : malloc(len + 1);
+    is_memory_allocated(num);
+    for (uint32_t i = 0; i < len; i++) num[i] = (str[i] == ',') ? '.' : str[i];
+    num[len] = '\0';
+    double value = strtod(num, NULL);
+    if (num != buf) free(num);
+    return value;
+}
+
+//returns 1 if all the text is a number, info (may be NULL) tells how it is written
+uint8_t parse_number(const char* str, uint32_t len, double* value, number_info* info)
+{
+    uint32_t i = 0;
+    while (i < len && str[i] == ' ') i++;
+    while (len > i && str[len - 1] == ' ') len--;
+    uint32_t start = i;
+    uint8_t negative = 0;
+    if (i < len && (str[i] == '-' || str[i] == '+')) negative = (str[i++] == '-');
+
+    uint64_t mantissa = 0;
+    uint32_t digits = 0;     //digits of the mantissa without the leading zeros
+    int32_t exp10 = 0;
+    uint8_t any_digit = 0;
+    uint32_t decimals = 0;
+    uint8_t comma = 0;
+    for (; i < len && isdigit((unsigned char)str[i]); i++) {
+        any_digit = 1;
+        if (mantissa == 0 && str[i] == '0') continue;
+        if (digits < 19) mantissa = mantissa * 10 + (str[i] - '0');
+        else exp10++;
+        digits++;
+    }
+    if (i < len && (str[i] == '.' || str[i] == ',')) {
+        comma = (str[i] == ',');
+        uint32_t sep = i;
+        for (i++; i < len && isdigit((unsigned char)str[i]); i++) {
+            any_digit = 1;
+            if (mantissa == 0 && str[i] == '0') {
+                exp10--;
+                continue;
+            }
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (str[i] - '0');
+                exp10--;
+            }
+            digits++;
+        }
+        decimals = i - sep - 1;
+    }
+    if (any_digit == 0) return 0;
+    uint8_t exponent = 0;
+    if (i < len && (str[i] == 'e' || str[i] == 'E')) {
+        i++;
+        uint8_t exp_negative = 0;
+        if (i < len && (str[i] == '-' || str[i] == '+')) exp_negative = (str[i++] == '-');
+        if (i == len || !isdigit((unsigned char)str[i])) return 0;
+        int32_t exp = 0;
+        for (; i < len && isdigit((unsigned char)str[i]); i++) {
+            if (exp < 100000) exp = exp * 10 + (str[i] - '0');
+        }
+        exp10 += exp_negative ? -exp : exp;
+        exponent = 1;
+        decimals = 0;
+    }
+    if (i != len) return 0;
+
+    if (digits > 19 || mantissa > MAX_EXACT_MANTISSA || exp10 < -MAX_EXACT_POW10 || exp10 > MAX_EXACT_POW10) {
+        *value = (mantissa == 0) ? (negative ? -0.0 : 0.0) : read_number_copy(&str[start], len - start);
+    } else {
+        //both numbers are exact, so the only rounding is in the operation
+        *value = (exp10 < 0) ? (double)mantissa / exact_pow10[-exp10] : (double)mantissa * exact_pow10[exp10];
+        if (negative) *value = -*value;
+    }
+    if (info != NULL) {
+        info->decimals = decimals;
+        info->comma = comma;
+        info->exponent = exponent;
+    }
+    return 1;
+}
+
+//Numbers are printed without printf: the digits are found with exact integer
+//arithmetic, so the text is the same as printf gives ("%g" by default, "%.Nf"
+//for dec=N). rt gives the shortest text that is read back as the same number.
+//Numbers out of the exact range are printed with snprintf().
+const number_format DEFAULT_NUMBER_FORMAT = {-1, 0, 0};
+
+#define MAX_FORMAT_DECIMALS 20
+#define MAX_POW5 27 //5^27 < 2^63
+
+//reads dec=N, rt and grp, returns the number of these attributes
+uint8_t get_number_format(char** attrs, number_format* fmt)
+{
+    *fmt = DEFAULT_NUMBER_FORMAT;
+    if (attrs == NULL) return 0;
+    uint8_t count = 0;
+    char* value = get_attr_value(attrs, "dec");
+    if (value != NULL) {
+        char* end = NULL;
+        unsigned long decimals = strtoul(value, &end, 10);
+        if (!isdigit(*value) || *end != '\0' || decimals > MAX_FORMAT_DECIMALS) {
+            printf("  Error: wrong value of the \"dec\" attribute \"%s\". Ignoring\n", value);
+        } else {
+            fmt->decimals = decimals;
+        }
+        count++;
+    }
+    if ((fmt->shortest = in_str_array(attrs, "rt"))) count++;
+    if ((fmt->grouping = in_str_array(attrs, "grp"))) count++;
+    return count;
+}
+
+static const uint64_t pow10_table[20] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL, 100000000ULL,
+    1000000000ULL, 10000000000ULL, 100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+    100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL, 100000000000000000ULL,
+    1000000000000000000ULL, 10000000000000000000ULL
+};
+
+static uint8_t get_digits_count(uint64_t n)
+{
+    uint8_t count = 1;
+    while (count < 20 && n >= pow10_table[count]) count++;
+    return count;
+}
+
+//writes count digits of n (with leading zeros), commas between thousands if grouping
+static uint32_t put_digits(char* out, uint64_t n, uint8_t count, uint8_t grouping)
+{
+    char digits[20];
+    for (int8_t i = count - 1; i >= 0; i--) {
+        digits[i] = '0' + n % 10;
+        n /= 10;
+    }
+    uint32_t len = 0;
+    for (uint8_t i = 0; i < count; i++) {
+        if (grouping && i > 0 && (count - i) % 3 == 0) out[len++] = ',';
+        out[len++] = digits[i];
+    }
+    return len;
+}
+
+#ifdef __SIZEOF_INT128__
+typedef unsigned __int128 uint128;
+
+//the finite positive value is m * 2^e
+static void get_binary(double value, uint64_t* m, int32_t* e)
+{
+    int exp;
+    double f = frexp(value, &exp);
+    *m = (uint64_t)ldexp(f, 53);
+    *e = exp - 53;
+}
+
+//Finds q = floor(m * 2^e * 10^s) and compares the rest with 1/2: half is -1 if
+//it is less, 0 if equal and 1 if more. Returns 0 if q doesn't fit in 64 bits
+//or the numbers don't fit in 128 bits.
+static uint8_t scale_by_pow10(uint64_t m, int32_t e, int32_t s, uint64_t* q, int8_t* half, uint8_t* exact)
+{
+    //10^s = 5^s * 2^s
+    if (s > MAX_POW5 || s < -MAX_POW5) return 0;
+    uint64_t pow5 = 1;
+    for (int32_t i = (s < 0) ? -s : s; i > 0; i--) pow5 *= 5;
+    uint128 num = m;
+    uint128 den = 1;
+    if (s >= 0) num *= pow5;
+    else den = pow5;
+    e += s;
+    if (e >= 0) {
+        if (e >= 127 || (num >> (127 - e)) != 0) return 0;
+        num <<= e;
+    } else {
+        if (e <= -126 || (den >> (126 + e)) != 0) return 0;
+        den <<= -e;
+    }
+    uint128 quot = num / den;
+    if (quot > UINT64_MAX) return 0;
+    uint128 rest = num - quot * den;
+    *q = quot;
+    *exact = (rest == 0);
+    *half = (rest * 2 < den) ? -1 : (rest * 2 > den) ? 1 : 0;
+    return 1;
+}
+
+//Writes the digits like "%g": value = digits * 10^(exp10 - count + 1), the
+//first digit is not 0. Exponent form is used if exp10 < -4 or exp10 >= precision.
+static uint32_t put_general(char* out, uint64_t digits, uint8_t count, int32_t exp10, uint8_t precision,
+                            uint8_t grouping)
+{
+    while (count > 1 && digits % 10 == 0) {
+        digits /= 10;
+        count--;
+    }
+    uint32_t len = 0;
+    if (exp10 < -4 || exp10 >= precision) {
+        out[len++] = '0' + digits / pow10_table[count - 1];
+        if (count > 1) {
+            out[len++] = '.';
+            len += put_digits(&out[len], digits % pow10_table[count - 1], count - 1, 0);
+        }
+        out[len++] = 'e';
+        out[len++] = (exp10 < 0) ? '-' : '+';
+        uint32_t exp = (exp10 < 0) ? -exp10 : exp10;
+        len += put_digits(&out[len], exp, (exp < 100) ? 2 : 3, 0);
+    } else if (exp10 < 0) {
+        out[len++] = '0';
+        out[len++] = '.';
+        for (int32_t i = exp10 + 1; i < 0; i++) out[len++] = '0';
+        len += put_digits(&out[len], digits, count, 0);
+    } else if (count <= exp10 + 1) {
+        //an integer, zeros are added after the digits
+        uint8_t int_digits = exp10 + 1;
+        len += put_digits(&out[len], digits * pow10_table[int_digits - count], int_digits, grouping);
+    } else {
+        uint8_t frac_digits = count - exp10 - 1;
+        len += put_digits(&out[len], digits / pow10_table[frac_digits], exp10 + 1, grouping);
+        out[len++] = '.';
+        len += put_digits(&out[len], digits % pow10_table[frac_digits], frac_digits, 0);
+    }
+    return len;
+}
+
+//"%g" of the positive value, 0 if the value is out of the exact range
+static uint32_t format_general(double value, uint8_t grouping, char* out)
+{
+    const uint8_t precision = 6;
+    uint64_t m;
+    int32_t e;
+    get_binary(value, &m, &e);
+    int32_t exp10 = floor(log10(value));
+    uint64_t q = 0;
+    for (uint8_t tries = 0; tries < 4; tries++) {
+        int8_t half;
+        uint8_t exact;
+        if (scale_by_pow10(m, e, precision - 1 - exp10, &q, &half, &exact) == 0) return 0;
+        if (half > 0 || (half == 0 && (q & 1))) q++;//to the nearest, ties to even
+        if (q >= pow10_table[precision]) exp10++;
+        else if (q < pow10_table[precision - 1]) exp10--;
+        else return put_general(out, q, precision, exp10, precision, grouping);
+    }
+    return 0;
+}
+
+//"%.Nf" of the positive value, 0 if the value is out of the exact range
+static uint32_t format_fixed(double value, uint8_t decimals, uint8_t grouping, char* out)
+{
+    uint64_t m;
+    int32_t e;
+    get_binary(value, &m, &e);
+    uint64_t q;
+    int8_t half;
+    uint8_t exact;
+    if (decimals >= 20 || scale_by_pow10(m, e, decimals, &q, &half, &exact) == 0) return 0;
+    if (q == UINT64_MAX) return 0;
+    if (half > 0 || (half == 0 && (q & 1))) q++;
+    uint64_t p = pow10_table[decimals];
+    uint64_t int_part = q / p;
+    uint32_t len = put_digits(out, int_part, get_digits_count(int_part), grouping);
+    if (decimals > 0) {
+        out[len++] = '.';
+        len += put_digits(&out[len], q % p, decimals, 0);
+    }
+    return len;
+}
+
+//The shortest text of the positive normal value that is read back as the same
+//number. All numbers in the rounding interval of the value are read as it, the
+//interval is found with 17 digits and the shortest digits in it are taken, the
+//nearest to the value if there are several.
+static uint32_t format_shortest(double value, uint8_t grouping, char* out)
+{
+    const uint8_t precision = 17;
+    if (value < DBL_MIN) return 0;//subnormal numbers have other intervals
+    uint64_t m;
+    int32_t e;
+    get_binary(value, &m, &e);
+    int32_t exp10 = floor(log10(value));
+    uint64_t q = 0;
+    int8_t half;
+    uint8_t exact;
+    for (uint8_t tries = 0; tries < 4; tries++) {
+        if (scale_by_pow10(m, e, precision - 1 - exp10, &q, &half, &exact) == 0) return 0;
+        if (q >= pow10_table[precision]) exp10++;
+        else if (q < pow10_table[precision - 1]) exp10--;
+        else break;
+    }
+    if (q >= pow10_table[precision] || q < pow10_table[precision - 1]) return 0;
+    int32_t s = precision - 1 - exp10;
+
+    //the interval is between the midpoints to the neighbours, the lower one is
+    //closer at a power of 2; the midpoints are read as the value if m is even
+    uint64_t lower, upper;
+    int8_t lower_half, upper_half;
+    uint8_t lower_exact, upper_exact;
+    uint8_t ok = (m == (1ULL << 52) && value >= 2 * DBL_MIN) ?
+                 scale_by_pow10(4 * m - 1, e - 2, s, &lower, &lower_half, &lower_exact) :
+                 scale_by_pow10(2 * m - 1, e - 1, s, &lower, &lower_half, &lower_exact);
+    if (ok == 0 || scale_by_pow10(2 * m + 1, e - 1, s, &upper, &upper_half, &upper_exact) == 0) return 0;
+    uint8_t inclusive = (m % 2 == 0);
+    //the smallest and the biggest numbers of 17 digits in the interval
+    uint64_t lo = lower + ((inclusive && lower_exact) ? 0 : 1);
+    uint64_t hi = (!inclusive && upper_exact) ? upper - 1 : upper;
+
+    for (int8_t k = precision - 1; k >= 0; k--) {
+        uint64_t p = pow10_table[k];
+        uint64_t first = lo / p + (lo % p != 0);
+        uint64_t last = hi / p;
+        if (first > last) continue;
+        //q and the rest of the value after it are rounded to k digits less
+        uint64_t digits = q / p;
+        uint64_t rest = q % p;
+        uint8_t up;
+        if (k == 0) up = (half > 0 || (half == 0 && (digits & 1)));
+        else if (rest * 2 != p) up = (rest * 2 > p);
+        else up = (exact == 0 || (digits & 1));
+        digits += up;
+        if (digits < first) digits = first;
+        if (digits > last) digits = last;
+        uint8_t count = get_digits_count(digits);
+        return put_general(out, digits, count, count - 1 + k - s, precision, grouping);
+    }
+    return 0;
+}
+#else
+static uint32_t format_general(double value, uint8_t grouping, char* out) {return 0;}
+static uint32_t format_fixed(double value, uint8_t decimals, uint8_t grouping, char* out) {return 0;}
+static uint32_t format_shortest(double value, uint8_t grouping, char* out) {return 0;}
+#endif
+
+//puts commas between thousands of the number printed by snprintf()
+static uint32_t group_thousands(char* num, uint32_t len)
+{
+    uint32_t start = (num[0] == '-') ? 1 : 0;
+    uint32_t int_end = start;
+    while (isdigit(num[int_end])) int_end++;
+    if (num[int_end] != '\0' && num[int_end] != '.') return len;//exponent form, inf or nan
+    char tmp[MAX_NUMBER_LEN];
+    memcpy(tmp, num, len + 1);
+    uint32_t j = start;
+    for (uint32_t i = start; i < int_end; i++) {
+        if (i > start && (int_end - i) % 3 == 0) num[j++] = ',';
+        num[j++] = tmp[i];
+    }
+    memcpy(&num[j], &tmp[int_end], len - int_end + 1);
+    return j + len - int_end;
+}
+
+//the text of the number by printf, the shortest one is checked with strtod()
+static uint32_t print_number(double value, const number_format* fmt, char* out)
+{
+    int len;
+    if (fmt->decimals >= 0) {
+        len = snprintf(out, MAX_NUMBER_LEN, "%.*f", fmt->decimals, value);
+    } else if (fmt->shortest) {
+        for (uint8_t precision = 1; ; precision++) {
+            len = snprintf(out, MAX_NUMBER_LEN, "%.*g", precision, value);
+            if (precision == 17 || strtod(out, NULL) == value || isnan(value)) break;
+        }
+    } else {
+        len = snprintf(out, MAX_NUMBER_LEN, "%g", value);
+    }
+    if (fmt->grouping && len + len / 3 < MAX_NUMBER_LEN) len = group_thousands(out, len);
+    return len;
+}
+
+//writes the number to out (MAX_NUMBER_LEN chars at least), returns its length
+uint32_t format_number(double value, const number_format* fmt, char* out)
+{
+    uint32_t len = 0;
+    if (isfinite(value)) {
+        uint32_t sign = signbit(value) ? 1 : 0;
+        double v = fabs(value);
+        out[0] = '-';
+        if (fmt->decimals >= 0) {
+            len = format_fixed(v, fmt->decimals, fmt->grouping, &out[sign]);
+        } else if (v == 0) {
+            out[sign] = '0';
+            len = 1;
+        } else if (fmt->shortest) {
+            len = format_shortest(v, fmt->grouping, &out[sign]);
+        } else {
+            len = format_general(v, fmt->grouping, &out[sign]);
+        }
+        if (len > 0) len += sign;
+    }
+    if (len == 0) len = print_number(value, fmt, out);
+    out[len] = '\0';
+    return len;
+}
+
+//the number is written right into the buffer
+void append_number_to_buf(str_buf* buf, double value, const number_format* fmt)
+{
+    if (buf->len + MAX_NUMBER_LEN + 1 > buf->size) {
+        append_to_buf(buf, "", 0);//initial allocation
+        while (buf->len + MAX_NUMBER_LEN + 1 > buf->size) buf->size *= 2;
+        buf->str = realloc(buf->str, buf->size);
+        is_memory_allocated(buf->str);
+    }
+    buf->len += format_number(value, fmt, &buf->str[buf->len]);
+}
+
+
+/***************************************************************************
+* functions for Text Formatting
+***************************************************************************/
+void set_doc_width(uint8_t width)
+{
+    if (width < 10) {
+        printf("  Error: Document width cannot be less than 10 characters\n");
+        DOC_WIDTH = 10;
+    } else if (width > 200) {
+        printf("  Error: Document width cannot be more than 250 characters\n");
+        DOC_WIDTH = 250;
+    } else {
+        DOC_WIDTH = width;
+    }
+}
+
+void set_start_doc_width(uint8_t width)
+{
+    set_doc_width(width);
+    START_DOC_WIDTH = DOC_WIDTH;
+}
+
+
+/***************************************************************************
+* functions for working with threads
+***************************************************************************/
+//Big jobs are split into blocks of rows: block b of n has the items
+//[count * b / n, count * (b + 1) / n). The caller runs the first block itself.
+uint16_t THREADS_COUNT = 1;
+const uint16_t MAX_THREADS_COUNT = 256;
+
+typedef struct block_job {
+    block_function f;
+    void*    arg;
+    uint32_t block;
+    uint64_t start;
+    uint64_t end;
+} block_job;
+
+//0 - the number of processors
+void set_threads_count(uint16_t count)
+{
+    if (count == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        count = (cpus < 1) ? 1 : (cpus > MAX_THREADS_COUNT) ? MAX_THREADS_COUNT : cpus;
+    } else if (count > MAX_THREADS_COUNT) {
+        printf("  Error: number of threads cannot be more than %u\n", MAX_THREADS_COUNT);
+        count = MAX_THREADS_COUNT;
+    }
+    THREADS_COUNT = count;
+}
+
+//blocks are not smaller than min_block items, 1 means the serial path
+uint32_t get_blocks_count(uint64_t count, uint64_t min_block)
+{
+    uint64_t blocks = count / (min_block > 0 ? min_block : 1);
+    if (blocks > THREADS_COUNT) blocks = THREADS_COUNT;
+    return (blocks > 0) ? blocks : 1;
+}
+
+static void* run_block_job(void* arg)
+{
+    block_job* job = arg;
+    job->f(job->arg, job->block, job->start, job->end);
+    return NULL;
+}
+
+void run_in_blocks(uint64_t count, uint32_t blocks, block_function f, void* arg)
+{
+    if (blocks <= 1) {
+        f(arg, 0, 0, count);
+        return;
+    }
+    block_job* jobs = calloc(blocks, sizeof(block_job));
+    is_memory_allocated(jobs);
+    pthread_t* threads = calloc(blocks, sizeof(pthread_t));
+    is_memory_allocated(threads);
+    uint8_t* started = calloc(blocks, sizeof(uint8_t));
+    is_memory_allocated(started);
+    for (uint32_t b = 0; b < blocks; b++) {
+        jobs[b] = (block_job){f, arg, b, count * b / blocks, count * (b + 1) / blocks};
+        //a block without a thread is run by the caller
+        if (b > 0) started[b] = (pthread_create(&threads[b], NULL, run_block_job, &jobs[b]) == 0);
+    }
+    run_block_job(&jobs[0]);
+    for (uint32_t b = 1; b < blocks; b++) {
+        if (started[b]) pthread_join(threads[b], NULL);
+        else run_block_job(&jobs[b]);
+    }
+    free(jobs);
+    free(threads);
+    free(started);
+}
+
+
+/***************************************************************************
+* functions for working with arrays
+***************************************************************************/
+uint16_t get_arr_size(char** str_arr)
+{
+    uint16_t count = 0;
+    while (str_arr[count] != NULL) count++;
+    return count;
+}
+
+uint8_t in_str_array(char** arr, char* value)
+{
+    if (arr == NULL) return 0;
+    uint16_t arr_size = get_arr_size(arr);
+    for (uint16_t i = 0; i < arr_size; i++) {
+        if (strcmp(arr[i], value) == 0) return 1;
+    }
+    return 0;
+}
+
+//value of the "name=value" attribute or NULL
+char* get_attr_value(char** attrs, char* name)
+{
+    if (attrs == NULL) return NULL;
+    size_t len = strlen(name);
+    uint16_t arr_size = get_arr_size(attrs);
+    for (uint16_t i = 0; i < arr_size; i++) {
+        if (strncmp(attrs[i], name, len) == 0 && attrs[i][len] == '=') return &attrs[i][len + 1];
+    }
+    return NULL;
+}
+
+uint32_t get_max_len(char** str_arr, uint32_t arr_size)
+{
+    uint32_t max_len = strlen(str_arr[0]);
+    for (uint32_t i = 0; i < arr_size; i++) {
+        if (max_len < strlen(str_arr[i])) max_len = strlen(str_arr[i]);
+    }
+    return max_len;
+}
+
+/***************************************************************************
+* Basic functions for some tags
+***************************************************************************/
+char* get_aligned_text(char* str, char** attrs)
+{
+    char** lines = split('\n', str);
+    uint32_t lines_count = get_elements_count('\n', str);
+    uint32_t max_line = get_max_len(lines, lines_count);
+    uint32_t len = (max_line > DOC_WIDTH) ? max_line : DOC_WIDTH;
+    len = (len + 1) * lines_count;
+    char* aligned = calloc(len, sizeof(char));
+    is_memory_allocated(aligned);
+    for (uint32_t i = 0; i < lines_count; i++) {
+        uint16_t spaces = (strlen(lines[i]) > DOC_WIDTH) ? 0 : DOC_WIDTH - strlen(lines[i]);
+        if (attrs == NULL) spaces /= 2;
+        char* al = get_str_from_sym(' ', spaces);
+        strcat(aligned, al);
+        free(al);
+        strcat(aligned, lines[i]);
+        spaces = DOC_WIDTH - strlen(lines[i]) - spaces;
+        al = get_str_from_sym(' ', spaces);
+        strcat(aligned, al);
+        free(lines[i]);
+        free(al);
+        if (i < lines_count - 1) strcat(aligned, "\n");
+    }
+    free(lines);
+    return aligned;
+}
+
+char* header(char* str, uint8_t header_type, char** attrs)
+{
+    char sep_sym = '\0';
+    if (attrs != NULL) {
+        if (attrs[0] != NULL) {
+            sep_sym = attrs[0][0];
+        }
+    }
+    if (header_type == 1 && sep_sym == '\0') sep_sym = '=';
+    uint8_t doc_width_bak = DOC_WIDTH;
+    if (DOC_WIDTH < strlen(str)) set_doc_width(strlen(str) + 4);
+    char* header = NULL;
+    uint16_t len = DOC_WIDTH + 1;
+    if (header_type == 1) {
+        char* centered_str = center(str, NULL);
+        len = DOC_WIDTH * 2 + strlen(centered_str) + 3;
+        header = calloc(len, sizeof(char));
+        is_memory_allocated(header);
+        char* tmp = get_str_from_sym(sep_sym, DOC_WIDTH);
+        sprintf(header, "%s\n%s\n%s", tmp, centered_str, tmp);
+        free(tmp);
+        free(centered_str);
+    } else {
+        header = calloc(len, sizeof(char));
+        is_memory_allocated(header);
+        if (sep_sym == '\0') sep_sym = (header_type == 2) ? '=' : '-';
+        char* tmp = get_str_from_sym(sep_sym, (DOC_WIDTH-strlen(str) - 1) / 2);
+        sprintf(header, "%s %s ", tmp, str);
+        free(tmp);
+        tmp = get_str_from_sym(sep_sym, DOC_WIDTH - strlen(header));
+        strcat(header, tmp);
+        free(tmp);
+    }
+    set_doc_width(doc_width_bak);
+    return header;
+}
+
+/***************************************************************************
+* functions for working with tables
+***************************************************************************/
+//Cells are kept column-major: cell j of row i is [j * rows_count + i], and the
+//text of all cells is in one buffer. Rows with a different number of cells are
+//aligned separately, so widths are kept for every row size: width of column j
+//in rows with n cells is width[n * (n - 1) / 2 + j].
+static uint64_t get_width_index(uint32_t cells, uint32_t column)
+{
+    return (uint64_t)cells * (cells - 1) / 2 + column;
+}
+
+//footer rows with totals, see add_table_totals()
+static const char* total_names[] = {"sum", "avg", "min", "max", NULL};
+static const char* total_labels[] = {"Sum", "Avg", "Min", "Max"};
+
+//operations of the filter attribute, see arrange_table_rows()
+enum {FILTER_EQ, FILTER_NE, FILTER_LT, FILTER_LE, FILTER_GT, FILTER_GE};
+static const char* filter_ops[] = {"eq", "ne", "lt", "le", "gt", "ge", NULL};
+
+//value of the "name=N" attribute, 0 if there is no such attribute
+static uint32_t get_count_attr(char** attrs, char* name)
+{
+    char* value = get_attr_value(attrs, name);
+    if (value == NULL) return 0;
+    char* end = NULL;
+    unsigned long count = strtoul(value, &end, 10);
+    if (!isdigit(*value) || *end != '\0' || count == 0 || count > UINT32_MAX) {
+        printf("  Error: wrong value of the \"%s\" attribute \"%s\". Ignoring\n", name, value);
+        return 0;
+    }
+    return count;
+}
+
+//columns are numbered from 1 in the attribute: cols=1,3
+static void get_cols_attr(char** attrs, table_options* opt)
+{
+    char* value = get_attr_value(attrs, "cols");
+    if (value == NULL) return;
+    uint32_t count = get_elements_count(',', value);
+    opt->cols = calloc(count + 1, sizeof(uint32_t));
+    is_memory_allocated(opt->cols);
+    for (char* col = value; *col != '\0'; ) {
+        char* end = NULL;
+        unsigned long n = strtoul(col, &end, 10);
+        if (!isdigit(*col) || (*end != ',' && *end != '\0') || n == 0 || n > UINT32_MAX) {
+            printf("  Error: wrong value of the \"cols\" attribute \"%s\". Ignoring\n", value);
+            free(opt->cols);
+            opt->cols = NULL;
+            opt->cols_count = 0;
+            return;
+        }
+        opt->cols[opt->cols_count++] = n - 1;
+        col = (*end == ',') ? end + 1 : end;
+    }
+}
+
+//filter=column:op:value like filter=3:gt:100, tag symbols can't be used in attributes
+static void get_filter_attr(char** attrs, table_options* opt)
+{
+    char* value = get_attr_value(attrs, "filter");
+    if (value == NULL) return;
+    char* end = NULL;
+    unsigned long col = strtoul(value, &end, 10);
+    uint8_t ok = (isdigit(*value) && col > 0 && col <= UINT32_MAX && *end == ':');
+    uint8_t op = 0;
+    while (ok && filter_ops[op] != NULL && !(strncmp(&end[1], filter_ops[op], 2) == 0 && end[3] == ':')) op++;
+    if (!ok || filter_ops[op] == NULL) {
+        printf("  Error: wrong value of the \"filter\" attribute \"%s\". Ignoring\n", value);
+        return;
+    }
+    opt->filter_col = col;
+    opt->filter_op = op;
+    opt->filter_value = strdup(&end[4]);
+    is_memory_allocated(opt->filter_value);
+}
+
+void get_table_options(char** attrs, table_options* opt)
+{
+    memset(opt, 0, sizeof(table_options));
+    get_number_format(attrs, &opt->num);
+    opt->num.grouping = 0;//a comma in a number is the decimal point in tables
+    opt->nb = in_str_array(attrs, "nb");//no border
+    opt->nc = in_str_array(attrs, "nc");//no calculations
+    opt->na = in_str_array(attrs, "na");//don't align numbers to the right
+    opt->cs = in_str_array(attrs, "cs");//print the calculation counters
+    opt->dp = in_str_array(attrs, "dp");//align numbers at the decimal point
+    opt->doc_width = DOC_WIDTH;
+    opt->page = get_count_attr(attrs, "page");//rows on a page, the header row is repeated on every page
+    opt->rows = get_count_attr(attrs, "rows");//read only the first rows
+    get_cols_attr(attrs, opt);
+    opt->nh = in_str_array(attrs, "nh");//no header row
+    opt->sort = get_count_attr(attrs, "sort");
+    if (opt->sort == 0 && (opt->sort = get_count_attr(attrs, "rsort")) > 0) opt->rsort = 1;
+    opt->top = get_count_attr(attrs, "top");
+    get_filter_attr(attrs, opt);
+    for (uint8_t k = 0; total_names[k] != NULL; k++) {
+        if (in_str_array(attrs, (char*)total_names[k])) opt->totals |= 1 << k;
+    }
+
+    char* csv = get_attr_value(attrs, "csv");
+    char* tsv = get_attr_value(attrs, "tsv");
+    if (csv != NULL || tsv != NULL) {
+        opt->source = strdup((csv != NULL) ? csv : tsv);
+        is_memory_allocated(opt->source);
+        opt->sep = (csv != NULL) ? ',' : '\t';
+    }
+}
+
+void free_table_options(table_options* opt)
+{
+    free(opt->source);
+    free(opt->cols);
+    free(opt->filter_value);
+    opt->source = NULL;
+    opt->cols = NULL;
+    opt->filter_value = NULL;
+}
+
+uint64_t get_table_source_size(char* tbl_str, const table_options* opt)
+{
+    if (opt->source == NULL) return strlen(tbl_str);
+    struct stat st;
+    return (stat(opt->source, &st) == 0) ? (uint64_t)st.st_size : 0;
+}
+
+//one row of the table text
+typedef struct table_row {
+    const char*  base;      //text the cell offsets are in
+    uint32_t     cells;
+    uint32_t     size;
+    uint64_t*    off;
+    uint32_t*    len;
+    uint8_t*     calculated;//the cell text is in the buffer of calculated values
+    const char** text;
+    uint8_t*     right;
+} table_row;
+
+static void free_table_row(table_row* row)
+{
+    free(row->off);
+    free(row->len);
+    free(row->calculated);
+    free(row->text);
+    free(row->right);
+    memset(row, 0, sizeof(table_row));
+}
+
+static void add_cell_to_row(table_row* row, uint64_t off, uint32_t len)
+{
+    if (row->cells == row->size) {
+        row->size = (row->size == 0) ? 16 : row->size * 2;
+        row->off = realloc(row->off, row->size * sizeof(uint64_t));
+        is_memory_allocated(row->off);
+        row->len = realloc(row->len, row->size * sizeof(uint32_t));
+        is_memory_allocated(row->len);
+        row->calculated = realloc(row->calculated, row->size * sizeof(uint8_t));
+        is_memory_allocated(row->calculated);
+        row->text = realloc(row->text, row->size * sizeof(char*));
+        is_memory_allocated(row->text);
+        row->right = realloc(row->right, row->size * sizeof(uint8_t));
+        is_memory_allocated(row->right);
+    }
+    row->off[row->cells] = off;
+    row->len[row->cells] = len;
+    row->calculated[row->cells] = 0;
+    row->cells++;
+}
+
+//Reads the next row from *pos. Rows are separated by '\n' and cells by '|',
+//empty rows and cells are skipped. Returns 0 at the end of the text.
+static uint8_t read_table_row(const char* text, uint64_t len, uint64_t* pos, table_row* row)
+{
+    uint64_t i = *pos;
+    row->base = text;
+    while (i < len) {
+        row->cells = 0;
+        while (i < len && text[i] != '\n') {
+            uint64_t start = i;
+            while (i < len && text[i] != '\n' && text[i] != '|') i++;
+            if (i > start) add_cell_to_row(row, start, i - start);
+            if (i < len && text[i] == '|') i++;
+        }
+        if (i < len) i++;//'\n'
+        if (row->cells > 0) {
+            *pos = i;
+            return 1;
+        }
+    }
+    *pos = i;
+    return 0;
+}
+
+//Rows of a table come from the tag text or from a mmap'd csv/tsv file.
+typedef struct table_source {
+    const table_options* opt;
+    const char* data;
+    uint64_t    size;
+    uint64_t    pos;
+    char*       map;
+    uint32_t    rows;      //rows read
+    table_row   fields;    //all cells of the row when columns are selected
+    str_buf     text;      //fields of the current csv row
+} table_source;
+
+static void open_table_source(table_source* src, char* tbl_str, const table_options* opt)
+{
+    memset(src, 0, sizeof(table_source));
+    src->opt = opt;
+    if (opt->source == NULL) {
+        src->data = tbl_str;
+        src->size = strlen(tbl_str);
+        return;
+    }
+    int fd = open(opt->source, O_RDONLY);
+    if (fd < 0) {print_file_error(opt->source); return;}
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        char* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            print_file_error(opt->source);
+        } else {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            src->map = map;
+            src->data = map;
+            src->size = st.st_size;
+        }
+    }
+    close(fd);
+}
+
+static void rewind_table_source(table_source* src)
+{
+    src->pos = 0;
+    src->rows = 0;
+}
+
+static void close_table_source(table_source* src)
+{
+    if (src->map != NULL) munmap(src->map, src->size);
+    free_table_row(&src->fields);
+    free(src->text.str);
+    memset(src, 0, sizeof(table_source));
+}
+
+//line breaks inside quoted fields become spaces, tag symbols are escaped like in inserted files
+static void append_csv_text(str_buf* buf, const char* str, uint64_t len)
+{
+    uint64_t start = buf->len;
+    append_to_buf(buf, str, len);
+    if (get_span_without(str, len, "<>\r\n", 4) == len) return;
+    for (uint64_t i = start; i < buf->len; i++) {
+        if (buf->str[i] == '<') buf->str[i] = '\f';
+        else if (buf->str[i] == '>') buf->str[i] = '\a';
+        else if (buf->str[i] == '\r' || buf->str[i] == '\n') buf->str[i] = ' ';
+    }
+}
+
+//Reads the next record of the csv/tsv file. Quoted fields may contain the
+//separator, line breaks and doubled quotes. Empty lines are skipped.
+static uint8_t read_csv_row(table_source* src, table_row* row)
+{
+    const char* data = src->data;
+    uint64_t size = src->size;
+    uint64_t i = src->pos;
+    const char syms[2] = {src->opt->sep, '\n'};
+    while (i < size) {
+        row->cells = 0;
+        src->text.len = 0;
+        append_to_buf(&src->text, "", 0);
+        for (;;) {
+            uint64_t start = src->text.len;
+            if (data[i] == '"') {
+                for (i++; i < size; ) {
+                    const char* quote = memchr(&data[i], '"', size - i);
+                    uint64_t end = (quote != NULL) ? (uint64_t)(quote - data) : size;
+                    append_csv_text(&src->text, &data[i], end - i);
+                    i = (end < size) ? end + 1 : size;
+                    if (i >= size || data[i] != '"') break;
+                    append_to_buf(&src->text, "\"", 1);//doubled quote
+                    i++;
+                }
+            }
+            uint64_t end = i + get_span_without(&data[i], size - i, syms, 2);
+            uint64_t len = end - i;
+            if (len > 0 && data[end - 1] == '\r') len--;//CRLF line ends
+            append_csv_text(&src->text, &data[i], len);
+            add_cell_to_row(row, start, src->text.len - start);
+            i = end;
+            if (i < size && data[i] == src->opt->sep) {
+                i++;
+                if (i < size) continue;
+                add_cell_to_row(row, src->text.len, 0);//empty last field
+            } else if (i < size) {
+                i++;//'\n'
+            }
+            break;
+        }
+        if (row->cells > 1 || row->len[0] > 0) {
+            row->base = src->text.str;
+            src->pos = i;
+            return 1;
+        }
+    }
+    src->pos = i;
+    return 0;
+}
+
+//reads the next row with the selected columns
+static uint8_t read_source_row(table_source* src, table_row* row)
+{
+    const table_options* opt = src->opt;
+    table_row* fields = (opt->cols == NULL) ? row : &src->fields;
+    while (opt->rows == 0 || src->rows < opt->rows) {
+        uint8_t ok = (opt->source == NULL) ? read_table_row(src->data, src->size, &src->pos, fields)
+                                           : read_csv_row(src, fields);
+        if (ok == 0) return 0;
+        if (fields != row) {
+            row->cells = 0;
+            row->base = fields->base;
+            for (uint32_t k = 0; k < opt->cols_count; k++) {
+                uint32_t c = opt->cols[k];
+                if (c < fields->cells) add_cell_to_row(row, fields->off[c], fields->len[c]);
+            }
+            if (row->cells == 0) continue;
+        }
+        src->rows++;
+        return 1;
+    }
+    return 0;
+}
+
+void read_table(char* tbl_str, const table_options* opt, table* tbl)
+{
+    memset(tbl, 0, sizeof(table));
+    table_source src;
+    open_table_source(&src, tbl_str, opt);
+    table_row row = {0};
+
+    uint64_t text_len = 0;
+    while (read_source_row(&src, &row)) {
+        if (row.cells > tbl->cols_count) tbl->cols_count = row.cells;
+        for (uint32_t j = 0; j < row.cells; j++) text_len += row.len[j];
+        tbl->rows_count++;
+    }
+    uint64_t cells_count = (uint64_t)tbl->rows_count * tbl->cols_count;
+    tbl->cells_in_row = calloc(tbl->rows_count + 1, sizeof(uint32_t));
+    is_memory_allocated(tbl->cells_in_row);
+    tbl->cell_off = calloc(cells_count + 1, sizeof(uint64_t));
+    is_memory_allocated(tbl->cell_off);
+    tbl->cell_len = calloc(cells_count + 1, sizeof(uint32_t));
+    is_memory_allocated(tbl->cell_len);
+    tbl->text.size = text_len + 1;
+    tbl->text.str = malloc(tbl->text.size);
+    is_memory_allocated(tbl->text.str);
+    tbl->text.str[0] = '\0';
+
+    rewind_table_source(&src);
+    for (uint32_t i = 0; read_source_row(&src, &row); i++) {
+        tbl->cells_in_row[i] = row.cells;
+        for (uint32_t j = 0; j < row.cells; j++) {
+            uint64_t c = (uint64_t)j * tbl->rows_count + i;
+            tbl->cell_off[c] = tbl->text.len;
+            tbl->cell_len[c] = row.len[j];
+            append_to_buf(&tbl->text, &row.base[row.off[j]], row.len[j]);
+        }
+    }
+    free_table_row(&row);
+    close_table_source(&src);
+}
+
+void free_table(table* tbl)
+{
+    free(tbl->cells_in_row);
+    free(tbl->cell_off);
+    free(tbl->cell_len);
+    free(tbl->text.str);
+    memset(tbl, 0, sizeof(table));
+}
+
+//Cells are sorted out before calculation: text that can't be an expression is
+//not passed to tinyexpr, and literal numbers are read with parse_number(). Both
+//give the same result as te_interp() would.
+static uint8_t is_expr_sym(char sym)
+{
+    return isalnum((unsigned char)sym) || (sym != '\0' && strchr("._+-*/^%(), \t\n\r", sym) != NULL);
+}
+
+//kind of the cell text that is not a literal number, '.' is the decimal separator
+static uint8_t get_calc_kind(const char* str, uint32_t len)
+{
+    uint32_t i = 0;
+    while (i < len && str[i] == ' ') i++;
+    if (i == len) return CALC_TEXT;
+    //text: symbols tinyexpr doesn't know or names that are not builtin or document functions
+    for (i = 0; i < len; i++) {
+        if (!is_expr_sym(str[i])) return CALC_TEXT;
+        uint8_t name_start = isalpha((unsigned char)str[i]) &&
+                             (i == 0 || !(isalnum((unsigned char)str[i - 1]) || str[i - 1] == '.' || str[i - 1] == '_'));
+        if (name_start) {
+            uint32_t j = i;
+            while (j < len && (isalnum((unsigned char)str[j]) || str[j] == '_')) j++;
+            if (!te_is_builtin(&str[i], j - i) && !is_doc_func(&str[i], j - i)) return CALC_TEXT;
+            i = j - 1;
+        }
+    }
+    return CALC_EXPRESSION;
+}
+
+//calculates the cell, returns the kind of it, ok is 0 if there is no value
+static uint8_t eval_table_cell(const char* text, uint32_t len, double* value, uint8_t* ok)
+{
+    *ok = parse_number(text, len, value, NULL);
+    if (*ok) return CALC_LITERAL;
+    char buf[256];
+    char* str = (len < sizeof(buf)) ? buf : malloc(len + 1);
+    is_memory_allocated(str);
+    for (uint32_t i = 0; i < len; i++) str[i] = (text[i] == ',') ? '.' : text[i];
+    str[len] = '\0';
+
+    uint8_t kind = get_calc_kind(str, len);
+    if (kind == CALC_EXPRESSION) {
+        int error;
+        *value = eval_cached_expr(str, &error);
+        *ok = (error == 0);
+    }
+    if (str != buf) free(str);
+    return kind;
+}
+
+//appends the value of the cell to buf, returns 0 if the cell is not an expression
+static uint8_t calc_table_cell(const char* text, uint32_t len, str_buf* buf, uint64_t* counters,
+                               const number_format* fmt)
+{
+    double value;
+    uint8_t ok;
+    counters[eval_table_cell(text, len, &value, &ok)]++;
+    if (ok) append_number_to_buf(buf, value, fmt);
+    return ok;
+}
+
+void print_calc_counters(const uint64_t* counters)
+{
+    printf("  table cells: %llu text, %llu literals, %llu expressions\n", (unsigned long long)counters[CALC_TEXT],
+           (unsigned long long)counters[CALC_LITERAL], (unsigned long long)counters[CALC_EXPRESSION]);
+}
+
+//Cells starting with '=' are formulas. They may refer to other cells of the
+//table in the A1 style (column letters and row number from 1, '$' is allowed
+//and ignored) and to ranges in SUM/AVG/MIN/MAX/COUNT(B2:B9). References become
+//tinyexpr variables v0, v1, ..., so formulas of the same shape (like =B2*C2 and
+//=B3*C3) are compiled once. Formulas are calculated in the dependency order.
+#define FORMULA_SHAPES_SIZE 256
+
+enum {REF_CELL, REF_SUM, REF_AVG, REF_MIN, REF_MAX, REF_COUNT};
+static const char* range_functions[] = {"SUM", "AVG", "MIN", "MAX", "COUNT", NULL};
+
+enum {CELL_UNKNOWN, CELL_IN_PROGRESS, CELL_NUMBER, CELL_NOT_NUMBER};
+
+typedef struct cell_ref {
+    uint8_t  type;
+    uint32_t col1, row1;
+    uint32_t col2, row2;
+} cell_ref;
+
+typedef struct formula_shape {
+    char*       expr;
+    te_program* program; //bytecode of the expression, NULL if it is wrong or too deep
+    te_expr*    compiled;//tree of an expression that can't be lowered
+    double*     vars;
+    uint32_t    vars_count;
+    uint32_t    id;      //index of the shape in the table
+    struct formula_shape* next;
+} formula_shape;
+
+typedef struct formula {
+    uint64_t       cell;
+    uint64_t       refs_start;
+    uint32_t       refs_count;
+    formula_shape* shape;
+} formula;
+
+typedef struct table_formulas {
+    table*         tbl;
+    uint8_t*       state;  //CELL_* for every cell
+    double*        value;
+    uint32_t*      index;  //formula index + 1 for every cell, 0 - not a formula
+    formula*       formulas;
+    uint32_t       formulas_count;
+    cell_ref*      refs;
+    uint64_t       refs_count;
+    formula_shape* shapes[FORMULA_SHAPES_SIZE];
+    uint32_t       shapes_count;
+    uint8_t        cycle;  //a circular reference was reported
+} table_formulas;
+
+static uint8_t is_table_formula(const char* text, uint32_t len)
+{
+    uint32_t i = 0;
+    while (i < len && text[i] == ' ') i++;
+    return i < len && text[i] == '=';
+}
+
+static uint8_t is_name_sym(char sym)
+{
+    return isalnum((unsigned char)sym) || sym == '_';
+}
+
+//parses a reference like B2 or $B$2, returns the length of it or 0
+static uint32_t parse_cell_ref(const char* str, uint32_t* col, uint32_t* row)
+{
+    const char* p = str;
+    if (*p == '$') p++;
+    uint64_t c = 0;
+    uint8_t letters = 0;
+    for (; *p >= 'A' && *p <= 'Z' && letters < 7; p++, letters++) c = c * 26 + (*p - 'A' + 1);
+    if (letters == 0) return 0;
+    if (*p == '$') p++;
+    uint64_t r = 0;
+    uint8_t digits = 0;
+    for (; isdigit((unsigned char)*p) && digits < 10; p++, digits++) r = r * 10 + (*p - '0');
+    if (digits == 0 || r == 0 || r > UINT32_MAX || c > UINT32_MAX) return 0;
+    if (is_name_sym(*p) || *p == '(') return 0;//part of a name or a function
+    *col = c - 1;
+    *row = r - 1;
+    return p - str;
+}
+
+//parses FUNC(B2:B9), returns the length of it or 0
+static uint32_t parse_range_ref(const char* str, cell_ref* ref)
+{
+    for (uint8_t f = 0; range_functions[f] != NULL; f++) {
+        uint32_t name_len = strlen(range_functions[f]);
+        if (strncasecmp(str, range_functions[f], name_len) != 0 || str[name_len] != '(') continue;
+        const char* p = str + name_len + 1;
+        while (*p == ' ') p++;
+        uint32_t len = parse_cell_ref(p, &ref->col1, &ref->row1);
+        if (len == 0) return 0;
+        p += len;
+        while (*p == ' ') p++;
+        if (*p++ != ':') return 0;
+        while (*p == ' ') p++;
+        len = parse_cell_ref(p, &ref->col2, &ref->row2);
+        if (len == 0) return 0;
+        p += len;
+        while (*p == ' ') p++;
+        if (*p++ != ')') return 0;
+        if (ref->col1 > ref->col2) {uint32_t t = ref->col1; ref->col1 = ref->col2; ref->col2 = t;}
+        if (ref->row1 > ref->row2) {uint32_t t = ref->row1; ref->row1 = ref->row2; ref->row2 = t;}
+        ref->type = REF_SUM + f;
+        return p - str;
+    }
+    return 0;
+}
+
+static void add_cell_ref(table_formulas* tf, const cell_ref* ref)
+{
+    if ((tf->refs_count & (tf->refs_count - 1)) == 0) {//grow at powers of two
+        tf->refs = realloc(tf->refs, (tf->refs_count ? tf->refs_count * 2 : 1) * sizeof(cell_ref));
+        is_memory_allocated(tf->refs);
+    }
+    tf->refs[tf->refs_count++] = *ref;
+}
+
+static formula_shape* get_formula_shape(table_formulas* tf, char* expr, uint32_t vars_count)
+{
+    uint32_t bucket = get_str_hash(expr) % FORMULA_SHAPES_SIZE;
+    for (formula_shape* shape = tf->shapes[bucket]; shape != NULL; shape = shape->next) {
+        if (strcmp(shape->expr, expr) == 0) return shape;
+    }
+    formula_shape* shape = calloc(1, sizeof(formula_shape));
+    is_memory_allocated(shape);
+    shape->expr = strdup(expr);
+    is_memory_allocated(shape->expr);
+    shape->vars_count = vars_count;
+    shape->vars = calloc(vars_count + 1, sizeof(double));
+    is_memory_allocated(shape->vars);
+    te_variable* vars = calloc(vars_count + get_doc_vars_count() + 1, sizeof(te_variable));
+    is_memory_allocated(vars);
+    char* names = calloc((uint64_t)vars_count * 12 + 1, sizeof(char));
+    is_memory_allocated(names);
+    for (uint32_t k = 0; k < vars_count; k++) {
+        sprintf(&names[k * 12], "v%u", k);
+        vars[k].name = &names[k * 12];
+        vars[k].address = &shape->vars[k];
+    }
+    uint32_t funcs_count = add_doc_funcs(&vars[vars_count]);
+    int error;
+    shape->program = compile_expr(expr, vars, vars_count + funcs_count, &shape->compiled, &error);
+    shape->id = tf->shapes_count++;
+    free(vars);
+    free(names);
+    shape->next = tf->shapes[bucket];
+    tf->shapes[bucket] = shape;
+    return shape;
+}
+
+//turns the formula into a tinyexpr expression with references as variables
+static void parse_formula(table_formulas* tf, formula* f, const char* text, uint32_t len, str_buf* expr)
+{
+    char* str = strndup(text, len);
+    is_memory_allocated(str);
+    const char* p = strchr(str, '=') + 1;
+    expr->len = 0;
+    append_to_buf(expr, "", 0);
+    f->refs_start = tf->refs_count;
+    f->refs_count = 0;
+    while (*p != '\0') {
+        uint8_t name_start = (isalpha((unsigned char)*p) || *p == '$') &&
+                             (p == str || !(is_name_sym(p[-1]) || p[-1] == '.'));
+        cell_ref ref = {REF_CELL, 0, 0, 0, 0};
+        uint32_t ref_len = 0;
+        if (name_start) {
+            ref_len = parse_range_ref(p, &ref);
+            if (ref_len == 0) {
+                ref_len = parse_cell_ref(p, &ref.col1, &ref.row1);
+                ref.col2 = ref.col1;
+                ref.row2 = ref.row1;
+            }
+        }
+        if (ref_len > 0) {
+            char var[16];
+            sprintf(var, "v%u", f->refs_count++);
+            append_to_buf(expr, var, strlen(var));
+            add_cell_ref(tf, &ref);
+            p += ref_len;
+        } else if (name_start && *p != '$') {
+            //names of builtin functions and constants are case-insensitive
+            uint32_t name_len = 0;
+            while (is_name_sym(p[name_len])) name_len++;
+            uint8_t doc_func = is_doc_func(p, name_len);
+            for (; name_len > 0; p++, name_len--) append_sym_to_buf(expr, doc_func ? *p : tolower((unsigned char)*p), 1);
+        } else {
+            append_sym_to_buf(expr, (*p == ',') ? '.' : *p, 1);
+            p++;
+        }
+    }
+    free(str);
+    f->shape = get_formula_shape(tf, expr->str, f->refs_count);
+}
+
+static void get_cell_name(uint32_t col, uint32_t row, char* name)
+{
+    char letters[8];
+    uint8_t n = 0;
+    for (uint64_t c = (uint64_t)col + 1; c > 0 && n < 7; c = (c - 1) / 26) letters[n++] = 'A' + (c - 1) % 26;
+    uint8_t i = 0;
+    while (n > 0) name[i++] = letters[--n];
+    sprintf(&name[i], "%u", row + 1);
+}
+
+//index of the cell in the table or UINT64_MAX if there is no such cell
+static uint64_t get_ref_cell(const table* tbl, uint32_t col, uint32_t row)
+{
+    if (row >= tbl->rows_count || col >= tbl->cells_in_row[row]) return UINT64_MAX;
+    return (uint64_t)col * tbl->rows_count + row;
+}
+
+//value of a cell that is not a formula
+static uint8_t get_literal_value(table_formulas* tf, uint64_t c)
+{
+    if (tf->state[c] == CELL_UNKNOWN) {
+        uint8_t ok;
+        eval_table_cell(&tf->tbl->text.str[tf->tbl->cell_off[c]], tf->tbl->cell_len[c], &tf->value[c], &ok);
+        tf->state[c] = ok ? CELL_NUMBER : CELL_NOT_NUMBER;
+    }
+    return tf->state[c];
+}
+
+static uint8_t get_ref_value(table_formulas* tf, const cell_ref* ref, double* value)
+{
+    const table* tbl = tf->tbl;
+    if (ref->type == REF_CELL) {
+        uint64_t c = get_ref_cell(tbl, ref->col1, ref->row1);
+        if (c == UINT64_MAX) return 0;
+        if (tf->index[c] == 0) get_literal_value(tf, c);
+        *value = tf->value[c];
+        return tf->state[c] == CELL_NUMBER;
+    }
+    double sum = 0;
+    double min = INFINITY;
+    double max = -INFINITY;
+    uint64_t count = 0;
+    for (uint32_t col = ref->col1; col <= ref->col2; col++) {
+        for (uint32_t row = ref->row1; row <= ref->row2 && row < tbl->rows_count; row++) {
+            uint64_t c = get_ref_cell(tbl, col, row);
+            if (c == UINT64_MAX) continue;
+            if (tf->index[c] == 0) {
+                if (get_literal_value(tf, c) != CELL_NUMBER) continue;//text is skipped
+            } else if (tf->state[c] != CELL_NUMBER) {
+                return 0;//wrong formula
+            }
+            double v = tf->value[c];
+            sum += v;
+            if (v < min) min = v;
+            if (v > max) max = v;
+            count++;
+        }
+    }
+    switch (ref->type) {
+        case REF_SUM: *value = sum; return 1;
+        case REF_AVG: *value = sum / count; return count > 0;
+        case REF_MIN: *value = min; return count > 0;
+        case REF_MAX: *value = max; return count > 0;
+        default: *value = count; return 1;
+    }
+}
+
+static void eval_formula(table_formulas* tf, formula* f, uint8_t cycle)
+{
+    formula_shape* shape = f->shape;
+    uint8_t ok = (cycle == 0 && (shape->program != NULL || shape->compiled != NULL));
+    for (uint32_t k = 0; k < f->refs_count && ok; k++) {
+        ok = get_ref_value(tf, &tf->refs[f->refs_start + k], &shape->vars[k]);
+    }
+    if (ok) tf->value[f->cell] = (shape->program != NULL) ? te_run(shape->program) : te_eval(shape->compiled);
+    tf->state[f->cell] = ok ? CELL_NUMBER : CELL_NOT_NUMBER;
+}
+
+//Formulas that refer only to single cells without formulas (like =B2*C2 in every
+//row of a computed column) don't depend on other formulas. They are grouped by
+//the shape and calculated with te_run_batch(), the references are input columns.
+#define FORMULA_BATCH_SIZE 1024
+
+static uint8_t is_batch_formula(table_formulas* tf, const formula* f)
+{
+    if (f->shape->program == NULL) return 0;
+    for (uint32_t k = 0; k < f->refs_count; k++) {
+        const cell_ref* ref = &tf->refs[f->refs_start + k];
+        if (ref->type != REF_CELL) return 0;
+        uint64_t c = get_ref_cell(tf->tbl, ref->col1, ref->row1);
+        if (c != UINT64_MAX && tf->index[c] != 0) return 0;
+    }
+    return 1;
+}
+
+//formulas of the same shape
+static void eval_formula_batch(table_formulas* tf, const uint32_t* batch, uint32_t count)
+{
+    formula_shape* shape = tf->formulas[batch[0]].shape;
+    uint32_t vars_count = shape->vars_count;
+    double* inputs = calloc((uint64_t)vars_count * count + 1, sizeof(double));
+    is_memory_allocated(inputs);
+    const double** vars = calloc(vars_count + 1, sizeof(double*));
+    is_memory_allocated(vars);
+    const double** columns = calloc(vars_count + 1, sizeof(double*));
+    is_memory_allocated(columns);
+    uint32_t* rows = calloc(count, sizeof(uint32_t));
+    is_memory_allocated(rows);
+    double* out = calloc(count, sizeof(double));
+    is_memory_allocated(out);
+    for (uint32_t k = 0; k < vars_count; k++) {
+        vars[k] = &shape->vars[k];
+        columns[k] = &inputs[(uint64_t)k * count];
+    }
+
+    uint32_t n = 0;//formulas with all references to numbers
+    for (uint32_t j = 0; j < count; j++) {
+        const formula* f = &tf->formulas[batch[j]];
+        uint8_t ok = 1;
+        for (uint32_t k = 0; k < vars_count && ok; k++) {
+            ok = get_ref_value(tf, &tf->refs[f->refs_start + k], &inputs[(uint64_t)k * count + n]);
+        }
+        if (ok) rows[n++] = batch[j];
+        else tf->state[f->cell] = CELL_NOT_NUMBER;
+    }
+    te_run_batch(shape->program, vars, columns, vars_count, out, n);
+    for (uint32_t j = 0; j < n; j++) {
+        uint64_t c = tf->formulas[rows[j]].cell;
+        tf->value[c] = out[j];
+        tf->state[c] = CELL_NUMBER;
+    }
+    free(inputs);
+    free(vars);
+    free(columns);
+    free(rows);
+    free(out);
+}
+
+static void eval_formula_batches(table_formulas* tf)
+{
+    //counting sort of the batch formulas by the shape
+    uint32_t* first = calloc(tf->shapes_count + 1, sizeof(uint32_t));
+    is_memory_allocated(first);
+    uint32_t* order = calloc(tf->formulas_count, sizeof(uint32_t));
+    is_memory_allocated(order);
+    uint32_t batch_count = 0;
+    for (uint32_t i = 0; i < tf->formulas_count; i++) {
+        if (!is_batch_formula(tf, &tf->formulas[i])) continue;
+        order[batch_count++] = i;
+        first[tf->formulas[i].shape->id + 1]++;
+    }
+    for (uint32_t i = 0; i < tf->shapes_count; i++) first[i + 1] += first[i];
+    uint32_t* sorted = calloc(batch_count + 1, sizeof(uint32_t));
+    is_memory_allocated(sorted);
+    for (uint32_t j = 0; j < batch_count; j++) sorted[first[tf->formulas[order[j]].shape->id]++] = order[j];
+
+    //the formulas of every shape are contiguous now
+    for (uint32_t j = 0; j < batch_count;) {
+        uint32_t end = j;
+        while (end < batch_count && end - j < FORMULA_BATCH_SIZE &&
+               tf->formulas[sorted[end]].shape == tf->formulas[sorted[j]].shape) end++;
+        eval_formula_batch(tf, &sorted[j], end - j);
+        j = end;
+    }
+    free(first);
+    free(order);
+    free(sorted);
+}
+
+typedef struct formula_frame {
+    uint32_t formula;
+    uint32_t ref;     //reference that is being checked
+    uint64_t pos;     //position in the range
+    uint8_t  cycle;
+} formula_frame;
+
+//next formula the frame formula depends on, UINT32_MAX if there are no more
+static uint32_t get_next_dependency(table_formulas* tf, formula_frame* fr)
+{
+    const formula* f = &tf->formulas[fr->formula];
+    for (; fr->ref < f->refs_count; fr->ref++, fr->pos = 0) {
+        const cell_ref* ref = &tf->refs[f->refs_start + fr->ref];
+        uint64_t rows = (uint64_t)ref->row2 - ref->row1 + 1;
+        uint64_t size = rows * ((uint64_t)ref->col2 - ref->col1 + 1);
+        while (fr->pos < size) {
+            uint64_t c = get_ref_cell(tf->tbl, ref->col1 + fr->pos / rows, ref->row1 + fr->pos % rows);
+            fr->pos++;
+            if (c != UINT64_MAX && tf->index[c] != 0) return tf->index[c] - 1;
+        }
+    }
+    return UINT32_MAX;
+}
+
+static void eval_formulas(table_formulas* tf)
+{
+    formula_frame* stack = calloc(tf->formulas_count + 1, sizeof(formula_frame));
+    is_memory_allocated(stack);
+    for (uint32_t i = 0; i < tf->formulas_count; i++) {
+        if (tf->state[tf->formulas[i].cell] != CELL_UNKNOWN) continue;
+        uint32_t top = 0;
+        stack[0] = (formula_frame){i, 0, 0, 0};
+        tf->state[tf->formulas[i].cell] = CELL_IN_PROGRESS;
+        for (;;) {
+            formula_frame* fr = &stack[top];
+            uint32_t dep = get_next_dependency(tf, fr);
+            if (dep == UINT32_MAX) {
+                eval_formula(tf, &tf->formulas[fr->formula], fr->cycle);
+                if (top == 0) break;
+                top--;
+                continue;
+            }
+            uint8_t state = tf->state[tf->formulas[dep].cell];
+            if (state == CELL_IN_PROGRESS) {
+                fr->cycle = 1;
+                if (tf->cycle == 0) {
+                    const formula* f = &tf->formulas[fr->formula];
+                    char name[24];
+                    get_cell_name(f->cell / tf->tbl->rows_count, f->cell % tf->tbl->rows_count, name);
+                    printf("  Error: circular reference in the table cell %s\n", name);
+                    tf->cycle = 1;
+                }
+            } else if (state == CELL_UNKNOWN) {
+                tf->state[tf->formulas[dep].cell] = CELL_IN_PROGRESS;
+                stack[++top] = (formula_frame){dep, 0, 0, 0};
+            }
+        }
+    }
+    free(stack);
+}
+
+//calculates formulas, returns formula indexes of the cells or NULL if there are no formulas
+static uint32_t* calc_table_formulas(table* tbl, const number_format* fmt)
+{
+    uint64_t cells_count = (uint64_t)tbl->rows_count * tbl->cols_count;
+    table_formulas tf;
+    memset(&tf, 0, sizeof(table_formulas));
+    tf.tbl = tbl;
+    for (uint64_t c = 0; c < cells_count; c++) {
+        if (c / tbl->rows_count >= tbl->cells_in_row[c % tbl->rows_count]) continue;
+        if (!is_table_formula(&tbl->text.str[tbl->cell_off[c]], tbl->cell_len[c])) continue;
+        if (tf.index == NULL) {
+            tf.index = calloc(cells_count + 1, sizeof(uint32_t));
+            is_memory_allocated(tf.index);
+        }
+        tf.index[c] = ++tf.formulas_count;
+    }
+    if (tf.formulas_count == 0) return NULL;
+    tbl->calculated[CALC_EXPRESSION] += tf.formulas_count;
+
+    tf.state = calloc(cells_count + 1, sizeof(uint8_t));
+    is_memory_allocated(tf.state);
+    tf.value = calloc(cells_count + 1, sizeof(double));
+    is_memory_allocated(tf.value);
+    tf.formulas = calloc(tf.formulas_count, sizeof(formula));
+    is_memory_allocated(tf.formulas);
+    str_buf expr = {NULL, 0, 0};
+    for (uint64_t c = 0; c < cells_count; c++) {
+        if (tf.index == NULL || tf.index[c] == 0) continue;
+        formula* f = &tf.formulas[tf.index[c] - 1];
+        f->cell = c;
+        parse_formula(&tf, f, &tbl->text.str[tbl->cell_off[c]], tbl->cell_len[c], &expr);
+    }
+    free(expr.str);
+
+    eval_formula_batches(&tf);
+    eval_formulas(&tf);
+    for (uint32_t i = 0; i < tf.formulas_count; i++) {
+        uint64_t c = tf.formulas[i].cell;
+        if (tf.state[c] != CELL_NUMBER) continue;//wrong formulas are left as they are
+        tbl->cell_off[c] = tbl->text.len;
+        append_number_to_buf(&tbl->text, tf.value[c], fmt);
+        tbl->cell_len[c] = tbl->text.len - tbl->cell_off[c];
+    }
+
+    for (uint32_t i = 0; i < FORMULA_SHAPES_SIZE; i++) {
+        formula_shape* shape = tf.shapes[i];
+        while (shape != NULL) {
+            formula_shape* next = shape->next;
+            te_free(shape->compiled);
+            te_program_free(shape->program);
+            free(shape->vars);
+            free(shape->expr);
+            free(shape);
+            shape = next;
+        }
+    }
+    free(tf.state);
+    free(tf.value);
+    free(tf.formulas);
+    free(tf.refs);
+    return tf.index;
+}
+
+//Big tables are processed in blocks of rows on several threads: every block
+//calculates its cells into its own text buffer, measures them in its own layout
+//and formats its rows right into their place in the result.
+#define TABLE_BLOCK_CELLS 32768 //cells in a block at least, smaller tables are processed on one thread
+#define CELL_IN_BLOCK ((uint64_t)1 << 63)//the cell offset is in the text of the block
+
+static uint32_t get_table_blocks_count(const table* tbl)
+{
+    uint64_t min_rows = TABLE_BLOCK_CELLS / (tbl->cols_count > 0 ? tbl->cols_count : 1);
+    return get_blocks_count(tbl->rows_count, min_rows);
+}
+
+typedef struct calc_block {
+    str_buf  text;
+    uint64_t counters[3];
+    uint64_t base;//offset of the block text in the table text
+} calc_block;
+
+typedef struct calc_job {
+    table*          tbl;
+    const uint32_t* formulas;
+    calc_block*     blocks;//NULL on one thread
+    const number_format* fmt;
+} calc_job;
+
+static void calc_table_rows(void* arg, uint32_t block, uint64_t start, uint64_t end)
+{
+    calc_job* job = arg;
+    table* tbl = job->tbl;
+    str_buf* text = (job->blocks != NULL) ? &job->blocks[block].text : &tbl->text;
+    uint64_t* counters = (job->blocks != NULL) ? job->blocks[block].counters : tbl->calculated;
+    uint64_t flag = (job->blocks != NULL) ? CELL_IN_BLOCK : 0;
+    for (uint32_t j = 0; j < tbl->cols_count; j++) {
+        for (uint32_t i = start; i < end; i++) {
+            if (j >= tbl->cells_in_row[i]) continue;
+            uint64_t c = (uint64_t)j * tbl->rows_count + i;
+            if (job->formulas != NULL && job->formulas[c] != 0) continue;
+            uint64_t off = text->len;
+            if (calc_table_cell(&tbl->text.str[tbl->cell_off[c]], tbl->cell_len[c], text, counters, job->fmt)) {
+                tbl->cell_off[c] = off | flag;
+                tbl->cell_len[c] = text->len - off;
+            }
+        }
+    }
+}
+
+//cells calculated by the block get offsets in the table text
+static void move_block_cells(void* arg, uint32_t block, uint64_t start, uint64_t end)
+{
+    calc_job* job = arg;
+    table* tbl = job->tbl;
+    uint64_t base = job->blocks[block].base;
+    for (uint32_t j = 0; j < tbl->cols_count; j++) {
+        for (uint32_t i = start; i < end; i++) {
+            uint64_t c = (uint64_t)j * tbl->rows_count + i;
+            if (j < tbl->cells_in_row[i] && (tbl->cell_off[c] & CELL_IN_BLOCK)) {
+                tbl->cell_off[c] = (tbl->cell_off[c] & ~CELL_IN_BLOCK) + base;
+            }
+        }
+    }
+}
+
+void calc_in_table(table* tbl, const number_format* fmt)
+{
+    uint32_t* formulas = calc_table_formulas(tbl, fmt);
+    calc_job job = {tbl, formulas, NULL, fmt};
+    uint32_t blocks = get_table_blocks_count(tbl);
+    if (blocks > 1) {
+        job.blocks = calloc(blocks, sizeof(calc_block));
+        is_memory_allocated(job.blocks);
+    }
+    //formulas read the cells, so they are calculated before the cells change
+    run_in_blocks(tbl->rows_count, blocks, calc_table_rows, &job);
+    if (blocks > 1) {
+        for (uint32_t b = 0; b < blocks; b++) {
+            calc_block* cb = &job.blocks[b];
+            cb->base = tbl->text.len;
+            append_to_buf(&tbl->text, cb->text.str, cb->text.len);
+            for (uint8_t k = 0; k < 3; k++) tbl->calculated[k] += cb->counters[k];
+            free(cb->text.str);
+        }
+        run_in_blocks(tbl->rows_count, blocks, move_block_cells, &job);
+        free(job.blocks);
+    }
+    free(formulas);
+}
+
+//Footer rows with totals of the numeric columns (attributes sum, avg, min, max).
+//Numbers of a column are parsed once into a double array and reduced in one pass.
+
+typedef struct column_total {
+    double   sum;
+    double   min;
+    double   max;
+    uint64_t count;
+    uint8_t  decimals;//max number of decimal places of the values
+    uint8_t  comma;   //values are written with the decimal comma
+} column_total;
+
+//finite numbers of the cells are counted in the totals
+static uint8_t get_cell_number(const char* text, uint32_t len, double* value, column_total* t)
+{
+    number_info info;
+    if (!parse_number(text, len, value, &info) || !isfinite(*value)) return 0;
+    if (info.decimals > t->decimals) t->decimals = (info.decimals < UINT8_MAX) ? info.decimals : UINT8_MAX;
+    if (info.comma) t->comma = 1;
+    return 1;
+}
+
+static void add_to_total(column_total* t, const double* values, uint64_t count)
+{
+    if (count == 0) return;
+    if (t->count == 0) {
+        t->min = values[0];
+        t->max = values[0];
+    }
+    //independent accumulators let the compiler keep several lanes busy
+    double sum[4] = {0, 0, 0, 0};
+    double min[4] = {t->min, t->min, t->min, t->min};
+    double max[4] = {t->max, t->max, t->max, t->max};
+    uint64_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        for (uint8_t k = 0; k < 4; k++) {
+            double v = values[i + k];
+            sum[k] += v;
+            min[k] = (v < min[k]) ? v : min[k];
+            max[k] = (v > max[k]) ? v : max[k];
+        }
+    }
+    for (; i < count; i++) {
+        sum[0] += values[i];
+        min[0] = (values[i] < min[0]) ? values[i] : min[0];
+        max[0] = (values[i] > max[0]) ? values[i] : max[0];
+    }
+    t->sum += (sum[0] + sum[1]) + (sum[2] + sum[3]);
+    for (uint8_t k = 0; k < 4; k++) {
+        if (min[k] < t->min) t->min = min[k];
+        if (max[k] > t->max) t->max = max[k];
+    }
+    t->count += count;
+}
+
+//totals have the decimals of the column or dec=N of the table
+static void append_total(str_buf* buf, const column_total* t, uint8_t kind, const number_format* fmt)
+{
+    double value = (kind == 0) ? t->sum : (kind == 1) ? t->sum / t->count : (kind == 2) ? t->min : t->max;
+    number_format total = *fmt;
+    if (fmt->decimals < 0 && fabs(value) < 1e15) {
+        total.decimals = t->decimals;
+        if (kind == 1 && total.decimals < 2) total.decimals = 2;
+        if (total.decimals > 9) total.decimals = 9;
+    }
+    uint64_t start = buf->len;
+    append_number_to_buf(buf, value, &total);
+    if (t->comma) change_symbols('.', ',', &buf->str[start]);
+}
+
+//Appends the footer rows to buf: cell j of footer k is at off[k * cols_count + j].
+//The label goes to the first column without numbers.
+static uint8_t make_table_footers(const column_total* totals, uint32_t cols_count, uint8_t kinds,
+                                  const number_format* fmt, str_buf* buf, uint64_t* off, uint32_t* len)
+{
+    uint32_t label_col = 0;
+    while (label_col < cols_count && totals[label_col].count > 0) label_col++;
+    uint8_t footers = 0;
+    for (uint8_t kind = 0; total_names[kind] != NULL; kind++) {
+        if ((kinds & (1 << kind)) == 0) continue;
+        for (uint32_t j = 0; j < cols_count; j++) {
+            uint64_t c = (uint64_t)footers * cols_count + j;
+            off[c] = buf->len;
+            if (j == label_col) {
+                append_to_buf(buf, total_labels[kind], strlen(total_labels[kind]));
+            } else if (totals[j].count > 0) {
+                append_total(buf, &totals[j], kind, fmt);
+            }
+            len[c] = buf->len - off[c];
+        }
+        footers++;
+    }
+    return footers;
+}
+
+//the header row is not counted unless there is the nh attribute
+void add_table_totals(table* tbl, const table_options* opt)
+{
+    uint8_t kinds = opt->totals;
+    const number_format* fmt = &opt->num;
+    if (kinds == 0 || tbl->cols_count == 0) return;
+    uint32_t cols = tbl->cols_count;
+    uint32_t rows = tbl->rows_count;
+    column_total* totals = calloc(cols, sizeof(column_total));
+    is_memory_allocated(totals);
+    double* values = calloc(rows + 1, sizeof(double));
+    is_memory_allocated(values);
+    for (uint32_t j = 0; j < cols; j++) {
+        uint64_t count = 0;
+        for (uint32_t i = (opt->nh) ? 0 : 1; i < rows; i++) {
+            uint64_t c = (uint64_t)j * rows + i;
+            if (j < tbl->cells_in_row[i] &&
+                get_cell_number(&tbl->text.str[tbl->cell_off[c]], tbl->cell_len[c], &values[count], &totals[j])) {
+                count++;
+            }
+        }
+        add_to_total(&totals[j], values, count);
+    }
+    free(values);
+
+    //footers are added as rows, the cells are moved to the new number of rows
+    uint64_t* footer_off = calloc(4 * (uint64_t)cols, sizeof(uint64_t));
+    is_memory_allocated(footer_off);
+    uint32_t* footer_len = calloc(4 * (uint64_t)cols, sizeof(uint32_t));
+    is_memory_allocated(footer_len);
+    uint8_t footers = make_table_footers(totals, cols, kinds, fmt, &tbl->text, footer_off, footer_len);
+    free(totals);
+    uint32_t new_rows = rows + footers;
+    uint64_t* cell_off = calloc((uint64_t)new_rows * cols + 1, sizeof(uint64_t));
+    is_memory_allocated(cell_off);
+    uint32_t* cell_len = calloc((uint64_t)new_rows * cols + 1, sizeof(uint32_t));
+    is_memory_allocated(cell_len);
+    for (uint32_t j = 0; j < cols; j++) {
+        memcpy(&cell_off[(uint64_t)j * new_rows], &tbl->cell_off[(uint64_t)j * rows], rows * sizeof(uint64_t));
+        memcpy(&cell_len[(uint64_t)j * new_rows], &tbl->cell_len[(uint64_t)j * rows], rows * sizeof(uint32_t));
+        for (uint8_t k = 0; k < footers; k++) {
+            cell_off[(uint64_t)j * new_rows + rows + k] = footer_off[k * cols + j];
+            cell_len[(uint64_t)j * new_rows + rows + k] = footer_len[k * cols + j];
+        }
+    }
+    free(footer_off);
+    free(footer_len);
+    free(tbl->cell_off);
+    free(tbl->cell_len);
+    tbl->cell_off = cell_off;
+    tbl->cell_len = cell_len;
+    tbl->cells_in_row = realloc(tbl->cells_in_row, (new_rows + 1) * sizeof(uint32_t));
+    is_memory_allocated(tbl->cells_in_row);
+    for (uint8_t k = 0; k < footers; k++) tbl->cells_in_row[rows + k] = cols;
+    tbl->rows_count = new_rows;
+}
+
+//Rows can be filtered (filter=3:gt:100), sorted by a column (sort=2, rsort=2
+//for the descending order) and cut to the first rows (top=10). The first row is
+//the header and stays in place unless there is the nh attribute. Numbers of the
+//column are sorted by LSD radix sort on the bits of the values and go first, text
+//cells go after them sorted by merge sort. top=N of a sorted table selects N rows
+//with a bounded heap, so the other rows are never sorted. Cells without a value
+//go last.
+typedef struct row_filter {
+    uint32_t    col;      //from 0
+    uint8_t     op;       //FILTER_*
+    const char* value;
+    uint32_t    len;
+    double      number;
+    uint8_t     is_number;
+} row_filter;
+
+enum {SORT_NUMBER, SORT_TEXT, SORT_EMPTY};//kinds of the cells in the sorting order
+
+typedef struct sort_keys {
+    const table* tbl;
+    uint32_t     col;     //from 0
+    uint8_t      desc;
+    uint64_t*    keys;    //keys of the rows by their index, NULL if there are no numbers in the column
+    uint8_t*     kinds;   //SORT_* of the rows by their index, NULL with keys
+} sort_keys;
+
+//cell text without spaces around it, missing cells are empty
+static const char* get_key_cell(const table* tbl, uint32_t row, uint32_t col, uint32_t* len)
+{
+    *len = 0;
+    if (col >= tbl->cells_in_row[row]) return "";
+    uint64_t c = (uint64_t)col * tbl->rows_count + row;
+    const char* text = &tbl->text.str[tbl->cell_off[c]];
+    uint32_t n = tbl->cell_len[c];
+    while (n > 0 && text[0] == ' ') {text++; n--;}
+    while (n > 0 && text[n - 1] == ' ') n--;
+    *len = n;
+    return text;
+}
+
+static int compare_texts(const char* a, uint32_t a_len, const char* b, uint32_t b_len)
+{
+    int cmp = memcmp(a, b, (a_len < b_len) ? a_len : b_len);
+    return (cmp != 0) ? cmp : (a_len > b_len) - (a_len < b_len);
+}
+
+static uint8_t is_row_kept(const table* tbl, uint32_t row, const row_filter* f)
+{
+    uint32_t len;
+    const char* text = get_key_cell(tbl, row, f->col, &len);
+    double value;
+    column_total t = {0};
+    int cmp;
+    if (f->is_number) {
+        //only numbers are compared with a number
+        if (!get_cell_number(text, len, &value, &t)) return f->op == FILTER_NE;
+        cmp = (value > f->number) - (value < f->number);
+    } else {
+        cmp = compare_texts(text, len, f->value, f->len);
+    }
+    switch (f->op) {
+        case FILTER_EQ: return cmp == 0;
+        case FILTER_NE: return cmp != 0;
+        case FILTER_LT: return cmp < 0;
+        case FILTER_LE: return cmp <= 0;
+        case FILTER_GT: return cmp > 0;
+        default:        return cmp >= 0;
+    }
 }
 
-char* get_text_before_tag(char* str, char* tag)
+//the order of the keys is the order of the values, -0 is 0
+static uint64_t get_number_key(double value)
 {
-    char* open_tag = get_open_tag(tag);
-    char* start_tag = strstr(str, open_tag);
-    char* text_before_tag = (char*)calloc(start_tag - &str[0] + 1, sizeof(char));
-    is_memory_allocated(text_before_tag);
-    memcpy(text_before_tag, &str[0], start_tag - &str[0]);
-    text_before_tag[start_tag - &str[0]] = '\0';
-    free(open_tag);
-    return text_before_tag;
+    if (value == 0) value = 0;
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return (bits >> 63) ? ~bits : bits | ((uint64_t)1 << 63);
 }
 
-char* get_text_after_tag(char* str, char* tag)
+//numeric keys and kinds of the cells if there are numbers in the column
+static void get_sort_keys(sort_keys* sk, const uint32_t* rows, uint32_t count)
 {
-    char* close_tag = get_close_tag(tag);
-    char* end_tag = strstr(str, close_tag);
-    if (end_tag == NULL) {
-        if (is_valid_tag(tag) != -1) {
-            printf("  Error: no closing tag found for \"%s\". Ignoring\n", tag);
-        } else print_tag_error(tag);
-        free(close_tag);
-        close_tag = get_open_tag(tag);
-        end_tag = strstr(str, close_tag);
-    } else if (is_valid_tag(tag) == -1) print_tag_error(tag);
-    end_tag = end_tag + sizeof(char) * strlen(close_tag);
-    free(close_tag);
-    char* text_after_tag = (char*)calloc(strlen(str) - (end_tag - &str[0]) + 1, sizeof(char));
-    is_memory_allocated(text_after_tag);
-    strcpy(text_after_tag, end_tag);
-    return text_after_tag;
+    const table* tbl = sk->tbl;
+    sk->keys = calloc(tbl->rows_count + 1, sizeof(uint64_t));
+    is_memory_allocated(sk->keys);
+    sk->kinds = calloc(tbl->rows_count + 1, sizeof(uint8_t));
+    is_memory_allocated(sk->kinds);
+    uint32_t numbers = 0;
+    for (uint32_t k = 0; k < count; k++) {
+        uint32_t len;
+        const char* text = get_key_cell(tbl, rows[k], sk->col, &len);
+        double value;
+        column_total t = {0};
+        sk->keys[rows[k]] = UINT64_MAX;
+        sk->kinds[rows[k]] = (len == 0) ? SORT_EMPTY : SORT_TEXT;
+        if (len == 0 || !get_cell_number(text, len, &value, &t)) continue;
+        sk->keys[rows[k]] = sk->desc ? ~get_number_key(value) : get_number_key(value);
+        sk->kinds[rows[k]] = SORT_NUMBER;
+        numbers++;
+    }
+    if (numbers > 0) return;
+    free(sk->keys);
+    free(sk->kinds);
+    sk->keys = NULL;
+    sk->kinds = NULL;
 }
 
+//rows with equal keys keep their order
+static int compare_rows(const sort_keys* sk, uint32_t a, uint32_t b)
+{
+    int cmp;
+    if (sk->kinds != NULL && sk->kinds[a] != sk->kinds[b]) {
+        cmp = (sk->kinds[a] > sk->kinds[b]) - (sk->kinds[a] < sk->kinds[b]);
+    } else if (sk->keys != NULL && sk->kinds[a] == SORT_NUMBER) {
+        cmp = (sk->keys[a] > sk->keys[b]) - (sk->keys[a] < sk->keys[b]);
+    } else {
+        uint32_t a_len, b_len;
+        const char* a_text = get_key_cell(sk->tbl, a, sk->col, &a_len);
+        const char* b_text = get_key_cell(sk->tbl, b, sk->col, &b_len);
+        if (a_len == 0 || b_len == 0) cmp = (a_len == 0) - (b_len == 0);
+        else cmp = sk->desc ? compare_texts(b_text, b_len, a_text, a_len) : compare_texts(a_text, a_len, b_text, b_len);
+    }
+    return (cmp != 0) ? cmp : (a > b) - (a < b);
+}
 
+//LSD radix sort of the rows by their keys, 8 bits at a time
+static void radix_sort_rows(const sort_keys* sk, uint32_t* rows, uint32_t count)
+{
+    uint64_t* keys = malloc(2 * ((uint64_t)count + 1) * sizeof(uint64_t));
+    is_memory_allocated(keys);
+    uint32_t* tmp = malloc(((uint64_t)count + 1) * sizeof(uint32_t));
+    is_memory_allocated(tmp);
+    uint64_t* src_keys = keys;
+    uint64_t* dst_keys = &keys[count + 1];
+    uint32_t* src_rows = rows;
+    uint32_t* dst_rows = tmp;
+    for (uint32_t k = 0; k < count; k++) src_keys[k] = sk->keys[rows[k]];
+    for (uint8_t shift = 0; shift < 64; shift += 8) {
+        uint32_t counts[257] = {0};
+        for (uint32_t k = 0; k < count; k++) counts[((src_keys[k] >> shift) & 0xFF) + 1]++;
+        if (counts[((src_keys[0] >> shift) & 0xFF) + 1] == count) continue;//the same byte in all keys
+        for (uint16_t d = 1; d <= 256; d++) counts[d] += counts[d - 1];
+        for (uint32_t k = 0; k < count; k++) {
+            uint32_t pos = counts[(src_keys[k] >> shift) & 0xFF]++;
+            dst_keys[pos] = src_keys[k];
+            dst_rows[pos] = src_rows[k];
+        }
+        uint64_t* swap_keys = src_keys; src_keys = dst_keys; dst_keys = swap_keys;
+        uint32_t* swap_rows = src_rows; src_rows = dst_rows; dst_rows = swap_rows;
+    }
+    if (src_rows != rows) memcpy(rows, src_rows, count * sizeof(uint32_t));
+    free(keys);
+    free(tmp);
+}
 
-char* execute_tag(char* tag, char* tag_content)
+//bottom-up merge sort of the rows
+static void merge_sort_rows(const sort_keys* sk, uint32_t* rows, uint32_t count)
 {
-    char* t_tag = strdup(tag);
-    t_tag = rm_spaces_start_end(t_tag);
-    int8_t tag_i = is_valid_tag(t_tag);
-    
-    if (tag_i != -1 && strcmp(tag_content, "\r") != 0) {
-        char** attr = get_tag_attributes(t_tag);
-        char* tag_result = (*tag_functions[tag_i])(tag_content, attr);
-        for (uint16_t i = 0; i < have_attributes(tag) - 1; i++) {
-            if (attr[i] != NULL) free(attr[i]);
-            else break;
+    uint32_t* tmp = malloc(((uint64_t)count + 1) * sizeof(uint32_t));
+    is_memory_allocated(tmp);
+    uint32_t* src = rows;
+    uint32_t* dst = tmp;
+    for (uint64_t width = 1; width < count; width *= 2) {
+        for (uint64_t start = 0; start < count; start += 2 * width) {
+            uint64_t mid = (start + width < count) ? start + width : count;
+            uint64_t end = (start + 2 * width < count) ? start + 2 * width : count;
+            uint64_t a = start, b = mid, k = start;
+            while (a < mid && b < end) dst[k++] = (compare_rows(sk, src[b], src[a]) < 0) ? src[b++] : src[a++];
+            while (a < mid) dst[k++] = src[a++];
+            while (b < end) dst[k++] = src[b++];
         }
-        free(t_tag);
-        free(attr);
-        return tag_result;
+        uint32_t* swap = src; src = dst; dst = swap;
     }
-    free(t_tag);
-    return tag_content;
+    if (src != rows) memcpy(rows, src, count * sizeof(uint32_t));
+    free(tmp);
 }
 
-char* execute_nested_tags(char* str)
+//numbers, text cells and cells without a value are put one after another keeping
+//their order, then the numbers are sorted by their keys and the text cells by merge sort
+static void sort_rows_by_kind(const sort_keys* sk, uint32_t* rows, uint32_t count)
 {
-    char* tag = get_tag(str);
-    if (tag != NULL) {
-        char* t_tag = strdup(tag);
-        t_tag = rm_spaces_start_end(t_tag);
+    uint32_t* tmp = malloc(((uint64_t)count + 1) * sizeof(uint32_t));
+    is_memory_allocated(tmp);
+    uint32_t starts[SORT_EMPTY + 2] = {0};
+    for (uint32_t k = 0; k < count; k++) starts[sk->kinds[rows[k]] + 1]++;
+    for (uint8_t kind = 1; kind <= SORT_EMPTY + 1; kind++) starts[kind] += starts[kind - 1];
+    uint32_t numbers = starts[SORT_TEXT];
+    uint32_t texts = starts[SORT_EMPTY] - numbers;
+    for (uint32_t k = 0; k < count; k++) tmp[starts[sk->kinds[rows[k]]]++] = rows[k];
+    memcpy(rows, tmp, count * sizeof(uint32_t));
+    free(tmp);
+    if (numbers > 1) radix_sort_rows(sk, rows, numbers);
+    if (texts > 1) merge_sort_rows(sk, &rows[numbers], texts);
+}
 
-        char* tag_content = get_tag_content(str, tag);
-        char* res = execute_nested_tags(tag_content);
+static void sift_down_row(const sort_keys* sk, uint32_t* heap, uint32_t size, uint32_t k)
+{
+    while (2 * (uint64_t)k + 1 < size) {
+        uint32_t child = 2 * k + 1;
+        if (child + 1 < size && compare_rows(sk, heap[child + 1], heap[child]) > 0) child++;
+        if (compare_rows(sk, heap[child], heap[k]) <= 0) break;
+        uint32_t swap = heap[k]; heap[k] = heap[child]; heap[child] = swap;
+        k = child;
+    }
+}
 
-        char* text_before_tag = get_text_before_tag(str, tag);
-        char* text_after_tag = get_text_after_tag(str, t_tag);
+//the first top rows in the sorting order are moved to the start of rows, sorted
+static void select_top_rows(const sort_keys* sk, uint32_t* rows, uint32_t count, uint32_t top)
+{
+    //the heap keeps the best rows found so far, the worst of them is the root
+    uint32_t* heap = rows;
+    for (uint32_t k = top / 2; k > 0; k--) sift_down_row(sk, heap, top, k - 1);
+    for (uint32_t k = top; k < count; k++) {
+        if (compare_rows(sk, rows[k], heap[0]) >= 0) continue;
+        heap[0] = rows[k];
+        sift_down_row(sk, heap, top, 0);
+    }
+    for (uint32_t size = top; size > 1; size--) {
+        uint32_t swap = heap[0]; heap[0] = heap[size - 1]; heap[size - 1] = swap;
+        sift_down_row(sk, heap, size - 1, 0);
+    }
+}
 
-        char* result = NULL;
-        char* tag_result = execute_tag(tag, res);
-        uint32_t len = strlen(text_before_tag) + strlen(tag_result) + strlen(text_after_tag) + 1;
-        result = (char*)calloc(len,  sizeof(char));
-        is_memory_allocated(result);
-        sprintf(result, "%s%s%s", text_before_tag, tag_result, text_after_tag);
-        free(text_before_tag);
-        free(tag_result);
-        free(text_after_tag);
-        free(t_tag);
-        if (tag_content != tag_result) free(tag_content);
-        if (res != tag_content) free(res);
-        free(tag);
-        return result;
+//the table gets the rows in the order, other rows are dropped
+static void keep_table_rows(table* tbl, const uint32_t* order, uint32_t count)
+{
+    uint32_t cols = tbl->cols_count;
+    uint32_t* cells_in_row = calloc((uint64_t)count + 1, sizeof(uint32_t));
+    is_memory_allocated(cells_in_row);
+    uint64_t* cell_off = calloc((uint64_t)count * cols + 1, sizeof(uint64_t));
+    is_memory_allocated(cell_off);
+    uint32_t* cell_len = calloc((uint64_t)count * cols + 1, sizeof(uint32_t));
+    is_memory_allocated(cell_len);
+    for (uint32_t i = 0; i < count; i++) {
+        cells_in_row[i] = tbl->cells_in_row[order[i]];
+        for (uint32_t j = 0; j < cells_in_row[i]; j++) {
+            cell_off[(uint64_t)j * count + i] = tbl->cell_off[(uint64_t)j * tbl->rows_count + order[i]];
+            cell_len[(uint64_t)j * count + i] = tbl->cell_len[(uint64_t)j * tbl->rows_count + order[i]];
+        }
     }
-    free(tag);
-    return str;
+    free(tbl->cells_in_row);
+    free(tbl->cell_off);
+    free(tbl->cell_len);
+    tbl->cells_in_row = cells_in_row;
+    tbl->cell_off = cell_off;
+    tbl->cell_len = cell_len;
+    tbl->rows_count = count;
 }
 
-char* execute_all_tags(char* str)
+void arrange_table_rows(table* tbl, const table_options* opt)
 {
-    char* result = strdup(str);
-    is_memory_allocated(result);
-    char* tmp = NULL;
-    char* tag = get_tag(result);
-    while (tag != NULL) {
-        tmp = strdup(result);
-        free(result);
-        result = execute_nested_tags(tmp);
-        free(tmp);
-        free(tag);
-        tag = get_tag(result);
+    if (opt->filter_col == 0 && opt->sort == 0 && opt->top == 0) return;
+    uint32_t* order = calloc((uint64_t)tbl->rows_count + 1, sizeof(uint32_t));
+    is_memory_allocated(order);
+    uint32_t first = (opt->nh == 1 || tbl->rows_count == 0) ? 0 : 1;//rows before first stay in place
+    uint32_t count = first;
+    row_filter f = {0};
+    if (opt->filter_col > 0) {
+        column_total t = {0};
+        f.col = opt->filter_col - 1;
+        f.op = opt->filter_op;
+        f.value = opt->filter_value;
+        f.len = strlen(opt->filter_value);
+        f.is_number = get_cell_number(f.value, f.len, &f.number, &t);
     }
-    return result;
+    for (uint32_t i = first; i < tbl->rows_count; i++) {
+        if (opt->filter_col == 0 || is_row_kept(tbl, i, &f)) order[count++] = i;
+    }
+    uint32_t* rows = &order[first];
+    uint32_t rows_count = count - first;
+    uint32_t top = (opt->top > 0 && opt->top < rows_count) ? opt->top : rows_count;
+    if (opt->sort > 0 && rows_count > 1) {
+        sort_keys sk = {tbl, opt->sort - 1, opt->rsort, NULL, NULL};
+        get_sort_keys(&sk, rows, rows_count);
+        if (top < rows_count) select_top_rows(&sk, rows, rows_count, top);
+        else if (sk.keys != NULL) sort_rows_by_kind(&sk, rows, rows_count);
+        else merge_sort_rows(&sk, rows, rows_count);
+        free(sk.keys);
+        free(sk.kinds);
+    }
+    for (uint32_t i = 0; i < first; i++) order[i] = i;
+    keep_table_rows(tbl, order, first + top);
+    free(order);
 }
 
+//Column analysis: type of every column and the widths of the number parts
+//around the decimal point. The first (header) row doesn't change the type.
+static const char* column_type_names[] = {"empty", "integer", "decimal", "text", "mixed"};
 
+//kind of the cell: COLUMN_INTEGER, COLUMN_DECIMAL or COLUMN_TEXT
+static uint8_t get_cell_type(const char* text, uint32_t len, uint32_t* int_width, uint32_t* frac_width)
+{
+    if (!is_number_len(text, len)) return COLUMN_TEXT;
+    while (len > 0 && text[len - 1] == ' ') len--;
+    uint32_t sep = len;//the last '.' or ','
+    for (uint32_t i = len; i > 0; i--) {
+        if (text[i - 1] == '.' || text[i - 1] == ',') {
+            sep = i - 1;
+            break;
+        }
+    }
+    *int_width = sep;
+    *frac_width = len - sep;
+    return (sep < len) ? COLUMN_DECIMAL : COLUMN_INTEGER;
+}
 
-/***************************************************************************
-* functions for working with strings
-***************************************************************************/
-uint16_t get_elements_count(char sym, char* str)
+static void add_to_column_info(column_info* col, const char* text, uint32_t len, uint8_t header)
 {
-    uint16_t count = 0;
-    char* delims = calloc(3,  sizeof(char));
-    is_memory_allocated(delims);
-    sprintf(delims, "%c", sym);
-    char* temp_str = strdup(str);
-    char* token = strtok(temp_str, delims);
-    while (token != NULL) {
-        count++;
-        token = strtok(NULL, delims);
+    uint32_t int_width = 0;
+    uint32_t frac_width = 0;
+    uint8_t type = get_cell_type(text, len, &int_width, &frac_width);
+    if (type != COLUMN_TEXT) {
+        if (int_width > col->int_width) col->int_width = int_width;
+        if (frac_width > col->frac_width) col->frac_width = frac_width;
+    }
+    if (header) return;
+    if (col->type == COLUMN_EMPTY) {
+        col->type = type;
+    } else if (col->type != type) {
+        uint8_t numbers = (col->type == COLUMN_INTEGER || col->type == COLUMN_DECIMAL);
+        if (numbers && type != COLUMN_TEXT) col->type = COLUMN_DECIMAL;
+        else col->type = COLUMN_MIXED;
     }
-    free(delims);
-    free(temp_str);
-    return count;
 }
 
-char** split(char sym, char* str)
+void analyze_table_columns(const table* tbl, column_info* cols)
 {
-    char* delims = calloc(3, sizeof(char));
-    is_memory_allocated(delims);
-    sprintf(delims, "%c", sym);
-    uint16_t count = get_elements_count(sym, str);
-    char** elements = (char**)calloc(count, sizeof(char*));
-    is_memory_allocated(elements);
-    char* temp_str = strdup(str);
-    count = 0;
-    char* token = strtok(temp_str, delims);
-    while (token != NULL) {
-        elements[count] = strdup(token);
-        is_memory_allocated(elements[count]);
-        count++;
-        token = strtok(NULL, delims);
+    memset(cols, 0, tbl->cols_count * sizeof(column_info));
+    for (uint32_t j = 0; j < tbl->cols_count; j++) {
+        for (uint32_t i = 0; i < tbl->rows_count; i++) {
+            if (j >= tbl->cells_in_row[i]) continue;
+            uint64_t c = (uint64_t)j * tbl->rows_count + i;
+            add_to_column_info(&cols[j], &tbl->text.str[tbl->cell_off[c]], tbl->cell_len[c], i == 0);
+        }
     }
-    free(delims);
-    free(temp_str);
-    return elements;
 }
 
-char* get_str_from_sym(char sym, uint16_t count)
+void print_column_types(const column_info* cols, uint32_t cols_count)
 {
-    char* str = calloc(count + 1, sizeof(char));
-    is_memory_allocated(str);
-    char* symbol = calloc(2, sizeof(char));
-    is_memory_allocated(symbol);
-    sprintf(symbol, "%c", sym);
-    for (uint16_t i = 0; i < count; i++) {
-        strcat(str, symbol);
+    printf("  table columns:");
+    for (uint32_t j = 0; j < cols_count; j++) {
+        printf("%s %s", (j == 0) ? "" : ",", column_type_names[cols[j].type]);
     }
-    free(symbol);
-    return str;
+    printf("\n");
 }
 
-void change_symbols(char from, char to, char* str)
+//Appends the number to buf with spaces after it, so that decimal points of
+//the column are one under another when numbers are aligned to the right.
+//Returns 0 if the cell is not a number.
+static uint8_t append_aligned_number(str_buf* buf, const column_info* col, const char* text, uint32_t len)
 {
-    for (uint64_t i = 0; i < strlen(str); i++) {
-        if (str[i] == from) str[i] = to;
+    uint32_t int_width = 0;
+    uint32_t frac_width = 0;
+    if (get_cell_type(text, len, &int_width, &frac_width) == COLUMN_TEXT) return 0;
+    append_to_buf(buf, text, int_width + frac_width);
+    append_sym_to_buf(buf, ' ', col->frac_width - frac_width);
+    return 1;
+}
+
+void align_decimal_points(table* tbl, const column_info* cols)
+{
+    for (uint32_t j = 0; j < tbl->cols_count; j++) {
+        for (uint32_t i = 0; i < tbl->rows_count; i++) {
+            if (j >= tbl->cells_in_row[i]) continue;
+            uint64_t c = (uint64_t)j * tbl->rows_count + i;
+            uint64_t off = tbl->text.len;
+            //the cell is copied first, the buffer may be moved by append_to_buf()
+            char* text = strndup(&tbl->text.str[tbl->cell_off[c]], tbl->cell_len[c]);
+            is_memory_allocated(text);
+            if (append_aligned_number(&tbl->text, &cols[j], text, tbl->cell_len[c])) {
+                tbl->cell_off[c] = off;
+                tbl->cell_len[c] = tbl->text.len - off;
+            }
+            free(text);
+        }
     }
 }
 
-uint8_t is_num(char* str)
+//calculations, totals and alignment of the parsed table
+void process_table(table* tbl, const table_options* opt)
 {
-    uint8_t result = 0;
-    uint16_t len = strlen(str);
-    for (uint16_t i = 0; i < len; i++) {
-        if (isdigit(str[i]) || str[i] == '-' || str[i] == '.' || str[i] == ' ') {
-            result = 1;
-        } else return 0;
+    if (opt->nc == 0) calc_in_table(tbl, &opt->num);
+    if (opt->cs) print_calc_counters(tbl->calculated);
+    arrange_table_rows(tbl, opt);
+    add_table_totals(tbl, opt);
+    uint8_t dp = (opt->dp == 1 && opt->na == 0 && opt->nb == 0);
+    if (dp || opt->cs) {
+        column_info* cols = calloc(tbl->cols_count + 1, sizeof(column_info));
+        is_memory_allocated(cols);
+        analyze_table_columns(tbl, cols);
+        if (opt->cs) print_column_types(cols, tbl->cols_count);
+        if (dp) align_decimal_points(tbl, cols);
+        free(cols);
     }
-    return result;
 }
 
-uint8_t is_number(char* str)
+void init_table_layout(table_layout* lt, uint32_t cols_count, const table_options* opt)
 {
-    uint8_t result = 0;
-    uint16_t len = strlen(str);
-    for (uint16_t i = 0; i < len; i++) {
-        if (isdigit(str[i]) || str[i] == '-' || str[i] == '.' || str[i] == ',' || str[i] == ' ') {
-            result = 1;
-        } else return 0;
+    lt->cols_count = cols_count;
+    lt->width = calloc(get_width_index(cols_count + 1, 0) + 1, sizeof(uint32_t));
+    is_memory_allocated(lt->width);
+    lt->row_len = 0;
+    lt->nb = opt->nb;
+    lt->na = (opt->nb == 1) ? 1 : opt->na;
+    lt->doc_width = opt->doc_width;
+}
+
+void free_table_layout(table_layout* lt)
+{
+    free(lt->width);
+    lt->width = NULL;
+}
+
+void measure_table_cell(table_layout* lt, uint32_t cells, uint32_t column, uint32_t len)
+{
+    if (cells > lt->cols_count) {
+        //rows are measured one by one, so the table can turn out wider than expected
+        uint64_t old_size = get_width_index(lt->cols_count + 1, 0) + 1;
+        uint64_t new_size = get_width_index(cells + 1, 0) + 1;
+        lt->width = realloc(lt->width, new_size * sizeof(uint32_t));
+        is_memory_allocated(lt->width);
+        memset(&lt->width[old_size], 0, (new_size - old_size) * sizeof(uint32_t));
+        lt->cols_count = cells;
     }
-    return result;
+    uint32_t* width = &lt->width[get_width_index(cells, column)];
+    if (*width < len) *width = len;
 }
 
-uint16_t get_number_len(uint16_t number)
+static int compare_widths(const void* a, const void* b)
 {
-    char* num_str = calloc(20, sizeof(char));
-    is_memory_allocated(num_str);
-    sprintf(num_str, "%d", number);
-    uint16_t len = strlen(num_str);
-    free(num_str);
-    return len;
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
 }
 
-char* rm_spaces_from_str(char* str)
+static void distribute_padding(uint32_t* width, uint32_t cells, uint32_t padding, uint32_t* sorted)
 {
-    char sym = ' ';
-    char* result = calloc(strlen(str) + 2, sizeof(char));
-    is_memory_allocated(result);
-    uint64_t res_i = 0;
-    for (uint64_t i = 0; i < strlen(str); i++) {
-        if (str[i] != sym) {
-            result[res_i] = str[i];
-            res_i++;
+    //Spaces are added one by one to the narrowest cell (the last one of equal
+    //cells). That raises the narrowest cells to a common level, and the rest
+    //goes to the last cells of that level.
+    memcpy(sorted, width, cells * sizeof(uint32_t));
+    qsort(sorted, cells, sizeof(uint32_t), compare_widths);
+    uint64_t sum = 0;
+    uint64_t level = 0;
+    uint32_t k = 0;
+    while (k < cells) {
+        sum += sorted[k];
+        k++;
+        level = (padding + sum) / k;
+        if (k == cells || level < sorted[k]) break;
+    }
+    uint64_t rest = padding + sum - level * k;
+    for (uint32_t j = cells; j > 0; j--) {
+        if (width[j - 1] > level) continue;
+        width[j - 1] = level;
+        if (rest > 0) {
+            width[j - 1]++;
+            rest--;
         }
     }
-    result[res_i + 1] = '\0';
-    free(str);
-    return result;
 }
 
-char* rm_spaces_start_end(char* str)
+void finish_table_layout(table_layout* lt)
 {
-    uint64_t start = 0;
-    uint64_t end = 0;
-    for (uint64_t i = 0; i < strlen(str); i++) {
-        if (str[i] != ' ') {
-            start = i;
-            break;
-        }
+    uint32_t max_row_len = 0;
+    for (uint32_t n = 1; n <= lt->cols_count; n++) {
+        uint32_t row_len = n - 1;
+        for (uint32_t j = 0; j < n; j++) row_len += lt->width[get_width_index(n, j)];
+        if (row_len > max_row_len) max_row_len = row_len;
     }
-    for (uint64_t i = strlen(str) - 1; i >= 0; i--) {
-        if (str[i] != ' ') {
-            end = i;
-            break;
+    if (max_row_len < (uint32_t)lt->doc_width - 2) max_row_len = lt->doc_width - 2;
+
+    uint32_t* sorted = calloc(lt->cols_count + 1, sizeof(uint32_t));
+    is_memory_allocated(sorted);
+    for (uint32_t n = 1; n <= lt->cols_count; n++) {
+        uint32_t* width = &lt->width[get_width_index(n, 0)];
+        uint32_t row_len = n - 1;
+        for (uint32_t j = 0; j < n; j++) row_len += width[j];
+        distribute_padding(width, n, max_row_len - row_len, sorted);
+    }
+    free(sorted);
+    lt->row_len = (lt->nb == 0) ? max_row_len + 2 : max_row_len + 1;
+}
+
+//Numbers aligned at the decimal point are as wide as their part before the point
+//(kept + 1 in numbers, 0 - no numbers) and the widest decimal part of the column.
+static void add_number_widths(table_layout* lt, const table_layout* numbers, const column_info* cols)
+{
+    for (uint32_t n = 1; n <= numbers->cols_count; n++) {
+        for (uint32_t j = 0; j < n; j++) {
+            uint32_t width = numbers->width[get_width_index(n, j)];
+            if (width > 0) measure_table_cell(lt, n, j, width - 1 + cols[j].frac_width);
         }
     }
-    end += 1;
-    char* result = calloc(end - start + 2, sizeof(char));
-    is_memory_allocated(result);
-    memcpy(result, &str[start], end-start);
-    result[end-start] = '\0';
-    free(str);
-    return result;
 }
 
+void append_table_row(str_buf* buf, const table_layout* lt, uint32_t cells, const char** text,
+                      const uint32_t* len, const uint8_t* right)
+{
+    const uint32_t* width = &lt->width[get_width_index(cells, 0)];
+    if (lt->nb == 0) append_to_buf(buf, "|", 1);
+    for (uint32_t j = 0; j < cells; j++) {
+        if (right[j] == 1) append_sym_to_buf(buf, ' ', width[j] - len[j]);
+        append_to_buf(buf, text[j], len[j]);
+        if (right[j] == 0) append_sym_to_buf(buf, ' ', width[j] - len[j]);
+        append_to_buf(buf, (lt->nb == 0) ? "|" : " ", 1);
+    }
+    append_to_buf(buf, "\n", 1);
+}
 
-/***************************************************************************
-* functions for Text Formatting
-***************************************************************************/
-void set_doc_width(uint8_t width)
+void append_table_border(str_buf* buf, const table_layout* lt, uint32_t cells1, uint32_t cells2)
 {
-    if (width < 10) {
-        printf("  Error: Document width cannot be less than 10 characters\n");
-        DOC_WIDTH = 10;
-    } else if (width > 200) {
-        printf("  Error: Document width cannot be more than 250 characters\n");
-        DOC_WIDTH = 250;
-    } else {
-        DOC_WIDTH = width;
+    //'+' under the column separators of both rows
+    uint64_t start = buf->len;
+    append_sym_to_buf(buf, '-', lt->row_len);
+    uint32_t cells[2] = {cells1, cells2};
+    for (uint8_t k = 0; k < 2; k++) {
+        if (cells[k] == 0) continue;
+        const uint32_t* width = &lt->width[get_width_index(cells[k], 0)];
+        uint64_t pos = start;
+        buf->str[pos] = '+';
+        for (uint32_t j = 0; j < cells[k]; j++) {
+            pos += width[j] + 1;
+            buf->str[pos] = '+';
+        }
     }
 }
 
+//Rows go through the writer one by one. It adds the borders, repeats the header
+//row on every page and, when writing to a file or to dest, keeps only one row
+//in memory.
+typedef struct table_writer {
+    const table_layout* lt;
+    str_buf  out;
+    FILE*    file;         //NULL to keep the whole table in out
+    char*    dest;         //place of the next row in the rendered table or NULL
+    uint64_t rows_count;   //with the repeated header rows
+    uint64_t row;
+    uint32_t prev_cells;
+    uint32_t page;
+    uint32_t page_rows;
+    str_buf  header;       //rendered header row
+    uint32_t header_cells;
+} table_writer;
 
-/***************************************************************************
-* functions for working with arrays
-***************************************************************************/
-uint16_t get_arr_size(char** str_arr)
+//number of rows with the repeated header rows
+static uint64_t get_written_rows_count(uint32_t rows_count, uint32_t page)
 {
-    uint16_t count = 0;
-    while (str_arr[count] != NULL) count++;
-    return count;
+    return (page > 0 && rows_count > 2) ? rows_count + (rows_count - 2) / page : rows_count;
 }
 
-uint8_t in_str_array(char** arr, char* value)
+static void init_table_writer(table_writer* tw, const table_layout* lt, uint32_t rows_count,
+                              uint32_t page, FILE* file)
 {
-    if (arr == NULL) return 0;
-    uint16_t arr_size = get_arr_size(arr);
-    for (uint16_t i = 0; i < arr_size; i++) {
-        if (strcmp(arr[i], value) == 0) return 1;
+    memset(tw, 0, sizeof(table_writer));
+    tw->lt = lt;
+    tw->file = file;
+    tw->page = page;
+    tw->rows_count = get_written_rows_count(rows_count, page);
+}
+
+static void flush_table_writer(table_writer* tw)
+{
+    if (tw->out.len == 0) return;
+    if (tw->file != NULL) {
+        replace_service_symbols(tw->out.str, tw->out.len);
+        fwrite(tw->out.str, 1, tw->out.len, tw->file);
+    } else if (tw->dest != NULL) {
+        memcpy(tw->dest, tw->out.str, tw->out.len);
+        tw->dest += tw->out.len;
+    } else {
+        return;
     }
-    return 0;
+    tw->out.len = 0;
 }
 
-uint32_t get_max_len(char** str_arr, uint32_t arr_size)
+static void begin_table_row(table_writer* tw, uint32_t cells)
 {
-    uint32_t max_len = strlen(str_arr[0]);
-    for (uint32_t i = 0; i < arr_size; i++) {
-        if (max_len < strlen(str_arr[i])) max_len = strlen(str_arr[i]);
+    if (tw->lt->nb == 0) {
+        //the border before the last row is taken from the last row only
+        uint32_t prev = (tw->row == 0 || tw->row == tw->rows_count - 1) ? 0 : tw->prev_cells;
+        append_table_border(&tw->out, tw->lt, prev, cells);
+        append_to_buf(&tw->out, "\n", 1);
     }
-    return max_len;
+    tw->prev_cells = cells;
+    tw->row++;
+}
+
+static void add_table_row(table_writer* tw, uint32_t cells, const char** text, const uint32_t* len,
+                          const uint8_t* right)
+{
+    if (tw->page > 0 && tw->page_rows == tw->page) {
+        begin_table_row(tw, tw->header_cells);
+        append_to_buf(&tw->out, tw->header.str, tw->header.len);
+        tw->page_rows = 0;
+    }
+    begin_table_row(tw, cells);
+    uint64_t start = tw->out.len;
+    append_table_row(&tw->out, tw->lt, cells, text, len, right);
+    if (tw->row == 1) {
+        if (tw->page > 0) append_to_buf(&tw->header, &tw->out.str[start], tw->out.len - start);
+        tw->header_cells = cells;
+    } else {
+        tw->page_rows++;
+    }
+    flush_table_writer(tw);
+}
+
+static void finish_table_writer(table_writer* tw)
+{
+    if (tw->lt->nb == 0 && tw->row > 0) append_table_border(&tw->out, tw->lt, tw->prev_cells, 0);
+    flush_table_writer(tw);
+    free(tw->header.str);
 }
 
-uint16_t get_max(const uint16_t* arr, uint16_t size)
+//fills the cell arrays of row i for append_table_row(), returns the number of cells
+static uint32_t get_table_row(const table* tbl, const table_layout* lt, uint32_t i, const char** text,
+                              uint32_t* len, uint8_t* right)
 {
-    uint16_t max = arr[0];
-    for (uint16_t i = 1; i < size; i++) {
-        if (max < arr[i]) max = arr[i];
+    uint32_t cells = tbl->cells_in_row[i];
+    for (uint32_t j = 0; j < cells; j++) {
+        uint64_t c = (uint64_t)j * tbl->rows_count + i;
+        text[j] = &tbl->text.str[tbl->cell_off[c]];
+        len[j] = tbl->cell_len[c];
+        right[j] = (lt->na == 0 && is_number_len(text[j], len[j]));//numbers are aligned to the right
     }
-    return max;
+    return cells;
 }
 
-uint16_t get_min(const uint16_t* arr, uint16_t size)
+//the writer starts at row i as if the rows before it were written
+static void seek_table_writer(table_writer* tw, const table* tbl, uint32_t i, const char** text,
+                              uint32_t* len, uint8_t* right)
 {
-    uint16_t min = arr[0];
-    for (uint16_t i = 1; i < size; i++) {
-        if (min > arr[i]) min = arr[i];
+    if (i == 0) return;
+    tw->row = i;
+    if (tw->page > 0 && i >= 2) {
+        tw->row += (i - 2) / tw->page;
+        tw->page_rows = (i - 2) % tw->page + 1;
     }
-    return min;
+    tw->prev_cells = tbl->cells_in_row[i - 1];
+    tw->header_cells = get_table_row(tbl, tw->lt, 0, text, len, right);
+    if (tw->page > 0) append_table_row(&tw->header, tw->lt, tw->header_cells, text, len, right);
 }
 
-int32_t get_index(const uint16_t* arr, uint16_t size, uint16_t value)
+typedef struct render_job {
+    const table*  tbl;
+    table_layout* lt;    //layouts of the blocks when measuring, the table layout when formatting
+    uint32_t      page;
+    char*         result;
+} render_job;
+
+static void measure_table_rows(void* arg, uint32_t block, uint64_t start, uint64_t end)
 {
-    int32_t index = -1;
-    for (uint16_t i = 0; i < size; i++) {
-        if (value == arr[i]) index = i;
+    render_job* job = arg;
+    const table* tbl = job->tbl;
+    for (uint32_t i = start; i < end; i++) {
+        for (uint32_t j = 0; j < tbl->cells_in_row[i]; j++) {
+            measure_table_cell(&job->lt[block], tbl->cells_in_row[i], j, tbl->cell_len[(uint64_t)j * tbl->rows_count + i]);
+        }
     }
-    return index;
 }
 
-uint16_t get_min_index(const uint16_t* arr, uint16_t size)
+//the widths are the max widths of both layouts
+static void merge_table_layouts(table_layout* lt, const table_layout* block_lt)
 {
-    uint16_t min = get_min(arr, size);
-    uint16_t index = get_index(arr, size, min);
-    return index;
+    if (block_lt->cols_count > lt->cols_count) measure_table_cell(lt, block_lt->cols_count, 0, 0);
+    uint64_t size = get_width_index(block_lt->cols_count + 1, 0);
+    for (uint64_t k = 0; k < size; k++) {
+        if (lt->width[k] < block_lt->width[k]) lt->width[k] = block_lt->width[k];
+    }
 }
 
+static void format_table_rows(void* arg, uint32_t block, uint64_t start, uint64_t end)
+{
+    (void)block;
+    render_job* job = arg;
+    const table* tbl = job->tbl;
+    const char** text = calloc(tbl->cols_count + 1, sizeof(char*));
+    is_memory_allocated(text);
+    uint32_t* len = calloc(tbl->cols_count + 1, sizeof(uint32_t));
+    is_memory_allocated(len);
+    uint8_t* right = calloc(tbl->cols_count + 1, sizeof(uint8_t));
+    is_memory_allocated(right);
 
-/***************************************************************************
-* Basic functions for some tags
-***************************************************************************/
-char* get_aligned_text(char* str, char** attrs)
+    table_writer tw;
+    init_table_writer(&tw, job->lt, tbl->rows_count, job->page, NULL);
+    seek_table_writer(&tw, tbl, start, text, len, right);
+    //all lines of the table have the same length, so the place of every row is known
+    uint64_t row_size = (uint64_t)(job->lt->nb == 0 ? 2 : 1) * (job->lt->row_len + 1);
+    tw.dest = &job->result[tw.row * row_size];
+    for (uint32_t i = start; i < end; i++) {
+        uint32_t cells = get_table_row(tbl, job->lt, i, text, len, right);
+        add_table_row(&tw, cells, text, len, right);
+    }
+    if (end == tbl->rows_count) finish_table_writer(&tw);//the bottom border
+    else free(tw.header.str);
+    free(tw.out.str);
+    free(text);
+    free(len);
+    free(right);
+}
+
+char* render_table(table* tbl, const table_options* opt)
 {
-    char** lines = split('\n', str);
-    uint32_t lines_count = get_elements_count('\n', str);
-    uint32_t max_line = get_max_len(lines, lines_count);
-    uint32_t len = (max_line > DOC_WIDTH) ? max_line : DOC_WIDTH;
-    len = (len + 1) * lines_count;
-    char* aligned = calloc(len, sizeof(char));
-    is_memory_allocated(aligned);
-    for (uint32_t i = 0; i < lines_count; i++) {
-        uint16_t spaces = (strlen(lines[i]) > DOC_WIDTH) ? 0 : DOC_WIDTH - strlen(lines[i]);
-        if (attrs == NULL) spaces /= 2;
-        char* al = get_str_from_sym(' ', spaces);
-        strcat(aligned, al);
-        free(al);
-        strcat(aligned, lines[i]);
-        spaces = DOC_WIDTH - strlen(lines[i]) - spaces;
-        al = get_str_from_sym(' ', spaces);
-        strcat(aligned, al);
-        free(lines[i]);
-        free(al);
-        if (i < lines_count - 1) strcat(aligned, "\n");
+    uint32_t blocks = get_table_blocks_count(tbl);
+    table_layout* block_lt = calloc(blocks, sizeof(table_layout));
+    is_memory_allocated(block_lt);
+    for (uint32_t b = 0; b < blocks; b++) init_table_layout(&block_lt[b], tbl->cols_count, opt);
+    render_job job = {tbl, block_lt, opt->page, NULL};
+    run_in_blocks(tbl->rows_count, blocks, measure_table_rows, &job);
+    table_layout lt = block_lt[0];
+    for (uint32_t b = 1; b < blocks; b++) {
+        merge_table_layouts(&lt, &block_lt[b]);
+        free_table_layout(&block_lt[b]);
     }
-    free(lines);
-    return aligned;
+    free(block_lt);
+    finish_table_layout(&lt);
+
+    uint64_t rows = get_written_rows_count(tbl->rows_count, opt->page);
+    uint64_t size = rows * (lt.row_len + 1);
+    if (lt.nb == 0 && rows > 0) size += size + lt.row_len;//borders, no '\n' after the last one
+    job.result = malloc(size + 1);
+    is_memory_allocated(job.result);
+    job.result[size] = '\0';
+    job.lt = &lt;
+    run_in_blocks(tbl->rows_count, blocks, format_table_rows, &job);
+    free_table_layout(&lt);
+    return job.result;
 }
 
-char* header(char* str, uint8_t header_type, char** attrs)
+//calculates the cells of the row, the values are put into the values buffer
+static void calc_table_row(table_row* row, str_buf* values, uint64_t* counters, const number_format* fmt)
 {
-    char sep_sym = '\0';
-    if (attrs != NULL) {
-        if (attrs[0] != NULL) {
-            sep_sym = attrs[0][0];
+    values->len = 0;
+    for (uint32_t j = 0; j < row->cells; j++) {
+        uint64_t off = values->len;
+        if (calc_table_cell(&row->base[row->off[j]], row->len[j], values, counters, fmt)) {
+            row->off[j] = off;
+            row->len[j] = values->len - off;
+            row->calculated[j] = 1;
         }
     }
-    if (header_type == 1 && sep_sym == '\0') sep_sym = '=';
-    uint8_t doc_width_bak = DOC_WIDTH;
-    if (DOC_WIDTH < strlen(str)) set_doc_width(strlen(str) + 4);
-    char* header = NULL;
-    uint16_t len = DOC_WIDTH + 1;
-    if (header_type == 1) {
-        char* centered_str = center(str, NULL);
-        len = DOC_WIDTH * 2 + strlen(centered_str) + 3;
-        header = calloc(len, sizeof(char));
-        is_memory_allocated(header);
-        char* tmp = get_str_from_sym(sep_sym, DOC_WIDTH);
-        sprintf(header, "%s\n%s\n%s", tmp, centered_str, tmp);
-        free(tmp);
-        free(centered_str);
-    } else {
-        header = calloc(len, sizeof(char));
-        is_memory_allocated(header);
-        if (sep_sym == '\0') sep_sym = (header_type == 2) ? '=' : '-';
-        char* tmp = get_str_from_sym(sep_sym, (DOC_WIDTH-strlen(str) - 1) / 2);
-        sprintf(header, "%s %s ", tmp, str);
-        free(tmp);
-        tmp = get_str_from_sym(sep_sym, DOC_WIDTH - strlen(header));
-        strcat(header, tmp);
-        free(tmp);
-    }
-    set_doc_width(doc_width_bak);
-    return header;
 }
 
-/***************************************************************************
-* functions for working with tables
-***************************************************************************/
-uint16_t get_rows_count(char* tbl_str)
+//calculated rows are kept in a temporary file between the two passes
+static void save_row_values(FILE* tmp, const table_row* row, const str_buf* values)
 {
-    return get_elements_count('\n', tbl_str);
+    fwrite(&values->len, sizeof(uint64_t), 1, tmp);
+    fwrite(values->str, 1, values->len, tmp);
+    fwrite(row->calculated, sizeof(uint8_t), row->cells, tmp);
+    fwrite(row->off, sizeof(uint64_t), row->cells, tmp);
+    fwrite(row->len, sizeof(uint32_t), row->cells, tmp);
 }
 
-uint16_t* get_cells_count(char* tbl_str)
+static uint8_t load_row_values(FILE* tmp, table_row* row, str_buf* values)
 {
-    uint16_t  rows_count   = get_rows_count(tbl_str);
-    uint16_t* cells_in_row = calloc(rows_count, sizeof(uint16_t));
-    is_memory_allocated(cells_in_row);
-    char** rows = split('\n', tbl_str);
-    for (uint16_t i = 0; i < rows_count; i++) {
-        cells_in_row[i] = get_elements_count('|', rows[i]);
-        free(rows[i]);
-    }
-    free(rows);
-    return cells_in_row;
+    uint64_t len = 0;
+    if (fread(&len, sizeof(uint64_t), 1, tmp) != 1) return 0;
+    values->len = 0;
+    append_sym_to_buf(values, ' ', len);
+    return fread(values->str, 1, len, tmp) == len &&
+           fread(row->calculated, sizeof(uint8_t), row->cells, tmp) == row->cells &&
+           fread(row->off, sizeof(uint64_t), row->cells, tmp) == row->cells &&
+           fread(row->len, sizeof(uint32_t), row->cells, tmp) == row->cells;
 }
 
-char*** get_table_data(char* tbl_str)
+static void set_row_text(table_row* row, const table_layout* lt, const str_buf* values)
 {
-    uint16_t  rows_count   = get_rows_count(tbl_str);
-    char**    rows         = split('\n', tbl_str);
-    char***   table_data   = (char***)calloc(rows_count, sizeof(char**));
-    is_memory_allocated(table_data);
-    for (uint16_t i = 0; i < rows_count; i++) {
-        table_data[i] = split('|', rows[i]);
-        free(rows[i]);
+    for (uint32_t j = 0; j < row->cells; j++) {
+        row->text[j] = (row->calculated[j] == 1) ? &values->str[row->off[j]] : &row->base[row->off[j]];
+        row->right[j] = (lt->na == 0 && is_number_len(row->text[j], row->len[j]));
     }
-    free(rows);
-    return table_data;
 }
 
-uint16_t* get_cells_len(char** row, uint16_t cells_count)
+//Renders the table in two passes over its text: the first one measures the
+//cells, the second one writes the rows to the file. Only one row is in memory.
+//formulas may refer to any cell, so such tables are rendered in memory
+static uint8_t write_table_with_formulas(FILE* file, char* tbl_str, const table_options* opt)
 {
-    uint16_t* cells_len = calloc(cells_count, sizeof(uint16_t));
-    is_memory_allocated(cells_len);
-    for (uint16_t i = 0; i < cells_count; i++) {
-        cells_len[i] = strlen(row[i]);
-    }
-    return cells_len;
+    table tbl;
+    read_table(tbl_str, opt, &tbl);
+    process_table(&tbl, opt);
+    char* result = render_table(&tbl, opt);
+    uint64_t len = strlen(result);
+    replace_service_symbols(result, len);
+    fwrite(result, 1, len, file);
+    free(result);
+    free_table(&tbl);
+    return ferror(file) == 0;
 }
 
-uint16_t* get_rows_len(char*** table_data, uint16_t rows_count, const uint16_t* cells_in_row)
+static uint8_t have_formulas(const table_row* row)
 {
-    uint16_t* rows_len = calloc(rows_count, sizeof(uint16_t));
-    is_memory_allocated(rows_len);
-    for (uint16_t i = 0; i < rows_count; i++) {
-        uint16_t row_len = 0;
-        for (uint16_t j = 0; j < cells_in_row[i]; j++) {
-            row_len += strlen(table_data[i][j]);
-        }
-        rows_len[i] = row_len + cells_in_row[i] - 1;
+    for (uint32_t j = 0; j < row->cells; j++) {
+        if (is_table_formula(&row->base[row->off[j]], row->len[j])) return 1;
     }
-    return rows_len;
+    return 0;
 }
 
-char* get_table_border(const char* row1, const char* row2)
+//state of the streaming renderer between the passes
+typedef struct table_stream {
+    const table_options* opt;
+    table_layout  lt;
+    table_layout  numbers;   //widths of numbers before the decimal point for dp
+    uint8_t       dp;
+    uint32_t      cols_count;//size of totals and cols
+    column_total* totals;
+    column_info*  cols;
+    str_buf       aligned;   //numbers of the row aligned at the decimal point
+    uint64_t      counters[3];
+} table_stream;
+
+static void grow_stream_columns(table_stream* ts, uint32_t cells)
 {
-    uint16_t row_len = strlen(row1);
-    char* border = calloc(row_len + 1, sizeof(char));
-    is_memory_allocated(border);
-    for (uint16_t i = 0; i < row_len; i++) {
-        if (row1[i] == '|' || row2[i] == '|') {
-            strcat(border, "+");
-        } else {
-            strcat(border, "-");
-        }
-    }
-    return border;
-}
-
-char* add_table_border(char* table_str)
-{
-    char**   rows = split('\n', table_str);
-    uint16_t rows_count = get_rows_count(table_str);
-    uint16_t row_len = strlen(rows[0]);
-    uint32_t len = (rows_count * 2 + 1) * (row_len + 1);
-    char*    table = calloc(len, sizeof(char));
-    is_memory_allocated(table);
-    char* space_str = get_str_from_sym(' ', row_len);
-    for (uint16_t i = 0; i < rows_count; i++) {
-        char* row1;
-        char* row2;
-        if (i == 0) {
-            row1 = space_str;
-            row2 = rows[i];
-        } else if (i == rows_count - 1) {
-            row1 = rows[i];
-            row2 = space_str;
-        } else {
-            row1 = rows[i - 1];
-            row2 = rows[i];
-        }
-        char* border = get_table_border(row1, row2);
-        strcat(table, border);
-        strcat(table, "\n");
-        strcat(table, rows[i]);
-        if (i != rows_count - 1) {
-            free(border);
-            strcat(table, "\n");
+    if (cells <= ts->cols_count) return;
+    ts->totals = realloc(ts->totals, cells * sizeof(column_total));
+    is_memory_allocated(ts->totals);
+    memset(&ts->totals[ts->cols_count], 0, (cells - ts->cols_count) * sizeof(column_total));
+    ts->cols = realloc(ts->cols, cells * sizeof(column_info));
+    is_memory_allocated(ts->cols);
+    memset(&ts->cols[ts->cols_count], 0, (cells - ts->cols_count) * sizeof(column_info));
+    ts->cols_count = cells;
+}
+
+//first pass: totals, column analysis and widths of the row,
+//the header row is not in the totals
+static void measure_stream_row(table_stream* ts, table_row* row, const str_buf* values, uint8_t header,
+                               uint8_t footer)
+{
+    const table_options* opt = ts->opt;
+    grow_stream_columns(ts, row->cells);
+    set_row_text(row, &ts->lt, values);
+    for (uint32_t j = 0; j < row->cells; j++) {
+        double value;
+        if (opt->totals != 0 && header == 0 && footer == 0 && get_cell_number(row->text[j], row->len[j], &value, &ts->totals[j])) {
+            add_to_total(&ts->totals[j], &value, 1);
+        }
+        uint32_t int_width = 0;
+        uint32_t frac_width = 0;
+        add_to_column_info(&ts->cols[j], row->text[j], row->len[j], header);
+        if (ts->dp && get_cell_type(row->text[j], row->len[j], &int_width, &frac_width) != COLUMN_TEXT) {
+            measure_table_cell(&ts->numbers, row->cells, j, int_width + 1);
         } else {
-            strcat(table, "\n");
-            strcat(table, border);
-            free(border);
+            measure_table_cell(&ts->lt, row->cells, j, row->len[j]);
         }
     }
-    //Cleaning
-    for (uint16_t i = 0; i < rows_count; i++) {
-        free(rows[i]);
-    }
-    free(rows);
-    free(space_str);
-
-    return table;
 }
 
-void calc_in_table(char*** table_data, uint16_t rows_count, const uint16_t* cells_in_row)
+//second pass: the row goes to the writer
+static void write_stream_row(table_stream* ts, table_writer* tw, table_row* row, const str_buf* values)
 {
-    char* calc_res = NULL;
-    for (uint16_t i = 0; i < rows_count; i++) {
-        for (uint16_t j = 0; j < cells_in_row[i]; j++) {
-            char* tmp = calloc(strlen(table_data[i][j]) + 1, sizeof(char));
-            strcpy(tmp, table_data[i][j]);
-            change_symbols(',', '.', tmp);
-
-            calc_res = calc(tmp, NULL);
-            if (strcmp(calc_res, "error") != 0) {
-                free(table_data[i][j]);
-                table_data[i][j] = strdup(calc_res);
+    set_row_text(row, &ts->lt, values);
+    if (ts->dp) {
+        ts->aligned.len = 0;
+        for (uint32_t j = 0; j < row->cells; j++) {
+            uint64_t off = ts->aligned.len;
+            if (append_aligned_number(&ts->aligned, &ts->cols[j], row->text[j], row->len[j])) {
+                row->off[j] = off;
+                row->len[j] = ts->aligned.len - off;
+                row->right[j] = 2;//the text is in the aligned buffer
+            }
+        }
+        for (uint32_t j = 0; j < row->cells; j++) {
+            if (row->right[j] == 2) {
+                row->text[j] = &ts->aligned.str[row->off[j]];
+                row->right[j] = 1;
             }
-            free(calc_res);
-            free(tmp);
         }
     }
+    add_table_row(tw, row->cells, row->text, row->len, row->right);
 }
 
-uint16_t** get_column_width(char*** table_data, uint16_t rows_count, uint16_t* cells_in_row)
+uint8_t write_table_stream(FILE* file, char* tbl_str, const table_options* opt)
 {
-    uint16_t max_cells = get_max(cells_in_row, rows_count);
-    //Memory allocation
-    uint16_t** column_width = calloc(max_cells, sizeof(uint16_t*));
-    is_memory_allocated(column_width);
-    for (uint16_t i = 0; i < max_cells; i++) {
-        column_width[i] = calloc(i + 1, sizeof(uint16_t));
-        is_memory_allocated(column_width[i]);
+    table_source src;
+    open_table_source(&src, tbl_str, opt);
+    table_row row = {0};
+    str_buf values = {NULL, 0, 0};
+    table_stream ts;
+    memset(&ts, 0, sizeof(table_stream));
+    ts.opt = opt;
+    init_table_layout(&ts.lt, 0, opt);
+    init_table_layout(&ts.numbers, 0, opt);
+    ts.dp = (opt->dp == 1 && ts.lt.na == 0);
+    FILE* tmp = (opt->nc == 0) ? tmpfile() : NULL;
+    uint64_t recalculated[3] = {0, 0, 0};
+
+    uint32_t rows_count = 0;
+    uint8_t formulas = 0;
+    while (formulas == 0 && read_source_row(&src, &row)) {
+        formulas = (opt->nc == 0 && have_formulas(&row));
+        values.len = 0;
+        if (opt->nc == 0) calc_table_row(&row, &values, ts.counters, &opt->num);
+        if (tmp != NULL) save_row_values(tmp, &row, &values);
+        measure_stream_row(&ts, &row, &values, (rows_count == 0 && !opt->nh), 0);
+        rows_count++;
     }
 
-    for (uint16_t i = 0; i < rows_count; i++) {
-        for (uint16_t j = 0; j < cells_in_row[i]; j++) {
-            if (strlen(table_data[i][j]) > column_width[cells_in_row[i] - 1][j]) {
-                column_width[cells_in_row[i] - 1][j] = strlen(table_data[i][j]);
+    //footers are measured with the rows and written after them
+    str_buf footer_text = {NULL, 0, 0};
+    uint64_t* footer_off = calloc(4 * (uint64_t)ts.cols_count + 1, sizeof(uint64_t));
+    is_memory_allocated(footer_off);
+    uint32_t* footer_len = calloc(4 * (uint64_t)ts.cols_count + 1, sizeof(uint32_t));
+    is_memory_allocated(footer_len);
+    uint8_t footers = 0;
+    if (formulas == 0 && opt->totals != 0 && ts.cols_count > 0) {
+        footers = make_table_footers(ts.totals, ts.cols_count, opt->totals, &opt->num,
+                                     &footer_text, footer_off, footer_len);
+        str_buf no_values = {NULL, 0, 0};
+        for (uint8_t k = 0; k < footers; k++) {
+            row.cells = 0;
+            for (uint32_t j = 0; j < ts.cols_count; j++) {
+                add_cell_to_row(&row, footer_off[k * ts.cols_count + j], footer_len[k * ts.cols_count + j]);
             }
+            row.base = footer_text.str;
+            measure_stream_row(&ts, &row, &no_values, 0, 1);
         }
+        rows_count += footers;
     }
-    return column_width;
-}
+    if (ts.dp) add_number_widths(&ts.lt, &ts.numbers, ts.cols);
+    finish_table_layout(&ts.lt);
 
-void align_to_columns(char*** table_data, uint16_t rows_count, uint16_t* cells_in_row, uint8_t na)
-{
-    uint16_t** column_width = get_column_width(table_data, rows_count, cells_in_row);
-    char* align = NULL;
-    char* tmp = NULL;
-    for (uint16_t i = 0; i < rows_count; i++) {
-        for (uint16_t j = 0; j < cells_in_row[i]; j++) {
-            uint16_t al_len = column_width[cells_in_row[i] - 1][j] - strlen(table_data[i][j]);
-            if (al_len > 0) {
-                align = get_str_from_sym(' ', al_len);
-                tmp = strdup(table_data[i][j]);
-                free(table_data[i][j]);
-                table_data[i][j] = calloc(al_len + strlen(tmp) + 1, sizeof(char));
-                if (is_number(tmp) && na == 0) {
-                    sprintf(table_data[i][j], "%s%s", align, tmp);
-                } else {
-                    sprintf(table_data[i][j], "%s%s", tmp, align);
-                }
-                free(tmp);
-                free(align);
+    uint8_t ok = 1;
+    if (formulas == 1) {
+        ok = write_table_with_formulas(file, tbl_str, opt);
+    } else {
+        table_writer tw;
+        init_table_writer(&tw, &ts.lt, rows_count, opt->page, file);
+        if (tmp != NULL) rewind(tmp);
+        rewind_table_source(&src);
+        uint64_t row_start = 0;
+        while (read_source_row(&src, &row)) {
+            uint8_t loaded = (tmp != NULL && load_row_values(tmp, &row, &values));
+            if (tmp != NULL && loaded == 0) {
+                //the temporary file is broken, the rest is calculated again
+                fclose(tmp);
+                tmp = NULL;
+                src.pos = row_start;
+                src.rows--;
+                read_source_row(&src, &row);
             }
+            if (loaded == 0) {
+                values.len = 0;
+                if (opt->nc == 0) calc_table_row(&row, &values, recalculated, &opt->num);
+            }
+            row_start = src.pos;
+            write_stream_row(&ts, &tw, &row, &values);
         }
-    }
-    //Cleaning
-    uint16_t max_cells = get_max(cells_in_row, rows_count);
-    for (uint16_t i = 0; i < max_cells; i++) free(column_width[i]);
-    free(column_width);
-}
-
-uint16_t get_max_row_len(char*** table_data, uint16_t rows_count, uint16_t* cells_in_row)
-{
-    uint16_t max_row_len = 0;
-    uint16_t max_cells = get_max(cells_in_row, rows_count);
-    uint16_t** column_width = get_column_width(table_data, rows_count, cells_in_row);
-    for (uint16_t i = 0; i < max_cells; i++) {
-        uint16_t row_len = 0;
-        for (uint16_t j = 0; j <= i; j++) {
-            row_len += column_width[i][j];
+        for (uint8_t k = 0; k < footers; k++) {
+            row.cells = 0;
+            for (uint32_t j = 0; j < ts.cols_count; j++) {
+                add_cell_to_row(&row, footer_off[k * ts.cols_count + j], footer_len[k * ts.cols_count + j]);
+            }
+            row.base = footer_text.str;
+            values.len = 0;
+            write_stream_row(&ts, &tw, &row, &values);
         }
-        row_len += i;
-        if (row_len > max_row_len) max_row_len = row_len;
+        finish_table_writer(&tw);
+        if (opt->cs) {
+            print_calc_counters(ts.counters);
+            print_column_types(ts.cols, ts.cols_count);
+        }
+        free(tw.out.str);
+        ok = (ferror(file) == 0);
     }
-    //Cleaning
-    for (uint16_t i = 0; i < max_cells; i++) free(column_width[i]);
-    free(column_width);
-    return max_row_len;
+    if (tmp != NULL) fclose(tmp);
+    free(values.str);
+    free(ts.totals);
+    free(ts.cols);
+    free(ts.aligned.str);
+    free(footer_text.str);
+    free(footer_off);
+    free(footer_len);
+    free_table_row(&row);
+    free_table_layout(&ts.lt);
+    free_table_layout(&ts.numbers);
+    close_table_source(&src);
+    return ok;
 }
 
 
@@ -899,8 +4533,8 @@ double get_max_value(char** values, uint16_t values_count)
 {
     double max_value = 0;
     for (uint16_t i = 0; i < values_count; i++) {
-        if (is_num(values[i])) {
-            double vl = strtod(values[i], NULL);
+        double vl;
+        if (parse_number(values[i], strlen(values[i]), &vl, NULL)) {
             vl = (vl < 0) ? vl * (double)-1 : vl;//abs
             max_value = (max_value < vl) ? vl : max_value;
         }
@@ -908,6 +4542,22 @@ double get_max_value(char** values, uint16_t values_count)
     return max_value;
 }
 
+//the value without spaces and with the decimal point, "error" if it is not a number;
+//a value of spaces only is left empty
+static char* get_histogram_value(const char* str)
+{
+    uint32_t len = strlen(str);
+    char* value = calloc(len + 6, sizeof(char));
+    is_memory_allocated(value);
+    uint32_t value_len = 0;
+    for (uint32_t i = 0; i < len; i++) {
+        if (str[i] != ' ') value[value_len++] = (str[i] == ',') ? '.' : str[i];
+    }
+    double v;
+    if (len == 0 || (value_len > 0 && !parse_number(value, value_len, &v, NULL))) strcpy(value, "error");
+    return value;
+}
+
 void get_histogram_data(char* str, char** names, char** values)
 {
     char** lines = split('\n', str);
@@ -921,18 +4571,7 @@ void get_histogram_data(char* str, char** names, char** values)
             char** t = split('|', lines[i]);
             name = strdup(t[0]);
             is_memory_allocated(name);
-
-            value = strdup(t[1]);
-            is_memory_allocated(value);
-
-            if (strcmp(value, " ") != 0) value = rm_spaces_from_str(value);
-            change_symbols(',', '.', value);
-            if (is_num(value) == 0) {
-                free(value);
-                value = calloc(6, sizeof(char));
-                is_memory_allocated(value);
-                strcpy(value, "error");
-            }
+            value = get_histogram_value(t[1]);
             
             for (uint16_t j = 0; j < t_count; j++) free(t[j]);
             free(t);
@@ -940,22 +4579,10 @@ void get_histogram_data(char* str, char** names, char** values)
             name = calloc(2, sizeof(char));
             is_memory_allocated(name);
             strcpy(name, " ");
-
-            change_symbols(',', '.', lines[i]);
-
-            if (is_num(lines[i])) {
-                value = calloc(strlen(lines[i]) + 1, sizeof(char));
-                is_memory_allocated(value);
-                strcpy(value, lines[i]);
-            } else {
-                value = calloc(6, sizeof(char));
-                is_memory_allocated(value);
-                strcpy(value, "error");
-            }
+            value = get_histogram_value(lines[i]);
         }
 
         if (strcmp(name, " ") != 0) name = rm_spaces_start_end(name);
-        value = rm_spaces_from_str(value);
         names[i] = calloc(strlen(name) + 1, sizeof(char));
         is_memory_allocated(names[i]);
         values[i] = calloc(strlen(value) + 1, sizeof(char));
@@ -967,4 +4594,541 @@ void get_histogram_data(char* str, char** names, char** values)
         free(lines[i]);
     }
     free(lines);
-}
\ No newline at end of file
+}
+
+//Samples are numbers separated by spaces or line breaks in the tag text or in a
+//mmap'd file (src=file). They are read in one pass and given to the function one
+//by one, the number of values that are not numbers is returned.
+typedef void (*sample_function)(void* arg, double value);
+
+static uint64_t add_samples(const char* data, uint64_t size, sample_function f, void* arg)
+{
+    uint64_t skipped = 0;
+    uint64_t i = 0;
+    while (i < size) {
+        while (i < size && isspace((unsigned char)data[i])) i++;
+        uint64_t start = i;
+        while (i < size && !isspace((unsigned char)data[i])) i++;
+        if (i == start) break;
+        double value;
+        if (i - start < UINT32_MAX && parse_number(&data[start], i - start, &value, NULL)) f(arg, value);
+        else skipped++;
+    }
+    return skipped;
+}
+
+static uint64_t read_samples(char* str, char** attrs, sample_function f, void* arg)
+{
+    char* filename = get_attr_value(attrs, "src");
+    if (filename == NULL) return add_samples(str, strlen(str), f, arg);
+    uint64_t skipped = 0;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {print_file_error(filename); return 0;}
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        char* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            print_file_error(filename);
+        } else {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            skipped = add_samples(map, st.st_size, f, arg);
+            munmap(map, st.st_size);
+        }
+    }
+    close(fd);
+    return skipped;
+}
+
+//Histograms of raw samples (samples or src=file) keep only the counts of the bins:
+//the bin k covers [(first + k) * width, (first + k + 1) * width). A sample out of
+//bins=N bins doubles the width and merges pairs of bins. The width starts from width=W or from the first two different
+//samples. With log the bins are octaves [2^k, 2^(k+1)) merged the same way.
+#define DEFAULT_HISTOGRAM_BINS 10
+#define MAX_HISTOGRAM_BINS 1000
+
+typedef struct sample_bins {
+    uint64_t* counts;
+    uint32_t  size;        //max number of bins
+    uint32_t  used;        //bins from the first one to the last not empty one
+    int64_t   first;       //index of the first bin
+    double    width;       //0 - not known yet, all samples are equal to value
+    double    value;
+    uint64_t  count;       //samples in the bins
+    uint64_t  skipped;     //not numbers, not positive numbers with log
+    uint8_t   log;
+} sample_bins;
+
+static const char* sample_attrs[] = {"samples", "src", "bins", "width", "log", NULL};
+
+//the attribute belongs to histograms of samples
+static uint8_t is_sample_attr(const char* attr)
+{
+    for (uint8_t i = 0; sample_attrs[i] != NULL; i++) {
+        uint32_t len = strlen(sample_attrs[i]);
+        if (strncmp(attr, sample_attrs[i], len) == 0 && (attr[len] == '\0' || attr[len] == '=')) return 1;
+    }
+    return 0;
+}
+
+uint8_t is_sample_histogram(char** attrs)
+{
+    for (uint16_t i = 0; attrs != NULL && attrs[i] != NULL; i++) {
+        if (is_sample_attr(attrs[i])) return 1;
+    }
+    return 0;
+}
+
+//symbol of the bars: the first attribute which is not an attribute of samples
+char get_histogram_sym(char** attrs)
+{
+    for (uint16_t i = 0; attrs != NULL && attrs[i] != NULL; i++) {
+        if (!is_sample_attr(attrs[i])) return attrs[i][0];
+    }
+    return '#';
+}
+
+static int64_t floor_half(int64_t index)
+{
+    return (index >= 0) ? index / 2 : -((1 - index) / 2);
+}
+
+//the width is doubled, the bin k goes into the bin (first + k) / 2
+static void merge_sample_bins(sample_bins* sb)
+{
+    int64_t first = floor_half(sb->first);
+    for (uint32_t k = 0; k < sb->used; k++) {
+        uint64_t count = sb->counts[k];
+        sb->counts[k] = 0;
+        sb->counts[floor_half(sb->first + k) - first] += count;
+    }
+    sb->used = floor_half(sb->first + sb->used - 1) - first + 1;
+    sb->first = first;
+    sb->width *= 2;
+}
+
+static int64_t get_bin_index(sample_bins* sb, double value)
+{
+    double index = floor(value / sb->width);
+    while (fabs(index) > (double)((int64_t)1 << 52) && !isinf(sb->width * 2)) {
+        merge_sample_bins(sb);
+        index = floor(value / sb->width);
+    }
+    return (int64_t)index;
+}
+
+static void add_to_sample_bins(sample_bins* sb, double value, uint64_t count)
+{
+    int64_t index = get_bin_index(sb, value);
+    if (sb->used == 0) sb->first = index;
+    for (;;) {
+        int64_t low = (index < sb->first) ? index : sb->first;
+        int64_t last = sb->first + (int64_t)sb->used - 1;
+        int64_t high = (sb->used == 0 || index > last) ? index : last;
+        if (high - low < sb->size) break;
+        if (isinf(sb->width * 2)) {
+            //no wider bins: the sample goes into the first or the last bin
+            index = (index < sb->first) ? last - sb->size + 1 : sb->first + sb->size - 1;
+            break;
+        }
+        merge_sample_bins(sb);
+        index = floor_half(index);
+    }
+    if (index < sb->first) {
+        uint32_t shift = sb->first - index;
+        memmove(&sb->counts[shift], sb->counts, sb->used * sizeof(uint64_t));
+        memset(sb->counts, 0, shift * sizeof(uint64_t));
+        sb->first = index;
+        sb->used += shift;
+    }
+    if (index - sb->first >= sb->used) sb->used = index - sb->first + 1;
+    sb->counts[index - sb->first] += count;
+    sb->count += count;
+}
+
+static void add_sample(void* arg, double value)
+{
+    sample_bins* sb = arg;
+    if (!isfinite(value) || (sb->log && value <= 0)) {
+        sb->skipped++;
+        return;
+    }
+    if (sb->log) {
+        int exp;
+        frexp(value, &exp);
+        add_to_sample_bins(sb, exp - 1, 1);
+        return;
+    }
+    if (sb->width == 0) {
+        if (sb->count == 0 || value == sb->value) {
+            sb->value = value;
+            sb->count++;
+            return;
+        }
+        //the smallest power of two at least (distance / bins) wide
+        double distance = fabs(value - sb->value);
+        if (!isfinite(distance)) distance = DBL_MAX;
+        int exp;
+        double mantissa = frexp(distance / sb->size, &exp);
+        sb->width = (mantissa == 0.5) ? ldexp(1, exp - 1) : ldexp(1, exp);
+        if (sb->width == 0) sb->width = DBL_MIN;
+        if (isinf(sb->width)) sb->width = ldexp(1, DBL_MAX_EXP - 1);
+        uint64_t count = sb->count;
+        sb->count = 0;
+        add_to_sample_bins(sb, sb->value, count);
+    }
+    add_to_sample_bins(sb, value, 1);
+}
+
+static char* get_bin_name(const sample_bins* sb, uint32_t k)
+{
+    char low[MAX_NUMBER_LEN];
+    char high[MAX_NUMBER_LEN];
+    if (sb->width == 0) {
+        format_number(sb->value, &DEFAULT_NUMBER_FORMAT, low);
+        return strdup(low);
+    }
+    double from = (double)(sb->first + k) * sb->width;
+    double to = (double)(sb->first + k + 1) * sb->width;
+    if (sb->log) {
+        from = ldexp(1, (int)from);
+        to = ldexp(1, (int)to);
+    }
+    format_number(from, &DEFAULT_NUMBER_FORMAT, low);
+    format_number(to, &DEFAULT_NUMBER_FORMAT, high);
+    char* name = calloc(strlen(low) + strlen(high) + 5, sizeof(char));
+    is_memory_allocated(name);
+    sprintf(name, "[%s, %s)", low, high);
+    return name;
+}
+
+//names are the ranges of the bins and values are the counts, returns the number of bins
+uint16_t get_sample_histogram_data(char* str, char** attrs, char*** names, char*** values)
+{
+    sample_bins sb;
+    memset(&sb, 0, sizeof(sample_bins));
+    sb.log = in_str_array(attrs, "log");
+    sb.size = get_count_attr(attrs, "bins");
+    if (sb.size > MAX_HISTOGRAM_BINS) {
+        printf("  Error: more than %u bins in a histogram. Ignoring\n", MAX_HISTOGRAM_BINS);
+        sb.size = MAX_HISTOGRAM_BINS;
+    }
+    char* width = get_attr_value(attrs, "width");
+    if (width != NULL && !sb.log) {
+        if (!parse_number(width, strlen(width), &sb.width, NULL) || !isfinite(sb.width) || sb.width <= 0) {
+            printf("  Error: wrong value of the \"width\" attribute \"%s\". Ignoring\n", width);
+            sb.width = 0;
+        } else if (sb.size == 0) {
+            sb.size = MAX_HISTOGRAM_BINS;
+        }
+    }
+    if (sb.size == 0) sb.size = DEFAULT_HISTOGRAM_BINS;
+    if (sb.log) sb.width = 1;//octaves
+    sb.counts = calloc(sb.size, sizeof(uint64_t));
+    is_memory_allocated(sb.counts);
+
+    sb.skipped += read_samples(str, attrs, add_sample, &sb);
+    if (sb.skipped > 0) printf("  Error: %llu values of the histogram are not samples. Ignoring\n",
+                              (unsigned long long)sb.skipped);
+
+    uint16_t count = (sb.width == 0) ? (sb.count > 0) : sb.used;
+    *names = calloc(count + 1, sizeof(char*));
+    is_memory_allocated(*names);
+    *values = calloc(count + 1, sizeof(char*));
+    is_memory_allocated(*values);
+    for (uint16_t k = 0; k < count; k++) {
+        char value[24];
+        sprintf(value, "%llu", (unsigned long long)((sb.width == 0) ? sb.count : sb.counts[k]));
+        (*names)[k] = get_bin_name(&sb, k);
+        is_memory_allocated((*names)[k]);
+        (*values)[k] = strdup(value);
+        is_memory_allocated((*values)[k]);
+    }
+    free(sb.counts);
+    return count;
+}
+
+
+/***************************************************************************
+* functions for working with Statistics
+***************************************************************************/
+//<stats> keeps the count, the mean and the variance (Welford), min and max of the
+//samples. Quantiles are exact while the samples fit into mem=MB megabytes: they are
+//found by selection. Beyond that the samples go into a t-digest and the quantiles
+//are approximate.
+#define DEFAULT_STATS_MEM 64
+#define DIGEST_COMPRESSION 200
+#define DIGEST_BUFFER (DIGEST_COMPRESSION * 10)
+#define DIGEST_SIZE (DIGEST_COMPRESSION + 2 + DIGEST_BUFFER)//merged centroids and new samples
+#define MAX_STATS_QUANTILES 32
+
+typedef struct centroid {
+    double mean;
+    double weight;
+} centroid;
+
+typedef struct sample_stats {
+    uint64_t  count;
+    double    mean;
+    double    m2;          //sum of squared deviations from the mean
+    double    min;
+    double    max;
+    double*   values;      //all samples while they fit into max_values
+    uint64_t  values_size;
+    uint64_t  values_cap;
+    uint64_t  max_values;
+    centroid* digest;      //NULL - the quantiles are exact
+    uint32_t  digest_len;
+    uint64_t  skipped;
+} sample_stats;
+
+static int compare_centroids(const void* a, const void* b)
+{
+    double x = ((const centroid*)a)->mean;
+    double y = ((const centroid*)b)->mean;
+    return (x > y) - (x < y);
+}
+
+//the scale function k1 of the t-digest and its inverse, k is in [-compression / 4, compression / 4]
+static double get_digest_k(double q)
+{
+    return DIGEST_COMPRESSION / (2 * M_PI) * asin(2 * q - 1);
+}
+
+static double get_digest_q(double k)
+{
+    if (k >= DIGEST_COMPRESSION / 4.0) return 1;
+    return (sin(2 * M_PI * k / DIGEST_COMPRESSION) + 1) / 2;
+}
+
+//centroids are sorted and merged while they span at most 1 of k,
+//so there are at most compression + 1 of them
+static void compress_digest(sample_stats* st)
+{
+    if (st->digest_len == 0) return;
+    qsort(st->digest, st->digest_len, sizeof(centroid), compare_centroids);
+    double total = 0;
+    for (uint32_t i = 0; i < st->digest_len; i++) total += st->digest[i].weight;
+    double done = 0;//weight of the finished centroids
+    double limit = total * get_digest_q(get_digest_k(0) + 1);
+    uint32_t n = 0;
+    for (uint32_t i = 1; i < st->digest_len; i++) {
+        centroid* c = &st->digest[n];
+        centroid x = st->digest[i];
+        if (done + c->weight + x.weight <= limit) {
+            c->weight += x.weight;
+            c->mean += (x.mean - c->mean) * x.weight / c->weight;
+        } else {
+            done += c->weight;
+            limit = total * get_digest_q(get_digest_k(done / total) + 1);
+            st->digest[++n] = x;
+        }
+    }
+    st->digest_len = n + 1;
+}
+
+static void add_to_digest(sample_stats* st, double value)
+{
+    if (st->digest_len == DIGEST_SIZE) compress_digest(st);
+    st->digest[st->digest_len].mean = value;
+    st->digest[st->digest_len].weight = 1;
+    st->digest_len++;
+}
+
+//the samples don't fit into the memory any more
+static void start_digest(sample_stats* st)
+{
+    st->digest = calloc(DIGEST_SIZE, sizeof(centroid));
+    is_memory_allocated(st->digest);
+    for (uint64_t i = 0; i < st->values_size; i++) add_to_digest(st, st->values[i]);
+    free(st->values);
+    st->values = NULL;
+    st->values_size = 0;
+    st->values_cap = 0;
+}
+
+static void add_stats_sample(void* arg, double value)
+{
+    sample_stats* st = arg;
+    if (!isfinite(value)) {
+        st->skipped++;
+        return;
+    }
+    st->count++;
+    double delta = value - st->mean;
+    st->mean += delta / st->count;
+    st->m2 += delta * (value - st->mean);
+    if (st->count == 1 || value < st->min) st->min = value;
+    if (st->count == 1 || value > st->max) st->max = value;
+    if (st->digest == NULL && st->values_size == st->max_values) start_digest(st);
+    if (st->digest != NULL) {
+        add_to_digest(st, value);
+        return;
+    }
+    if (st->values_size == st->values_cap) {
+        st->values_cap = (st->values_cap == 0) ? 1024 : st->values_cap * 2;
+        if (st->values_cap > st->max_values) st->values_cap = st->max_values;
+        st->values = realloc(st->values, st->values_cap * sizeof(double));
+        is_memory_allocated(st->values);
+    }
+    st->values[st->values_size++] = value;
+}
+
+static uint64_t get_random_index(uint64_t* seed, uint64_t from, uint64_t to)
+{
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 7;
+    *seed ^= *seed << 17;
+    return from + *seed % (to - from);
+}
+
+//puts the k-th smallest value to values[k], smaller values before it and bigger ones after it
+static void select_value(double* values, uint64_t count, uint64_t k)
+{
+    uint64_t seed = 0x9E3779B97F4A7C15ULL;
+    uint64_t from = 0;
+    uint64_t to = count;
+    while (to - from > 1) {
+        //median of three random values
+        double a = values[get_random_index(&seed, from, to)];
+        double b = values[get_random_index(&seed, from, to)];
+        double c = values[get_random_index(&seed, from, to)];
+        double pivot = (a < b) ? ((b < c) ? b : (a < c) ? c : a) : ((a < c) ? a : (b < c) ? c : b);
+        //three parts: [from, lt) < pivot, [lt, gt) == pivot, [gt, to) > pivot
+        uint64_t lt = from;
+        uint64_t gt = to;
+        uint64_t i = from;
+        while (i < gt) {
+            double v = values[i];
+            if (v < pivot) {
+                values[i++] = values[lt];
+                values[lt++] = v;
+            } else if (v > pivot) {
+                values[i] = values[--gt];
+                values[gt] = v;
+            } else {
+                i++;
+            }
+        }
+        if (k < lt) to = lt;
+        else if (k >= gt) from = gt;
+        else return;
+    }
+}
+
+//the quantile q in [0, 1] with the linear interpolation between the closest ranks
+static double get_exact_quantile(sample_stats* st, double q)
+{
+    uint64_t n = st->values_size;
+    double h = (n - 1) * q;
+    uint64_t k = (uint64_t)h;
+    if (k >= n - 1) return st->max;
+    select_value(st->values, n, k);
+    double value = st->values[k];
+    if (h == k) return value;
+    double next = st->values[k + 1];
+    for (uint64_t i = k + 2; i < n; i++) next = (st->values[i] < next) ? st->values[i] : next;
+    return value + (next - value) * (h - k);
+}
+
+//the quantile q in [0, 1] between the centers of the centroids, min and max are the ends
+static double get_digest_quantile(const sample_stats* st, double q)
+{
+    const centroid* c = st->digest;
+    uint32_t n = st->digest_len;
+    double total = st->count;
+    double target = q * total;
+    if (target < c[0].weight / 2) return st->min + (c[0].mean - st->min) * target / (c[0].weight / 2);
+    if (target >= total - c[n - 1].weight / 2) {
+        return st->max - (st->max - c[n - 1].mean) * (total - target) / (c[n - 1].weight / 2);
+    }
+    double center = c[0].weight / 2;
+    for (uint32_t i = 0; i + 1 < n; i++) {
+        double next = center + (c[i].weight + c[i + 1].weight) / 2;
+        if (target < next) return c[i].mean + (c[i + 1].mean - c[i].mean) * (target - center) / (next - center);
+        center = next;
+    }
+    return st->max;
+}
+
+//percents from the q=50,90,99 attribute, returns the number of quantiles
+static uint32_t get_stats_quantiles(char** attrs, double* quantiles)
+{
+    char* value = get_attr_value(attrs, "q");
+    if (value == NULL) value = "50,90,99";
+    uint32_t count = 0;
+    uint16_t elements = get_elements_count(',', value);
+    char** q = split(',', value);
+    for (uint16_t i = 0; i < elements; i++) {
+        double percent;
+        if (parse_number(q[i], strlen(q[i]), &percent, NULL) && percent >= 0 && percent <= 100 &&
+            count < MAX_STATS_QUANTILES) {
+            quantiles[count++] = percent;
+        } else {
+            printf("  Error: wrong quantile \"%s\". Ignoring\n", q[i]);
+        }
+        free(q[i]);
+    }
+    free(q);
+    return count;
+}
+
+static void append_stats_cell(str_buf* buf, const char* str)
+{
+    if (buf->len > 0 && buf->str[buf->len - 1] != '\n') append_sym_to_buf(buf, '|', 1);
+    append_to_buf(buf, str, strlen(str));
+}
+
+static void append_stats_number(str_buf* buf, double value, uint8_t defined, const number_format* fmt)
+{
+    if (buf->len > 0 && buf->str[buf->len - 1] != '\n') append_sym_to_buf(buf, '|', 1);
+    if (defined) append_number_to_buf(buf, value, fmt);
+    else append_sym_to_buf(buf, '-', 1);
+}
+
+//text of the table with the names of the statistics and their values
+char* get_stats_table(char* str, char** attrs, const number_format* fmt)
+{
+    sample_stats st;
+    memset(&st, 0, sizeof(sample_stats));
+    uint32_t mem = get_count_attr(attrs, "mem");
+    st.max_values = (uint64_t)((mem > 0) ? mem : DEFAULT_STATS_MEM) * 1024 * 1024 / sizeof(double);
+    double quantiles[MAX_STATS_QUANTILES];
+    uint32_t quantiles_count = get_stats_quantiles(attrs, quantiles);
+    st.skipped = read_samples(str, attrs, add_stats_sample, &st);
+    if (st.skipped > 0) printf("  Error: %llu values of the statistics are not samples. Ignoring\n",
+                               (unsigned long long)st.skipped);
+    if (st.digest != NULL) compress_digest(&st);
+
+    str_buf buf = {0};
+    append_stats_cell(&buf, "count");
+    append_stats_cell(&buf, "mean");
+    append_stats_cell(&buf, "sd");
+    append_stats_cell(&buf, "min");
+    for (uint32_t i = 0; i < quantiles_count; i++) {
+        char name[MAX_NUMBER_LEN + 2];
+        strcpy(name, (st.digest != NULL) ? "~p" : "p");//approximate quantiles are marked
+        format_number(quantiles[i], &DEFAULT_NUMBER_FORMAT, &name[strlen(name)]);
+        append_stats_cell(&buf, name);
+    }
+    append_stats_cell(&buf, "max");
+    append_sym_to_buf(&buf, '\n', 1);
+
+    char count[24];
+    sprintf(count, "%llu", (unsigned long long)st.count);
+    append_stats_cell(&buf, count);
+    append_stats_number(&buf, st.mean, st.count > 0, fmt);
+    append_stats_number(&buf, sqrt(st.m2 / (st.count - 1)), st.count > 1, fmt);
+    append_stats_number(&buf, st.min, st.count > 0, fmt);
+    for (uint32_t i = 0; i < quantiles_count; i++) {
+        double value = 0;
+        if (st.count > 0) {
+            value = (st.digest != NULL) ? get_digest_quantile(&st, quantiles[i] / 100)
+                                        : get_exact_quantile(&st, quantiles[i] / 100);
+        }
+        append_stats_number(&buf, value, st.count > 0, fmt);
+    }
+    append_stats_number(&buf, st.max, st.count > 0, fmt);
+    free(st.values);
+    free(st.digest);
+    return buf.str;
+}
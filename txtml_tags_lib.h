@@ -2,14 +2,25 @@
 #ifndef TXTML_TAGS_LIB_H
 #define TXTML_TAGS_LIB_H
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE //copy_file_range
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <ctype.h>
 #include <math.h>
+#include <float.h>
 #include <time.h>
 #include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
 #include "tinyexpr.h"
 #include "txtml_tags.h"
 
@@ -21,11 +32,135 @@ void print_file_error(char* filename);
 void print_tag_error(char* tag);
 
 //files
-uint16_t get_files_count(char* dirname, char* file_extension);
+uint32_t get_files_count(char* dirname, char* file_extension);
 char** get_files_in_dir(char* dirname, char* file_extension);
 char* get_file_content(char* filename);
 void write_to_file(char* filename, char* str);
 char* change_file_extension(char* filename, char* extension);
+uint8_t copy_plain_file(char* src_filename, char* dst_filename);
+
+//include cache
+char* get_include_content(char* filename);
+void print_include_cache_stats(void);
+void free_include_cache(void);
+
+//fragments
+char* get_rendered_fragment(char* filename);
+void free_fragment_cache(void);
+
+//shared tag results
+void start_sharing_tag_results(void);
+char* get_shared_tag_result(char* tag_name, char* tag, char* content);
+void add_shared_tag_result(char* tag_name, char* tag, char* content, char* result);
+void stop_sharing_tag_results(void);
+
+//document variables
+uint32_t get_var_name_len(const char* str);
+uint8_t set_doc_var(const char* name, uint32_t len, double value);
+uint32_t get_doc_vars_count(void);
+uint32_t get_doc_vars_version(void);
+void clear_doc_vars(void);
+uint8_t define_doc_var(const char* line, double* value, int* error);
+uint8_t define_doc_func(const char* line);
+
+//expression cache
+double eval_cached_expr(const char* str, int* error);
+void print_expr_cache_stats(void);
+void free_expr_cache(void);
+
+//numbers
+typedef struct number_info {
+    uint32_t decimals;    //digits after the decimal separator
+    uint8_t  comma;       //the decimal separator is a comma
+    uint8_t  exponent;    //the number has an exponent
+} number_info;
+uint8_t parse_number(const char* str, uint32_t len, double* value, number_info* info);
+#define MAX_NUMBER_LEN 448 //"%.20f" of the biggest double with commas
+typedef struct number_format {
+    int8_t   decimals;    //digits after the decimal point (dec=N), -1 - like "%g"
+    uint8_t  shortest;    //the shortest text read back as the same number (rt)
+    uint8_t  grouping;    //commas between thousands (grp)
+} number_format;
+extern const number_format DEFAULT_NUMBER_FORMAT;
+uint8_t get_number_format(char** attrs, number_format* fmt);
+uint32_t format_number(double value, const number_format* fmt, char* out);
+
+//table options
+typedef struct table_options {
+    uint8_t   nb;          //no border
+    uint8_t   nc;          //no calculations
+    uint8_t   na;          //don't align numbers to the right
+    uint8_t   doc_width;
+    uint32_t  page;        //rows on a page, 0 - no pages
+    uint32_t  rows;        //max number of rows, 0 - all rows
+    uint32_t* cols;        //selected columns (from 0), NULL - all columns
+    uint32_t  cols_count;
+    char*     source;      //csv/tsv file, NULL - the tag text
+    char      sep;         //field separator of the file
+    uint8_t   totals;      //footer rows: 1 - sum, 2 - avg, 4 - min, 8 - max
+    uint8_t   cs;          //print the calculation counters
+    uint8_t   dp;          //align numbers at the decimal point
+    uint32_t  sort;        //column to sort the rows by (from 1), 0 - the source order
+    uint8_t   rsort;       //sort in the descending order
+    uint32_t  top;         //rows left after filtering and sorting, 0 - all rows
+    uint8_t   nh;          //no header row, the first row is filtered and sorted too
+    uint32_t  filter_col;  //column of the filter (from 1), 0 - no filter
+    uint8_t   filter_op;
+    char*     filter_value;
+    number_format num;     //format of the calculated numbers (dec=N, rt)
+} table_options;
+
+//splices
+extern const uint32_t SPLICE_THRESHOLD;
+uint32_t add_file_splice(char* filename);
+uint32_t add_table_splice(char* tbl_str, const table_options* opt);
+char* get_splice_marker(uint32_t index);
+uint8_t write_splice(FILE* file, uint32_t index);
+void write_result(FILE* file, char* str);
+void clear_splices(void);
+
+//packs
+typedef struct pack_header {
+    char     magic[8];
+    uint32_t docs_count;
+    uint32_t buckets_count;
+    uint64_t index_offset;
+    uint64_t buckets_offset;
+} pack_header;
+
+typedef struct pack_entry {
+    uint64_t name_offset;
+    uint64_t data_offset;
+    uint64_t data_len;
+    uint32_t name_len;
+    uint32_t next;//next entry with the same hash bucket
+} pack_entry;
+
+typedef struct pack {
+    char*              data;
+    uint64_t           size;
+    const pack_header* header;
+    const pack_entry*  entries;
+    const uint32_t*    buckets;
+} pack;
+
+typedef struct pack_writer {
+    FILE*       file;
+    char*       filename;
+    pack_entry* entries;
+    uint32_t*   hashes;
+    uint32_t    count;
+} pack_writer;
+
+uint8_t open_pack(char* filename, pack* pk);
+void close_pack(pack* pk);
+int64_t find_in_pack(const pack* pk, char* name);
+char* get_pack_doc_name(const pack* pk, uint32_t index);
+char* get_pack_doc(const pack* pk, uint32_t index);
+uint8_t create_pack(char* filename, pack_writer* pw);
+void add_to_pack(pack_writer* pw, char* name, char* str, uint64_t len);
+void add_result_to_pack(pack_writer* pw, char* name, char* result);
+uint8_t finish_pack(pack_writer* pw);
 
 //tags
 int8_t have_attributes(char* tag);
@@ -42,51 +177,116 @@ char* get_text_after_tag(char* str, char* tag);
 char* execute_tag(char* tag, char* tag_content);
 char* execute_nested_tags(char* str);
 char* execute_all_tags(char* str);
+extern uint16_t TAG_DEPTH;
 
 
 //strings
+typedef struct str_buf {
+    char*    str;
+    uint64_t len;
+    uint64_t size;
+} str_buf;
 uint16_t get_elements_count(char sym, char* str);
 char** split(char sym, char* str);
 char* get_str_from_sym(char sym, uint16_t count);
 void change_symbols(char from, char to, char* str);
+void escape_tag_symbols(char* str);
+void replace_service_symbols(char* str, uint64_t len);
+uint64_t get_span_without(const char* str, uint64_t len, const char* syms, uint8_t syms_count);
+void append_to_buf(str_buf* buf, const char* str, uint64_t len);
+void append_sym_to_buf(str_buf* buf, char sym, uint64_t count);
+void append_number_to_buf(str_buf* buf, double value, const number_format* fmt);
+uint32_t get_str_hash(const char* str);
 uint8_t is_num(char* str);
-uint8_t is_number(char* str);
+uint8_t is_number_len(const char* str, uint32_t len);
 uint16_t get_number_len(uint16_t number);
-char* rm_spaces_from_str(char* str);
 char* rm_spaces_start_end(char* str);
 
 //text formatting
 extern const uint8_t DEFAULT_DOC_WIDTH;
 extern uint8_t DOC_WIDTH;
+extern uint8_t START_DOC_WIDTH;
 void set_doc_width(uint8_t width);
+void set_start_doc_width(uint8_t width);
+
+//threads
+typedef void (*block_function)(void* arg, uint32_t block, uint64_t start, uint64_t end);
+extern uint16_t THREADS_COUNT;
+void set_threads_count(uint16_t count);
+uint32_t get_blocks_count(uint64_t count, uint64_t min_block);
+void run_in_blocks(uint64_t count, uint32_t blocks, block_function f, void* arg);
 
 //arrays
 uint16_t get_arr_size(char** str_arr);
 uint8_t in_str_array(char** arr, char* value);
+char* get_attr_value(char** attrs, char* name);
 uint32_t get_max_len(char** str_arr, uint32_t arr_size);
-uint16_t get_max(const uint16_t* arr, uint16_t size);
-uint16_t get_min(const uint16_t* arr, uint16_t size);
-int32_t get_index(const uint16_t* arr, uint16_t size, uint16_t value);
-uint16_t get_min_index(const uint16_t* arr, uint16_t size);
 
 //basic functions for some tags
 char* get_aligned_text(char* str, char** attrs);
 char* header(char* str, uint8_t header_type, char** attrs);
 
 //tables
-uint16_t get_rows_count(char* tbl_str);
-uint16_t* get_cells_count(char* tbl_str);
-char*** get_table_data(char* tbl_str);
-uint16_t* get_cells_len(char** row, uint16_t cells_count);
-uint16_t* get_rows_len(char*** table_data, uint16_t rows_count, const uint16_t* cells_in_row);
-char* get_table_border(const char* row1, const char* row2);
-char* add_table_border(char* table_str);
-void calc_in_table(char*** table_data, uint16_t rows_count, const uint16_t* cells_in_row);
-uint16_t** get_column_width(char*** table_data, uint16_t rows_count, uint16_t* cells_in_row);
-void align_to_columns(char*** table_data, uint16_t rows_count, uint16_t* cells_in_row, uint8_t na);
-uint16_t get_max_row_len(char*** table_data, uint16_t rows_count, uint16_t* cells_in_row);
+enum {CALC_TEXT, CALC_LITERAL, CALC_EXPRESSION};//calculation paths of the cells
+
+typedef struct table {
+    uint32_t  rows_count;
+    uint32_t  cols_count;  //max number of cells in a row
+    uint32_t* cells_in_row;
+    uint64_t* cell_off;    //column-major: cell j of row i is [j * rows_count + i]
+    uint32_t* cell_len;
+    str_buf   text;        //text of all cells
+    uint64_t  calculated[3];//number of cells by the calculation path
+} table;
+
+enum {COLUMN_EMPTY, COLUMN_INTEGER, COLUMN_DECIMAL, COLUMN_TEXT, COLUMN_MIXED};
+
+typedef struct column_info {
+    uint8_t   type;        //COLUMN_*
+    uint32_t  int_width;   //max width of numbers before the decimal point
+    uint32_t  frac_width;  //max width of the decimal point and digits after it
+} column_info;
+
+typedef struct table_layout {
+    uint32_t  cols_count;
+    uint32_t* width;       //cell widths for every number of cells in a row
+    uint32_t  row_len;     //length of a row without '\n'
+    uint8_t   nb;          //no border
+    uint8_t   na;          //don't align numbers to the right
+    uint8_t   doc_width;
+} table_layout;
+
+void get_table_options(char** attrs, table_options* opt);
+void free_table_options(table_options* opt);
+uint64_t get_table_source_size(char* tbl_str, const table_options* opt);
+void read_table(char* tbl_str, const table_options* opt, table* tbl);
+void free_table(table* tbl);
+void calc_in_table(table* tbl, const number_format* fmt);
+void print_calc_counters(const uint64_t* counters);
+void arrange_table_rows(table* tbl, const table_options* opt);
+void add_table_totals(table* tbl, const table_options* opt);
+void analyze_table_columns(const table* tbl, column_info* cols);
+void print_column_types(const column_info* cols, uint32_t cols_count);
+void align_decimal_points(table* tbl, const column_info* cols);
+void process_table(table* tbl, const table_options* opt);
+void init_table_layout(table_layout* lt, uint32_t cols_count, const table_options* opt);
+void free_table_layout(table_layout* lt);
+void measure_table_cell(table_layout* lt, uint32_t cells, uint32_t column, uint32_t len);
+void finish_table_layout(table_layout* lt);
+void append_table_row(str_buf* buf, const table_layout* lt, uint32_t cells, const char** text,
+                      const uint32_t* len, const uint8_t* right);
+void append_table_border(str_buf* buf, const table_layout* lt, uint32_t cells1, uint32_t cells2);
+char* render_table(table* tbl, const table_options* opt);
+uint8_t write_table_stream(FILE* file, char* tbl_str, const table_options* opt);
 
 //histograms
+#define MIN_HISTOGRAM_WIDTH 10 //bar width when the names and values take the whole line
 double get_max_value(char** values, uint16_t values_count);
 void get_histogram_data(char* str, char** names, char** values);
+uint8_t is_sample_histogram(char** attrs);
+char get_histogram_sym(char** attrs);
+uint16_t get_sample_histogram_data(char* str, char** attrs, char*** names, char*** values);
+
+//statistics
+char* get_stats_table(char* str, char** attrs, const number_format* fmt);
 #endif //TXTML_TAGS_LIB_H
\ No newline at end of file